@@ -14,6 +14,9 @@
 #include <stdint.h>
 #include <bitpack.h>
 
+/* Hanson Libs */
+#include <assert.h>
+
 /* Header */
 #include "decode.h"
 
@@ -56,3 +59,77 @@ Um_opcode decode_word(uint32_t word, unsigned *rA, unsigned *rB,
 
         return opcode;
 }
+
+
+/* decode_instr
+ * Purpose:
+ *      Decodes a 32-bit um instruction into a Um_instr, keeping only the
+ *      fields its opcode uses, so the instruction can be stored and run
+ *      later without being decoded again. Its handler is its own (see
+ *      decode_handler)
+ * Arguments:
+ *      (uint32_t) word - The instruction to decode
+ *      (Um_instr *) instr - Where to put the decoded instruction
+ * Notes:
+ *      - CRE for instr to be NULL
+ *      - Words with an invalid opcode (14 or 15) decode fine; it is up to
+ *        the client to fail when running them
+ */
+void decode_instr(uint32_t word, Um_instr *instr)
+{
+        assert(instr != NULL);
+
+        unsigned rA, rB, rC, load_rA;
+        uint32_t load_val;
+        Um_opcode opcode = decode_word(word, &rA, &rB, &rC, &load_rA, 
+                                       &load_val);
+
+        instr->opcode = opcode;
+        if (opcode == LV) {
+                instr->rA = load_rA;
+                instr->rB = 0;
+                instr->rC = 0;
+                instr->value = load_val;
+        } else {
+                instr->rA = rA;
+                instr->rB = rB;
+                instr->rC = rC;
+                instr->value = 0;
+        }
+        instr->handler = decode_handler(instr);
+}
+
+/* decode_handler
+ * Purpose:
+ *      Works out which of the threaded interpreter's handlers runs a decoded
+ *      instruction on its own
+ * Arguments:
+ *      (const Um_instr *) instr - The decoded instruction
+ * Returns:
+ *      (unsigned) UM_HANDLER of its opcode and the registers it uses
+ * Notes:
+ *      - CRE for instr to be NULL
+ */
+unsigned decode_handler(const Um_instr *instr)
+{
+        assert(instr != NULL);
+
+        switch (instr->opcode) {
+        case MAP:
+        case LOADP:
+                return UM_HANDLER(instr->opcode, 0, instr->rB, instr->rC);
+        case UNMAP:
+        case OUT:
+        case IN:
+                return UM_HANDLER(instr->opcode, 0, 0, instr->rC);
+        case LV:
+                return UM_HANDLER(LV, instr->rA, 0, 0);
+        case HALT:
+        case 14:
+        case 15:
+                return UM_HANDLER(instr->opcode, 0, 0, 0);
+        default:
+                return UM_HANDLER(instr->opcode, instr->rA, instr->rB,
+                                  instr->rC);
+        }
+}
\ No newline at end of file
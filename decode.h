@@ -22,8 +22,28 @@ typedef enum Um_opcode {
         NAND, HALT, MAP, UNMAP, OUT, IN, LOADP, LV
 } Um_opcode;
 
+/* An instruction with its fields already extracted. For LV, rA is the
+ * loadval register and value the 25-bit value to load; for every other
+ * opcode rA, rB and rC are the three register fields and value is unused.
+ * handler is what the threaded interpreter dispatches on (see below) */
+typedef struct Um_instr {
+        uint32_t opcode : 4;
+        uint32_t rA : 3, rB : 3, rC : 3;
+        uint32_t handler : 14;
+        uint32_t value;
+} Um_instr;
+
+/* The threaded interpreter has a handler for every opcode and choice of
+ * the registers that opcode uses (registers it doesn't use count as 0),
+ * followed by the superinstructions (fuse.h) */
+#define UM_HANDLER(opcode, a, b, c) \
+        ((opcode) * 512 + (a) * 64 + (b) * 8 + (c))
+#define UM_FIRST_FUSED_HANDLER (16 * 512)
+
 Um_opcode decode_word(uint32_t word, unsigned *rA, unsigned *rB, 
                       unsigned *rC, unsigned *load_rA, 
                       uint32_t *load_val); 
+void decode_instr(uint32_t word, Um_instr *instr);
+unsigned decode_handler(const Um_instr *instr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,205 @@
+/* fuse.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ *
+ * Finds the superinstructions listed in fuse.h, and the direct jumps, in a
+ * predecoded program and sets the handler of the instruction each one
+ * starts at
+ */
+
+/* Standard Libs */
+#include <stdbool.h>
+
+/* Hanson Libs */
+#include <assert.h>
+
+/* Header */
+#include "fuse.h"
+
+/* The longest superinstruction */
+#define MAX_FUSED 3
+
+/* The table from fuse.h, in the order it is matched in */
+typedef struct Fusion {
+        Um_fused handler;
+        unsigned length;
+        Um_opcode opcodes[MAX_FUSED];
+} Fusion;
+
+#define FUSION3(name, first, second, third) \
+        { FUSED_##name, 3, { first, second, third } },
+#define FUSION2(name, first, second) \
+        { FUSED_##name, 2, { first, second } },
+static const Fusion fusions[] = {
+        UM_FUSED_TRIPLES(FUSION3)
+        UM_FUSED_PAIRS(FUSION2)
+};
+#undef FUSION3
+#undef FUSION2
+
+static const unsigned NUM_FUSIONS = sizeof(fusions) / sizeof(fusions[0]);
+
+/* Private helper functions */
+static unsigned handler_at(const Um_instr *program, uint32_t length,
+                           uint32_t index);
+static unsigned direct_jump_at(const Um_instr *program, uint32_t length,
+                               uint32_t index);
+#ifndef NDEBUG
+static bool valid_fusion(const Fusion *fusion);
+#endif
+
+/* Fuse_program
+ * Purpose:
+ *      Sets the handler of every instruction in a predecoded program: the
+ *      superinstruction which starts there, or its own (decode_handler)
+ * Arguments:
+ *      (Um_instr *) program - The predecoded program
+ *      (uint32_t) length - How many instructions it has (not counting the
+ *                          invalid one SegMem puts at the end)
+ * Notes:
+ *      - CRE for program to be NULL, or for the table in fuse.h to have a
+ *        run with a LOADP before its end or with a HALT in it
+ */
+void Fuse_program(Um_instr *program, uint32_t length)
+{
+        assert(program != NULL);
+#ifndef NDEBUG
+        for (unsigned f = 0; f < NUM_FUSIONS; f++) {
+                assert(valid_fusion(&fusions[f]));
+        }
+#endif
+
+        for (uint32_t i = 0; i < length; i++) {
+                program[i].handler = handler_at(program, length, i);
+        }
+}
+
+/* Fuse_around
+ * Purpose:
+ *      Redoes the handlers which depend on one instruction, after it has
+ *      been changed by a store into segment 0
+ * Arguments:
+ *      (Um_instr *) program - The predecoded program
+ *      (uint32_t) length - How many instructions it has
+ *      (uint32_t) index - Which instruction changed
+ * Notes:
+ *      - CRE for program to be NULL or index to be out of bounds
+ */
+void Fuse_around(Um_instr *program, uint32_t length, uint32_t index)
+{
+        assert(program != NULL);
+        assert(index < length);
+
+        uint32_t first = index < MAX_FUSED - 1 ? 0 : index - (MAX_FUSED - 1);
+        for (uint32_t i = first; i <= index; i++) {
+                program[i].handler = handler_at(program, length, i);
+        }
+}
+
+/* handler_at
+ * Purpose:
+ *      Finds the handler for one instruction of a predecoded program
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (uint32_t) length - How many instructions it has
+ *      (uint32_t) index - Which instruction
+ * Returns:
+ *      (unsigned) the direct jump starting at index, else the first
+ *      superinstruction in the table which matches the opcodes starting at
+ *      index, else the instruction's own handler
+ */
+static unsigned handler_at(const Um_instr *program, uint32_t length,
+                           uint32_t index)
+{
+        unsigned jump = direct_jump_at(program, length, index);
+        if (jump != 0) {
+                return jump;
+        }
+
+        for (unsigned f = 0; f < NUM_FUSIONS; f++) {
+                const Fusion *fusion = &fusions[f];
+                if (length - index < fusion->length) {
+                        continue;
+                }
+
+                unsigned k = 0;
+                while (k < fusion->length &&
+                       program[index + k].opcode == fusion->opcodes[k]) {
+                        k++;
+                }
+                if (k == fusion->length) {
+                        return fusion->handler;
+                }
+        }
+
+        return decode_handler(&program[index]);
+}
+
+/* direct_jump_at
+ * Purpose:
+ *      Finds a direct jump (see fuse.h) starting at one instruction of a
+ *      predecoded program
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (uint32_t) length - How many instructions it has
+ *      (uint32_t) index - Which instruction
+ * Returns:
+ *      (unsigned) FUSED_JUMP or FUSED_LV_JUMP, or 0 if there isn't one
+ * Notes:
+ *      - The LOADP's target register must be set by the LV right before it
+ *        to a value inside the program, and must not also be its segment
+ *        register. For FUSED_JUMP, the LV before that sets the segment
+ *        register to 0
+ */
+static unsigned direct_jump_at(const Um_instr *program, uint32_t length,
+                               uint32_t index)
+{
+        /* The LV setting the target, and the LOADP, at the end of a run
+         * of count instructions */
+        for (unsigned count = 3; count >= 2; count--) {
+                if (length - index < count) {
+                        continue;
+                }
+                const Um_instr *target = &program[index + count - 2];
+                const Um_instr *loadp = &program[index + count - 1];
+                if (target->opcode != LV || loadp->opcode != LOADP ||
+                    target->rA != loadp->rC || loadp->rB == loadp->rC ||
+                    target->value >= length) {
+                        continue;
+                }
+
+                if (count == 2) {
+                        return FUSED_LV_JUMP;
+                }
+                const Um_instr *segment = &program[index];
+                if (segment->opcode == LV && segment->rA == loadp->rB &&
+                    segment->value == 0) {
+                        return FUSED_JUMP;
+                }
+        }
+        return 0;
+}
+
+/* valid_fusion
+ * Purpose:
+ *      Checks that the interpreter can run a superinstruction from the table
+ * Arguments:
+ *      (const Fusion *) fusion - The superinstruction
+ * Returns:
+ *      (bool) whether only its last opcode jumps and none of them halts
+ */
+#ifndef NDEBUG
+static bool valid_fusion(const Fusion *fusion)
+{
+        for (unsigned k = 0; k < fusion->length; k++) {
+                if (fusion->opcodes[k] == HALT ||
+                    (fusion->opcodes[k] == LOADP &&
+                     k != fusion->length - 1)) {
+                        return false;
+                }
+        }
+        return true;
+}
+#endif
@@ -0,0 +1,73 @@
+/* fuse.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ *
+ * Superinstructions: short, common runs of opcodes which the threaded
+ * interpreter runs with one handler instead of dispatching to each
+ * instruction in turn. SegMem marks the first instruction of every run in
+ * the predecoded program with the superinstruction's handler; the rest keep
+ * their own handlers, so jumping into the middle of a run still works.
+ *
+ * The table below is the configuration. The percentages are how much of
+ * everything executed each sequence was, measured with an opcode counting
+ * UM on midmark.um / sandmark.umz (the same to within 0.1%) and codex.umz.
+ * Where runs overlap the first match in the table wins, so the triples come
+ * first. A LOADP may only end a run, and HALT can't be in one.
+ *
+ * Direct jumps come before the table. They are LOADPs whose target is set
+ * by the LV just before them, which are then known to jump within the
+ * program to that LV's value. Those are checked once, when fusing, and
+ * run as a plain branch to the target. They depend on LV values and
+ * register fields as well as opcodes, so SegMem re-fuses around any store
+ * which changes an LV or a LOADP.
+ */
+
+#ifndef FUSE_H
+#define FUSE_H
+
+#include <stdint.h>
+
+#include "decode.h"
+
+/* FUSE3(name, first, second, third) */
+#define UM_FUSED_TRIPLES(FUSE3)                                   \
+        FUSE3(LV_SSTORE_LV, LV, SSTORE, LV)  /* 13.0%  4.9% */    \
+        FUSE3(LV_SLOAD_LV, LV, SLOAD, LV)    /* 11.3%  5.4% */    \
+        FUSE3(LV_LV_LOADP, LV, LV, LOADP)    /*  0.0%  1.0% */    \
+        FUSE3(NAND_ADD_LV, NAND, ADD, LV)    /*  0.2%  5.7% */
+
+/* FUSE2(name, first, second) */
+#define UM_FUSED_PAIRS(FUSE2)                                     \
+        FUSE2(SSTORE_LV, SSTORE, LV)         /* 15.5%  6.5% */    \
+        FUSE2(LV_SLOAD, LV, SLOAD)           /* 15.3%  8.9% */    \
+        FUSE2(LV_SSTORE, LV, SSTORE)         /* 14.1%  5.1% */    \
+        FUSE2(SLOAD_LV, SLOAD, LV)           /* 12.5%  7.4% */    \
+        FUSE2(ADD_LV, ADD, LV)               /*  0.6%  9.8% */    \
+        FUSE2(LV_ADD, LV, ADD)               /*  0.3%  8.6% */    \
+        FUSE2(LV_LOADP, LV, LOADP)           /*  0.6%  4.4% */    \
+        FUSE2(LV_LV, LV, LV)                 /*  4.2%  3.4% */    \
+        FUSE2(NAND_NAND, NAND, NAND)         /*  2.7%  3.6% */
+
+/* Handlers of the superinstructions, numbered after the handlers of single
+ * instructions */
+#define UM_FUSED_ENUM3(name, first, second, third) FUSED_##name,
+#define UM_FUSED_ENUM2(name, first, second) FUSED_##name,
+typedef enum Um_fused {
+        FUSED_BEFORE_FIRST = UM_FIRST_FUSED_HANDLER - 1,
+        UM_FUSED_TRIPLES(UM_FUSED_ENUM3)
+        UM_FUSED_PAIRS(UM_FUSED_ENUM2)
+        FUSED_JUMP,    /* LV, LV, LOADP setting the segment (to 0) and the
+                        * target: no checks left when run */
+        FUSED_LV_JUMP, /* LV, LOADP setting the target only: checks the
+                        * segment is 0 when run */
+        FUSED_END
+} Um_fused;
+#undef UM_FUSED_ENUM3
+#undef UM_FUSED_ENUM2
+
+void Fuse_program(Um_instr *program, uint32_t length);
+void Fuse_around(Um_instr *program, uint32_t length, uint32_t index);
+
+#endif
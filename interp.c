@@ -0,0 +1,844 @@
+/* interp.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ * 11/20/2023
+ * 
+ * The interpreter handles the fetch, decode, and execute operations of the
+ * universal machine. It is a client of the registers and memory modules, as
+ * well as the decode module. um.c runs programs with it, and programs
+ * compiled by um2c fall back to it when they can't run compiled code.
+ *
+ */
+
+/* Standard Libs */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* Header */
+#include "interp.h"
+
+/* Our Modules */
+#include "fuse.h"
+#include "io.h"
+
+/* Interpreter core. The threaded (computed goto) core is used whenever the
+ * compiler supports labels as values; build with -DUM_SWITCH_DISPATCH
+ * (make DISPATCH=switch) to fall back to the switch in execute() */
+#if defined(__GNUC__) && !defined(UM_SWITCH_DISPATCH)
+#define UM_THREADED_DISPATCH
+#endif
+
+/* The um-fast build (see the Makefile) loads and stores through the inline
+ * fast paths in segmem.h; the normal build keeps every check */
+#ifdef UM_FAST
+#define GET_WORD SegMem_get_word_fast
+#define PUT_WORD SegMem_put_word_fast
+#define NOTE_ACCESS(ip) SegMem_note_access(mem, ip)
+#else
+#define GET_WORD SegMem_get_word
+#define PUT_WORD SegMem_put_word
+#define NOTE_ACCESS(ip) ((void)0)
+#endif
+
+/* Private helper functions */
+#ifdef UM_THREADED_DISPATCH
+static bool run_threaded(SegMem_T mem, Registers_T regs, word_t *ip,
+                         bool one_block, uint64_t *instructions_p);
+#else
+static bool run_switch(SegMem_T mem, Registers_T regs, word_t *ip,
+                       bool one_block, uint64_t *instructions_p);
+#endif
+
+/* Instruction counting for measuring instructions per second. Compiled in
+ * only with -DUM_STATS (make STATS=1) so the normal hot loop pays nothing */
+#ifdef UM_STATS
+#define COUNT_INSTRUCTION() (instructions++)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+#if defined(UM_THREADED_DISPATCH) && defined(UM_STATS)
+/* Call/return prediction, measured by the threaded core with UM_STATS.
+ * UM programs call a subroutine by loading a return address into a
+ * register with LV and jumping with a LOADP of segment 0, and return with
+ * a LOADP of segment 0 to that address. The first time a LOADP runs it is
+ * guessed to be a call if an LV in the same block, shortly before it, loads
+ * an address just after it into a register the LOADP itself doesn't use.
+ * Calls push that address onto a shadow stack. Any other LOADP which jumps
+ * to an address on the stack, with only guesses above it, is from then on
+ * a return, and confirms the call which pushed the address. Guesses jumped
+ * over weren't calls after all (if/else looks the same). Returns are
+ * predicted to go to the top. The threaded core jumps to any target as
+ * cheaply as to a predicted one, so this only reports how well returns
+ * could be predicted */
+#define RETURN_STACK_DEPTH 64
+
+/* How far before a call its return address may be loaded, and how far
+ * after the call it may be */
+static const unsigned CALL_WINDOW = 32;
+static const unsigned RETURN_WINDOW = 32;
+
+/* What a LOADP of segment 0 has been taken to be */
+typedef enum Site {
+        SITE_UNSEEN = 0, SITE_GUESSED_CALL, SITE_CALL, SITE_JUMP, SITE_RETURN
+} Site;
+
+/* A return address on the shadow stack, and the call which pushed it */
+typedef struct Frame {
+        word_t address;
+        word_t call;
+} Frame;
+
+typedef struct Predictor {
+        uint8_t *sites;     /* a Site for each word of segment 0 */
+        word_t *return_to;  /* return address of each call */
+        Frame stack[RETURN_STACK_DEPTH]; /* oldest overwritten when full */
+        unsigned top;       /* pushes minus pops */
+        unsigned depth;     /* valid entries, up to RETURN_STACK_DEPTH */
+        uint64_t calls;     /* pushes, including guesses found to be jumps */
+        uint64_t returns;
+        uint64_t predicted; /* returns which went to the top of the stack */
+} Predictor;
+
+static void predictor_reset(Predictor *p, word_t length);
+static void predictor_free(Predictor *p);
+static void predict(Predictor *p, const Um_instr *program, word_t at,
+                    word_t target);
+static bool find_return(Predictor *p, word_t target);
+static Site classify(const Um_instr *program, word_t at, word_t *return_to);
+#endif
+
+/* Interp_run
+ * Purpose:
+ *      Runs the program in segment 0 of mem until it halts, or IN stops the
+ *      machine (see io.h), starting from the given instruction, with the
+ *      interpreter core chosen at build time
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (Registers_T) regs - The registers to run the program with. Holds the
+ *                           final register values when it stops
+ *      (word_t *) ip - Index in segment 0 of the first instruction to run.
+ *                      Set to the index of the HALT it halted at, or of
+ *                      the IN which stopped it (Io_stopped), which hasn't
+ *                      changed any register
+ * Returns:
+ *      (uint64_t) the number of instructions executed if built with UM_STATS,
+ *                 0 otherwise
+ * Notes:
+ *      - CRE for mem, regs or ip to be NULL
+ *      - CRE for the program to contain an invalid opcode
+ */
+uint64_t Interp_run(SegMem_T mem, Registers_T regs, word_t *ip)
+{
+        assert(mem != NULL);
+        assert(regs != NULL);
+        assert(ip != NULL);
+
+        uint64_t instructions = 0;
+#ifdef UM_THREADED_DISPATCH
+        run_threaded(mem, regs, ip, false, &instructions);
+#else
+        run_switch(mem, regs, ip, false, &instructions);
+#endif
+        return instructions;
+}
+
+/* Interp_run_block
+ * Purpose:
+ *      Runs the program in segment 0 of mem from the given instruction up
+ *      to, but not including, the next LOADP. For engines which handle the
+ *      boundaries between blocks themselves (see Jit_run_tiered)
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (Registers_T) regs - The registers to run the program with. Holds the
+ *                           register values when it stops
+ *      (word_t *) ip - Index in segment 0 of the first instruction to run.
+ *                      Set to the index of the LOADP it stopped at
+ * Returns:
+ *      (bool) true if it stopped at a LOADP, false if the program halted
+ * Notes:
+ *      - CRE for mem, regs or ip to be NULL
+ *      - CRE for the program to contain an invalid opcode
+ *      - The LOADP is left for the caller to run
+ *      - IN mustn't be able to stop the machine (see io.h), since that
+ *        would look like stopping at a LOADP
+ */
+bool Interp_run_block(SegMem_T mem, Registers_T regs, word_t *ip)
+{
+        assert(mem != NULL);
+        assert(regs != NULL);
+        assert(ip != NULL);
+
+        uint64_t instructions = 0;
+#ifdef UM_THREADED_DISPATCH
+        return !run_threaded(mem, regs, ip, true, &instructions);
+#else
+        return !run_switch(mem, regs, ip, true, &instructions);
+#endif
+}
+
+#ifndef UM_THREADED_DISPATCH
+/* run_switch
+ * Purpose:
+ *      The original interpreter core. Runs the program in mem until it halts
+ *      by fetching and decoding each instruction and handing it to execute()
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (Registers_T) regs - The registers to run the program with
+ *      (word_t *) ip - Index in segment 0 of the first instruction to run.
+ *                      Set to the index of the HALT it halted at, the IN
+ *                      which stopped the machine, or with one_block the
+ *                      LOADP it stopped at
+ *      (bool) one_block - Stop before the next LOADP
+ *      (uint64_t *) instructions_p - Incremented by the number of
+ *                                    instructions executed if built with
+ *                                    UM_STATS
+ * Returns:
+ *      (bool) true if the program halted
+ * Notes:
+ *      - Every instruction goes through the single switch in execute(), so
+ *        all of them share one hard to predict indirect jump
+ */
+static bool run_switch(SegMem_T mem, Registers_T regs, word_t *ip,
+                       bool one_block, uint64_t *instructions_p)
+{
+        uint64_t instructions = 0;
+
+        /* Point the memory's instruction pointer at ip, and keep next in
+         * step with it */
+        word_t next = *ip;
+        SegMem_load_program(mem, 0, next);
+
+        Um_opcode opcode;
+        do {
+                /* Fetch an instruction */
+                word_t instruction = SegMem_fetch_next_i(mem);
+                
+                /* Decode it */
+                unsigned rA, rB, rC, loadval_rA;
+                uint32_t loadval_value;
+                opcode = decode_word(instruction, &rA, &rB, &rC, &loadval_rA, 
+                                       &loadval_value);
+
+                if (one_block && opcode == LOADP) {
+                        *ip = next;
+                        *instructions_p += instructions;
+                        return false;
+                }
+                next++;
+
+                /* Do it. An IN which stops the machine gave the end of
+                 * input, which it gives again when run again */
+                execute(mem, regs, opcode, 
+                        rA, rB, rC, 
+                        loadval_rA, loadval_value);
+                COUNT_INSTRUCTION();
+                if (opcode == LOADP) {
+                        next = Registers_get(regs, rC);
+                } else if (opcode == IN && Io_stopped) {
+                        *ip = next - 1;
+                        *instructions_p += instructions;
+                        return false;
+                }
+        } while (opcode != HALT); 
+
+        *ip = next - 1;
+        *instructions_p += instructions;
+        return true;
+}
+#endif /* !UM_THREADED_DISPATCH */
+
+#ifdef UM_THREADED_DISPATCH
+/* Labels as values and goto * are GNU extensions */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* Lists of every handler of single instructions, for generating them and
+ * the dispatch table: M(opcode, a, b, c) for each choice of the registers
+ * the opcode uses (see UM_HANDLER) */
+#define REGS_C(M, op, a, b)                                                   \
+        M(op, a, b, 0) M(op, a, b, 1) M(op, a, b, 2) M(op, a, b, 3)           \
+        M(op, a, b, 4) M(op, a, b, 5) M(op, a, b, 6) M(op, a, b, 7)
+#define REGS_BC(M, op, a)                                                     \
+        REGS_C(M, op, a, 0) REGS_C(M, op, a, 1) REGS_C(M, op, a, 2)           \
+        REGS_C(M, op, a, 3) REGS_C(M, op, a, 4) REGS_C(M, op, a, 5)           \
+        REGS_C(M, op, a, 6) REGS_C(M, op, a, 7)
+#define REGS_ABC(M, op)                                                       \
+        REGS_BC(M, op, 0) REGS_BC(M, op, 1) REGS_BC(M, op, 2)                 \
+        REGS_BC(M, op, 3) REGS_BC(M, op, 4) REGS_BC(M, op, 5)                 \
+        REGS_BC(M, op, 6) REGS_BC(M, op, 7)
+#define REGS_A(M, op)                                                         \
+        M(op, 0, 0, 0) M(op, 1, 0, 0) M(op, 2, 0, 0) M(op, 3, 0, 0)           \
+        M(op, 4, 0, 0) M(op, 5, 0, 0) M(op, 6, 0, 0) M(op, 7, 0, 0)
+#define ALL_HANDLERS(M)                                                       \
+        REGS_ABC(M, CMOV) REGS_ABC(M, SLOAD) REGS_ABC(M, SSTORE)              \
+        REGS_ABC(M, ADD) REGS_ABC(M, MUL) REGS_ABC(M, DIV)                    \
+        REGS_ABC(M, NAND) REGS_BC(M, MAP, 0) REGS_C(M, UNMAP, 0, 0)           \
+        REGS_C(M, OUT, 0, 0) REGS_C(M, IN, 0, 0) REGS_BC(M, LOADP, 0)         \
+        REGS_A(M, LV)
+
+/* run_threaded
+ * Purpose:
+ *      Direct-threaded interpreter core. Runs the program in mem until it
+ *      halts. Every instruction in the predecoded program names its own
+ *      handler, which ends by taking the next instruction and jumping
+ *      straight to that one's handler through a table of label addresses
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (Registers_T) regs - The registers to run the program with
+ *      (word_t *) ip - Index in segment 0 of the first instruction to run.
+ *                      Set to the index of the HALT it halted at, the IN
+ *                      which stopped the machine, or with one_block the
+ *                      LOADP it stopped at
+ *      (bool) one_block - Stop before the next LOADP
+ *      (uint64_t *) instructions_p - Incremented by the number of
+ *                                    instructions executed if built with
+ *                                    UM_STATS
+ * Returns:
+ *      (bool) true if the program halted
+ * Notes:
+ *      - Same semantics as execute(), instruction for instruction
+ *      - Because every handler has its own dispatch jump, the branch
+ *        predictor gets one history per handler instead of one for all
+ *      - The registers live in a local array while the program runs, and
+ *        there is a handler for every opcode and choice of registers, so a
+ *        single instruction's registers are constant array indices
+ *      - Superinstructions (fuse.h) get a handler each too, which runs all
+ *        of their instructions (reading their register fields) before
+ *        dispatching once
+ *      - LOADPs of segment 0 to a target just loaded by an LV (direct jumps,
+ *        fuse.h) branch to it without calling SegMem or checking it again
+ *      - CRE for the program to contain an invalid opcode
+ */
+static bool run_threaded(SegMem_T mem, Registers_T regs, word_t *ip,
+                         bool one_block, uint64_t *instructions_p)
+{
+        assert(mem != NULL);
+        assert(regs != NULL);
+
+#define TABLE_ENTRY(op, a, b, c)                                              \
+        [UM_HANDLER(op, a, b, c)] = &&do_##op##_##a##_##b##_##c,
+#define FUSED_ENTRY3(name, first, second, third) [FUSED_##name] = &&do_##name,
+#define FUSED_ENTRY2(name, first, second) [FUSED_##name] = &&do_##name,
+        static void *const dispatch_table[FUSED_END] = {
+                ALL_HANDLERS(TABLE_ENTRY)
+                [UM_HANDLER(HALT, 0, 0, 0)] = &&do_halt,
+                [UM_HANDLER(14, 0, 0, 0)] = &&do_invalid,
+                [UM_HANDLER(15, 0, 0, 0)] = &&do_invalid,
+                UM_FUSED_TRIPLES(FUSED_ENTRY3)
+                UM_FUSED_PAIRS(FUSED_ENTRY2)
+                [FUSED_JUMP] = &&do_JUMP,
+                [FUSED_LV_JUMP] = &&do_LV_JUMP,
+        };
+#undef TABLE_ENTRY
+#undef FUSED_ENTRY3
+#undef FUSED_ENTRY2
+
+        uint64_t instructions = 0;
+
+        /* The registers, copied back into regs when the program halts */
+        word_t r[8];
+        for (unsigned k = 0; k < 8; k++) {
+                r[k] = Registers_get(regs, k);
+        }
+
+        /* Predecoded segment 0 and the next instruction in it to run */
+        word_t length;
+        const Um_instr *program = SegMem_program(mem, &length);
+        assert(*ip <= length);
+        const Um_instr *pc = program + *ip;
+
+        const Um_instr *i;
+        word_t seg_id, target, input;
+
+#ifdef UM_STATS
+        /* Only whole runs are worth measuring (see Predictor) */
+        Predictor predictor = { NULL, NULL, { { 0, 0 } }, 0, 0, 0, 0, 0 };
+        if (!one_block) {
+                predictor_reset(&predictor, length);
+        }
+#define PREDICT(x, target) predict(&predictor, program, (x) - program, target)
+#define PREDICTOR_RESET() predictor_reset(&predictor, length)
+#else
+#define PREDICT(x, target) ((void)0)
+#define PREDICTOR_RESET() ((void)0)
+#endif
+
+/* Take the next predecoded instruction and jump to its handler */
+#define DISPATCH()                                                            \
+        do {                                                                  \
+                COUNT_INSTRUCTION();                                          \
+                i = pc++;                                                     \
+                goto *dispatch_table[i->handler];                             \
+        } while (0)
+
+/* What each opcode does, given the instruction x and its registers a, b
+ * and c: constants in the handlers of single instructions, x's fields in
+ * the handlers of superinstructions */
+#define OP_CMOV(x, a, b, c)                                                   \
+        if (r[c] != 0) {                                                      \
+                r[a] = r[b];                                                  \
+        }
+/* Loads and stores note down where they are, in case of a guard fault */
+#define OP_SLOAD(x, a, b, c)                                                  \
+        NOTE_ACCESS((x) - program);                                           \
+        r[a] = GET_WORD(mem, r[b], r[c]);
+/* Stores into segment 0 update the predecoded program in place */
+#define OP_SSTORE(x, a, b, c)                                                 \
+        seg_id = r[a];                                                        \
+        NOTE_ACCESS((x) - program);                                           \
+        PUT_WORD(mem, seg_id, r[b], r[c]);
+#define OP_ADD(x, a, b, c)                                                    \
+        r[a] = r[b] + r[c];
+#define OP_MUL(x, a, b, c)                                                    \
+        r[a] = r[b] * r[c];
+/* don't check for div by 0 for performance */
+#define OP_DIV(x, a, b, c)                                                    \
+        r[a] = r[b] / r[c];
+#define OP_NAND(x, a, b, c)                                                   \
+        r[a] = ~(r[b] & r[c]);
+#define OP_MAP(x, a, b, c)                                                    \
+        r[b] = SegMem_map(mem, r[c]);
+#define OP_UNMAP(x, a, b, c)                                                  \
+        SegMem_unmap(mem, r[c]);
+/* URE to out a value larger than 255 */
+#define OP_OUT(x, a, b, c)                                                    \
+        Io_out(r[c]);
+/* Input is [0, 255], or all 1s at the end of input. An IN which stops
+ * the machine is left to run again */
+#define OP_IN(x, a, b, c)                                                     \
+        input = Io_in();                                                      \
+        if (Io_stopped) {                                                     \
+                pc = (x);                                                     \
+                goto do_stop;                                                 \
+        }                                                                     \
+        r[c] = input;
+#define OP_LOADP(x, a, b, c)                                                  \
+        if (one_block) {                                                      \
+                pc = (x);                                                     \
+                goto do_stop;                                                 \
+        }                                                                     \
+        target = r[c];                                                        \
+        if (r[b] == 0) {                                                      \
+                PREDICT(x, target);                                           \
+        } else {                                                              \
+                SegMem_load_program(mem, r[b], target);                       \
+                program = SegMem_program(mem, &length);                       \
+                PREDICTOR_RESET();                                            \
+        }                                                                     \
+        assert(target < length);                                              \
+        pc = program + target;
+#define OP_LV(x, a, b, c)                                                     \
+        r[a] = (x)->value;
+
+/* A handler of a single instruction */
+#define HANDLER(op, a, b, c)                                                  \
+do_##op##_##a##_##b##_##c:                                                    \
+        OP_##op(i, a, b, c)                                                   \
+        DISPATCH();
+
+/* One instruction of a superinstruction */
+#define EXEC(op, x) OP_##op(x, (x)->rA, (x)->rB, (x)->rC)
+
+/* After one instruction of a superinstruction, before the next. A store
+ * into segment 0 might have changed the instructions which follow, so
+ * those get dispatched one by one again */
+#define BETWEEN(op, x)                                                        \
+        if ((op) == SSTORE && seg_id == 0) {                                  \
+                pc = (x) + 1;                                                 \
+                DISPATCH();                                                   \
+        }                                                                     \
+        COUNT_INSTRUCTION();
+
+/* Handlers for the superinstructions. pc is moved past all of them first,
+ * so a LOADP at the end jumps as usual */
+#define FUSED_HANDLER3(name, first, second, third)                            \
+do_##name:                                                                    \
+        pc = i + 3;                                                           \
+        EXEC(first, &i[0])                                                    \
+        BETWEEN(first, &i[0]);                                                \
+        EXEC(second, &i[1])                                                   \
+        BETWEEN(second, &i[1]);                                               \
+        EXEC(third, &i[2])                                                    \
+        DISPATCH();
+#define FUSED_HANDLER2(name, first, second)                                   \
+do_##name:                                                                    \
+        pc = i + 2;                                                           \
+        EXEC(first, &i[0])                                                    \
+        BETWEEN(first, &i[0]);                                                \
+        EXEC(second, &i[1])                                                   \
+        DISPATCH();
+
+        DISPATCH();
+
+        ALL_HANDLERS(HANDLER)
+
+        UM_FUSED_TRIPLES(FUSED_HANDLER3)
+        UM_FUSED_PAIRS(FUSED_HANDLER2)
+
+/* Direct jumps (see fuse.h), whose targets were checked when fusing. A
+ * LOADP one can't do directly (of another segment, or when stopping before
+ * LOADPs) is dispatched on its own */
+do_JUMP:
+        EXEC(LV, &i[0])
+        COUNT_INSTRUCTION();
+        EXEC(LV, &i[1])
+        pc = i + 2;
+        if (!one_block) {
+                COUNT_INSTRUCTION();
+                PREDICT(&i[2], i[1].value);
+                pc = program + i[1].value;
+        }
+        DISPATCH();
+do_LV_JUMP:
+        EXEC(LV, &i[0])
+        pc = i + 1;
+        if (r[i[1].rB] == 0 && !one_block) {
+                COUNT_INSTRUCTION();
+                PREDICT(&i[1], i[0].value);
+                pc = program + i[0].value;
+        }
+        DISPATCH();
+
+do_halt:
+        for (unsigned k = 0; k < 8; k++) {
+                Registers_set(regs, k, r[k]);
+        }
+        *ip = i - program;
+        *instructions_p += instructions;
+#ifdef UM_STATS
+        if (!one_block) {
+                fprintf(stderr, "um: %llu calls pushed, %llu returns, %llu "
+                        "predicted (%.1f%%)\n",
+                        (unsigned long long)predictor.calls,
+                        (unsigned long long)predictor.returns,
+                        (unsigned long long)predictor.predicted,
+                        predictor.returns == 0 ? 0.0 :
+                        100.0 * predictor.predicted / predictor.returns);
+                predictor_free(&predictor);
+        }
+#endif
+        return true;
+do_stop:
+        for (unsigned k = 0; k < 8; k++) {
+                Registers_set(regs, k, r[k]);
+        }
+        *ip = pc - program;
+        *instructions_p += instructions;
+        return false;
+do_invalid:
+        fprintf(stderr, "Instruction opcode not valid: %u\n", i->opcode);
+        assert(false);
+        return true;
+
+#undef FUSED_HANDLER3
+#undef FUSED_HANDLER2
+#undef BETWEEN
+#undef EXEC
+#undef HANDLER
+#undef OP_CMOV
+#undef OP_SLOAD
+#undef OP_SSTORE
+#undef OP_ADD
+#undef OP_MUL
+#undef OP_DIV
+#undef OP_NAND
+#undef OP_MAP
+#undef OP_UNMAP
+#undef OP_OUT
+#undef OP_IN
+#undef OP_LOADP
+#undef OP_LV
+#undef DISPATCH
+#undef PREDICT
+#undef PREDICTOR_RESET
+}
+
+#undef REGS_C
+#undef REGS_BC
+#undef REGS_ABC
+#undef REGS_A
+#undef ALL_HANDLERS
+
+#pragma GCC diagnostic pop
+
+#ifdef UM_STATS
+/* predictor_reset
+ * Purpose:
+ *      Forgets everything a Predictor learnt, for a new program
+ * Arguments:
+ *      (Predictor *) p - The predictor
+ *      (word_t) length - How many words the new program has
+ * Notes:
+ *      - Keeps the counts
+ */
+static void predictor_reset(Predictor *p, word_t length)
+{
+        predictor_free(p);
+        p->sites = CALLOC(length + 1, sizeof(uint8_t));
+        p->return_to = CALLOC(length + 1, sizeof(word_t));
+        p->top = 0;
+        p->depth = 0;
+}
+
+/* predictor_free
+ * Purpose:
+ *      Frees what a Predictor learnt
+ * Arguments:
+ *      (Predictor *) p - The predictor
+ */
+static void predictor_free(Predictor *p)
+{
+        if (p->sites != NULL) {
+                FREE(p->sites);
+                FREE(p->return_to);
+        }
+}
+
+/* predict
+ * Purpose:
+ *      Learns from, and predicts, one LOADP of segment 0
+ * Arguments:
+ *      (Predictor *) p - The predictor
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) at - Index of the LOADP
+ *      (word_t) target - Where it jumps to
+ * Notes:
+ *      - A call jumping straight to its own return address (a call which
+ *        was conditional and not taken) doesn't push
+ *      - A return not going to the top of the stack is a misprediction,
+ *        and pops the top frame anyway
+ */
+static void predict(Predictor *p, const Um_instr *program, word_t at,
+                    word_t target)
+{
+        if (p->sites[at] == SITE_UNSEEN) {
+                p->sites[at] = classify(program, at, &p->return_to[at]);
+        }
+
+        Site site = p->sites[at];
+        if (site == SITE_GUESSED_CALL || site == SITE_CALL) {
+                if (target != p->return_to[at]) {
+                        Frame *frame = &p->stack[p->top++ % RETURN_STACK_DEPTH];
+                        frame->address = p->return_to[at];
+                        frame->call = at;
+                        if (p->depth < RETURN_STACK_DEPTH) {
+                                p->depth++;
+                        }
+                        p->calls++;
+                }
+                return;
+        }
+
+        bool found = find_return(p, target);
+        if (found) {
+                p->sites[at] = SITE_RETURN;
+        }
+        if (p->sites[at] != SITE_RETURN) {
+                return;
+        }
+
+        p->returns++;
+        if (found) {
+                p->predicted++;
+        } else if (p->depth > 0) {
+                p->top--;
+                p->depth--;
+        }
+}
+
+/* find_return
+ * Purpose:
+ *      Looks for a return address on the shadow stack, skipping guessed
+ *      calls, and pops down to it if it is there
+ * Arguments:
+ *      (Predictor *) p - The predictor
+ *      (word_t) target - Where a LOADP jumps to
+ * Returns:
+ *      (bool) whether target was the return address of the top frame
+ *      after the guessed calls
+ * Notes:
+ *      - Confirms the call which pushed target, and turns the guessed
+ *        calls above it into jumps
+ */
+static bool find_return(Predictor *p, word_t target)
+{
+        unsigned k = 0;
+        while (k < p->depth) {
+                Frame *frame = &p->stack[(p->top - 1 - k) % RETURN_STACK_DEPTH];
+                if (frame->address == target) {
+                        break;
+                }
+                if (p->sites[frame->call] != SITE_GUESSED_CALL) {
+                        return false;
+                }
+                k++;
+        }
+        if (k == p->depth) {
+                return false;
+        }
+
+        for (unsigned j = 0; j <= k; j++) {
+                Frame *frame = &p->stack[--p->top % RETURN_STACK_DEPTH];
+                p->sites[frame->call] = j == k ? SITE_CALL : SITE_JUMP;
+        }
+        p->depth -= k + 1;
+        return true;
+}
+
+/* classify
+ * Purpose:
+ *      Works out whether a LOADP is a call, by looking back through its
+ *      block for an LV of a return address
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) at - Index of the LOADP
+ *      (word_t *) return_to - Set to the return address of a call
+ * Returns:
+ *      (Site) SITE_GUESSED_CALL, or SITE_JUMP if it doesn't look like one
+ * Notes:
+ *      - With more than one candidate, the closest return address wins
+ */
+static Site classify(const Um_instr *program, word_t at, word_t *return_to)
+{
+        const Um_instr *loadp = &program[at];
+        unsigned written = 0;   /* registers set later in the block */
+        word_t best = 0;
+
+        for (word_t k = at; k > 0 && at - k < CALL_WINDOW; k--) {
+                const Um_instr *instr = &program[k - 1];
+                int reg;
+                switch (instr->opcode) {
+                case MAP:
+                        reg = instr->rB;
+                        break;
+                case IN:
+                        reg = instr->rC;
+                        break;
+                case SSTORE: case HALT: case UNMAP: case OUT:
+                        reg = -1;
+                        break;
+                case LOADP:
+                        /* The end of the previous block */
+                        k = 1;
+                        reg = -1;
+                        break;
+                default:
+                        reg = instr->rA;
+                }
+                if (reg < 0 || (written & (1u << reg)) != 0) {
+                        continue;
+                }
+                written |= 1u << reg;
+
+                word_t value = instr->value;
+                if (instr->opcode == LV && (unsigned)reg != loadp->rB &&
+                    (unsigned)reg != loadp->rC && value > at &&
+                    value - at <= RETURN_WINDOW &&
+                    (best == 0 || value < best)) {
+                        best = value;
+                }
+        }
+
+        *return_to = best;
+        return best != 0 ? SITE_GUESSED_CALL : SITE_JUMP;
+}
+#endif /* UM_STATS */
+#endif /* UM_THREADED_DISPATCH */
+
+/* execute
+ * Purpose:
+ *      Execute the UM instruction passed in with given parameters on the 
+ *      memory and registers passed in
+ * Arguments: 
+ *      (SegMem_T) mem - The memory to perform operations on
+ *      (Registers_T) regs - The registers to perform operations on
+ *      (Um_opcode) opcode - The code of the operation to perform
+ *      (unsigned) rA - Which register is register A for 3 register instructions
+ *      (unsigned) rB - Which register is register B for 3 register instructions
+ *      (unsigned) rC - Which register is register C for 3 register instructions
+ *      (unsigned) loadval_rA - Which register is register A for a loadval
+ *                              instruction
+ *      (unsigned) load_value - If the instruction is loadval, what value to
+ *                              load
+ * Notes: 
+ *      - CRE for mem or regs to be NULL
+ */
+void execute(SegMem_T mem, Registers_T regs, Um_opcode opcode, 
+             unsigned rA, unsigned rB, unsigned rC, 
+             unsigned loadval_rA, unsigned loadval_value)
+{
+        assert(mem != NULL); 
+        assert(regs != NULL); 
+
+        /* Get the values of the registers we care about for 3-register 
+         * instructions */
+        word_t rA_val = Registers_get(regs, rA);
+        word_t rB_val = Registers_get(regs, rB);
+        word_t rC_val = Registers_get(regs, rC);
+        
+        /* Performs the operation based on the opcode */
+        word_t word, seg_id;
+        switch (opcode) {
+        case CMOV:
+                if (rC_val != 0) {
+                        Registers_set(regs, rA, rB_val);
+                }
+                break; 
+        case SLOAD:
+                word = SegMem_get_word(mem, rB_val, rC_val); 
+                Registers_set(regs, rA, word);
+                break; 
+        case SSTORE:
+                SegMem_put_word(mem, rA_val, rB_val, rC_val);
+                break; 
+        case ADD:
+                Registers_set(regs, rA, rB_val + rC_val);
+                break; 
+        case MUL:
+                Registers_set(regs, rA, rB_val * rC_val);
+                break; 
+        case DIV:
+                /* don't check for div by 0 for performance */
+                Registers_set(regs, rA, rB_val / rC_val); 
+                break; 
+        case NAND:
+                Registers_set(regs, rA, ~(rB_val & rC_val)); 
+                break; 
+        case HALT: 
+                /* do nothing, let loop end */
+                break; 
+        case MAP:
+                seg_id = SegMem_map(mem, rC_val);
+                Registers_set(regs, rB, seg_id);
+                break; 
+        case UNMAP:
+                SegMem_unmap(mem, rC_val);
+                break; 
+        case OUT:
+                /* URE to out a value larger than 255 */
+                Io_out(rC_val);
+                break; 
+        case IN:
+                /* Input is [0, 255], or all 1s at the end of input */
+                Registers_set(regs, rC, Io_in());
+                break; 
+        case LOADP:
+                SegMem_load_program(mem, rB_val, rC_val);
+                break; 
+        case LV:
+                Registers_set(regs, loadval_rA, loadval_value);
+                break;
+        default:
+                fprintf(stderr, "Instruction opcode not valid: %u\n", opcode);
+                assert(false);
+        }
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+/* interp.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ * 
+ * Exports the universal machine interpreter, which runs the program in a
+ * SegMem_T on a Registers_T until it halts (or IN stops it, see io.h), or
+ * one block at a time for engines which take over at LOADPs (see
+ * Jit_run_tiered)
+ * 
+ */
+
+#ifndef INTERP_H
+#define INTERP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "segmem.h"
+#include "registers.h"
+#include "decode.h"
+
+uint64_t Interp_run(SegMem_T mem, Registers_T regs, word_t *ip);
+bool Interp_run_block(SegMem_T mem, Registers_T regs, word_t *ip);
+void execute(SegMem_T mem, Registers_T regs, Um_opcode opcode, 
+             unsigned rA, unsigned rB, unsigned rC,
+             unsigned loadval_rA, unsigned loadval_value);
+
+#endif
\ No newline at end of file
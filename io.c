@@ -0,0 +1,356 @@
+/* io.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * The machine's console (see io.h)
+ */
+
+/* Header */
+#include "io.h"
+
+/* C Std Libs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/* POSIX */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* How big a mapped output file starts out. It doubles whenever it fills,
+ * and is cut down to what was written by Io_close */
+static const size_t OUTPUT_MAP_BYTES = 1 << 20;
+
+/* The buffers of stdout and stdin, used unless a file is mapped instead */
+static unsigned char output_buffer[IO_BUFFER_BYTES];
+static unsigned char input_buffer[IO_BUFFER_BYTES];
+
+unsigned char *Io_buffer = output_buffer;
+size_t Io_buffered = 0;
+size_t Io_capacity = IO_BUFFER_BYTES;
+bool Io_interactive = false;
+
+/* Input read but not yet given to IN: from Io_input_next to Io_input_end */
+const unsigned char *Io_input = input_buffer;
+size_t Io_input_next = 0;
+size_t Io_input_end = 0;
+
+bool Io_stop_at_end = false;
+volatile sig_atomic_t Io_stop_requested = 0;
+bool Io_stopped = false;
+
+/* Where output is written and input read. A mapped file is written through
+ * Io_buffer, which is its mapping, and a mapped input has been read
+ * entirely once Io_input is used up */
+static int output_fd = STDOUT_FILENO;
+static bool output_mapped = false;
+static int input_fd = STDIN_FILENO;
+static bool input_mapped = false;
+
+static uint32_t end_of_input(void);
+static void grow_output(void);
+static void write_buffer(void);
+static void output_failed(void);
+
+/* Io_set_mode
+ * Purpose:
+ *      Sets how often output is written (see io.h), and makes sure what is
+ *      left is written (Io_close) when the process exits
+ * Arguments:
+ *      (Io_mode) mode - The mode. IO_AUTO picks interactive mode when the
+ *                       output is a terminal, and throughput mode otherwise
+ * Notes:
+ *      - Call after Io_open_output, if at all, so IO_AUTO sees the file
+ */
+void Io_set_mode(Io_mode mode)
+{
+        static bool closed_at_exit = false;
+        if (!closed_at_exit) {
+                atexit(Io_close);
+                closed_at_exit = true;
+        }
+
+        if (mode == IO_AUTO) {
+                mode = isatty(output_fd) ? IO_INTERACTIVE : IO_THROUGHPUT;
+        }
+        Io_interactive = (mode == IO_INTERACTIVE);
+}
+
+/* Io_open_input
+ * Purpose:
+ *      Makes IN read from a file instead of stdin. A regular file is
+ *      mmapped, and IN takes its bytes straight from the mapping
+ * Arguments:
+ *      (const char *) path - The file
+ * Returns:
+ *      (bool) false if it can't be opened, true otherwise
+ * Notes:
+ *      - Anything but a regular file (a fifo, say) is read like stdin
+ *      - Only to be called before anything is input
+ */
+bool Io_open_input(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+                void *map = MAP_FAILED;
+                if (info.st_size > 0) {
+                        map = mmap(NULL, info.st_size, PROT_READ,
+                                   MAP_PRIVATE, fd, 0);
+                }
+                if (info.st_size == 0 || map != MAP_FAILED) {
+                        if (map != MAP_FAILED) {
+                                madvise(map, info.st_size, MADV_SEQUENTIAL);
+                                Io_input = map;
+                        }
+                        Io_input_next = 0;
+                        Io_input_end = info.st_size;
+                        input_mapped = true;
+                        close(fd);
+                        return true;
+                }
+        }
+
+        input_fd = fd;
+        return true;
+}
+
+/* Io_open_output
+ * Purpose:
+ *      Makes OUT write to a file instead of stdout, truncating it first. A
+ *      regular file is mmapped and OUT stores straight into the mapping,
+ *      which grows as it fills
+ * Arguments:
+ *      (const char *) path - The file
+ * Returns:
+ *      (bool) false if it can't be opened, true otherwise
+ * Notes:
+ *      - Anything but a regular file (/dev/null, a fifo) is written like
+ *        stdout
+ *      - Only to be called before anything is output
+ */
+bool Io_open_output(const char *path)
+{
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+                return false;
+        }
+        output_fd = fd;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+            ftruncate(fd, OUTPUT_MAP_BYTES) != 0) {
+                return true;
+        }
+        void *map = mmap(NULL, OUTPUT_MAP_BYTES, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                if (ftruncate(fd, 0) != 0) {
+                        output_failed();
+                }
+                return true;
+        }
+        Io_buffer = map;
+        Io_capacity = OUTPUT_MAP_BYTES;
+        output_mapped = true;
+        return true;
+}
+
+/* Io_flush
+ * Purpose:
+ *      Writes the output buffered so far: to stdout (or the file given to
+ *      Io_open_output) with write(), unless the output file is mapped, in
+ *      which case the bytes are in it already and the mapping is only grown
+ *      when full
+ * Notes:
+ *      - Output which can't be written to stdout (it was closed, say) is
+ *        thrown away, as printf would have done
+ *      - Exits with EXIT_FAILURE if a mapped output file can't be grown
+ */
+void Io_flush(void)
+{
+        if (output_mapped) {
+                if (Io_buffered == Io_capacity) {
+                        grow_output();
+                }
+                return;
+        }
+        write_buffer();
+}
+
+/* Io_flush_at_fault
+ * Purpose:
+ *      Writes the output so far when the machine fails in a way which
+ *      skips Io_close (a guard fault, which leaves with _exit): the buffer
+ *      to stdout, or a mapped output file cut to the bytes output
+ * Notes:
+ *      - Only calls write() and ftruncate(), so it can be called from a
+ *        signal handler
+ *      - Nothing is to be output after it
+ */
+void Io_flush_at_fault(void)
+{
+        if (output_mapped) {
+                /* There is nothing more to be done if this fails */
+                int cut = ftruncate(output_fd, Io_buffered);
+                (void)cut;
+                return;
+        }
+        write_buffer();
+}
+
+/* write_buffer
+ * Purpose:
+ *      Writes the buffered output to stdout (or the file given to
+ *      Io_open_output) with write(), and empties the buffer
+ * Notes:
+ *      - Output which can't be written is thrown away
+ */
+static void write_buffer(void)
+{
+        size_t written = 0;
+        while (written < Io_buffered) {
+                ssize_t n = write(output_fd, Io_buffer + written,
+                                  Io_buffered - written);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                written += n;
+        }
+        Io_buffered = 0;
+}
+
+/* Io_close
+ * Purpose:
+ *      Writes what is left of the output, cuts a mapped output file down to
+ *      the bytes output, and closes the files given to Io_open_input and
+ *      Io_open_output
+ * Notes:
+ *      - Called at exit once Io_set_mode has been. IN and OUT go back to
+ *        stdin and stdout
+ */
+void Io_close(void)
+{
+        if (output_mapped) {
+                munmap(Io_buffer, Io_capacity);
+                if (ftruncate(output_fd, Io_buffered) != 0) {
+                        output_failed();
+                }
+                output_mapped = false;
+        } else {
+                Io_flush();
+        }
+        if (output_fd != STDOUT_FILENO) {
+                close(output_fd);
+                output_fd = STDOUT_FILENO;
+        }
+        Io_buffer = output_buffer;
+        Io_buffered = 0;
+        Io_capacity = IO_BUFFER_BYTES;
+
+        if (Io_input != input_buffer) {
+                munmap((void *)Io_input, Io_input_end);
+        }
+        if (input_fd != STDIN_FILENO) {
+                close(input_fd);
+        }
+        input_mapped = false;
+        input_fd = STDIN_FILENO;
+        Io_input = input_buffer;
+        Io_input_next = 0;
+        Io_input_end = 0;
+}
+
+/* Io_refill
+ * Purpose:
+ *      Inputs a byte (IN) when none are left from the last read: writes
+ *      the output so far, so a prompt shows, then reads as much input as
+ *      there is
+ * Returns:
+ *      (uint32_t) the first byte read, or IO_END_OF_INPUT if there is no
+ *      more input (or it can't be read) or IN stops the machine
+ * Notes:
+ *      - Asking again after the end of input reads again, so a terminal
+ *        can go on after ^D. A mapped input file stays at its end
+ *      - Doesn't read at all once a stop has been requested, and a signal
+ *        which requests one while it waits ends the wait
+ */
+uint32_t Io_refill(void)
+{
+        Io_flush();
+        if (input_mapped || Io_stop_requested) {
+                return end_of_input();
+        }
+
+        ssize_t n;
+        do {
+                n = read(input_fd, input_buffer, IO_BUFFER_BYTES);
+        } while (n < 0 && errno == EINTR && !Io_stop_requested);
+
+        Io_input_next = 0;
+        Io_input_end = n > 0 ? n : 0;
+        if (Io_input_end == 0) {
+                return end_of_input();
+        }
+        return Io_input[Io_input_next++];
+}
+
+/* end_of_input
+ * Purpose:
+ *      Runs out of input, stopping the machine if it should stop there
+ * Returns:
+ *      (uint32_t) IO_END_OF_INPUT
+ */
+static uint32_t end_of_input(void)
+{
+        if (Io_stop_at_end || Io_stop_requested) {
+                Io_stopped = true;
+        }
+        return IO_END_OF_INPUT;
+}
+
+/* grow_output
+ * Purpose:
+ *      Doubles a full mapped output file, and maps it again
+ * Notes:
+ *      - Exits with EXIT_FAILURE if it can't
+ */
+static void grow_output(void)
+{
+        size_t capacity = 2 * Io_capacity;
+        munmap(Io_buffer, Io_capacity);
+        if (ftruncate(output_fd, capacity) != 0) {
+                output_failed();
+        }
+        void *map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         output_fd, 0);
+        if (map == MAP_FAILED) {
+                output_failed();
+        }
+        Io_buffer = map;
+        Io_capacity = capacity;
+}
+
+/* output_failed
+ * Purpose:
+ *      Reports that the output file couldn't be grown or cut to size, and
+ *      exits with EXIT_FAILURE
+ * Notes:
+ *      - Exits with _exit, since it may be called by Io_close at exit
+ */
+static void output_failed(void)
+{
+        fprintf(stderr, "um: can't write the output file\n");
+        _exit(EXIT_FAILURE);
+}
@@ -0,0 +1,116 @@
+/* io.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * The machine's console: what OUT writes and IN reads, for every engine
+ * (the interpreter, the JIT and programs compiled by um2c).
+ *
+ * OUT puts its byte in a buffer of IO_BUFFER_BYTES, which is written to
+ * stdout when it fills, before IN waits for input, and at HALT (by whoever
+ * ran the program calling Io_flush, and at exit once Io_set_mode has been
+ * called, and by SegMem when a guard fault ends the run). In interactive
+ * mode it is written after every newline too, so a program talking to
+ * someone at a terminal shows each line as soon as it is done. In
+ * throughput mode it isn't, so batch runs write in big chunks.
+ *
+ * IN takes its byte from a buffer of the same size, refilled from stdin
+ * with one read() of as much as there is (a line, at a terminal). At the
+ * end of input it gives IO_END_OF_INPUT, every time it is asked.
+ *
+ * Input and output can be files instead (um --in FILE --out FILE). Regular
+ * files are mmapped: IN reads straight from the input's mapping, and OUT
+ * stores straight into the output's, which doubles whenever it fills and is
+ * cut to size at exit. There is no buffer to write, so output only reaches
+ * the file's mapping, which the kernel writes back when it likes.
+ *
+ * IN can also stop the machine, so it can be snapshotted (see snapshot.h)
+ * while it waits for input: with Io_stop_at_end set, the end of input stops
+ * it instead of giving IO_END_OF_INPUT, and once Io_stop_requested is set
+ * (by a signal handler) the next IN which has to wait for input stops it.
+ * Either way Io_in gives IO_END_OF_INPUT without reading anything, and sets
+ * Io_stopped, and the interpreter stops before that IN so it runs again
+ * when the machine is resumed
+ */
+
+#ifndef IO_H
+#define IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <signal.h>
+
+/* How often output is written */
+typedef enum Io_mode {
+        IO_AUTO,                /* interactive if stdout is a terminal */
+        IO_THROUGHPUT,          /* when full, before IN waits, and at HALT */
+        IO_INTERACTIVE          /* after every newline too */
+} Io_mode;
+
+/* How many bytes of output are kept before they are written, and of
+ * input read at once */
+#define IO_BUFFER_BYTES 65536
+
+/* What IN gives at the end of input: every bit 1 */
+#define IO_END_OF_INPUT UINT32_MAX
+
+void Io_set_mode(Io_mode mode);
+bool Io_open_input(const char *path);
+bool Io_open_output(const char *path);
+void Io_flush(void);
+void Io_close(void);
+void Io_flush_at_fault(void);
+uint32_t Io_refill(void);
+
+/* Whether, and why, IN stops the machine (see above) */
+extern bool Io_stop_at_end;
+extern volatile sig_atomic_t Io_stop_requested;
+extern bool Io_stopped;
+
+/* The buffers (or mappings), for the inline Io_out and Io_in. Nothing else
+ * should use them */
+extern unsigned char *Io_buffer;
+extern size_t Io_buffered;
+extern size_t Io_capacity;
+extern bool Io_interactive;
+extern const unsigned char *Io_input;
+extern size_t Io_input_next;
+extern size_t Io_input_end;
+
+/* Io_out
+ * Purpose:
+ *      Outputs a byte (OUT)
+ * Arguments:
+ *      (uint32_t) c - The byte
+ * Notes:
+ *      - URE for c to be more than 255; only its low byte is output
+ */
+static inline void Io_out(uint32_t c)
+{
+        Io_buffer[Io_buffered++] = (unsigned char)c;
+        if (Io_buffered == Io_capacity ||
+            (Io_interactive && (unsigned char)c == '\n')) {
+                Io_flush();
+        }
+}
+
+/* Io_in
+ * Purpose:
+ *      Inputs a byte (IN)
+ * Returns:
+ *      (uint32_t) the byte, from 0 to 255, or IO_END_OF_INPUT
+ * Notes:
+ *      - Only calls Io_refill (which writes the output so far, then waits
+ *        for more input) once the bytes already read are used up
+ */
+static inline uint32_t Io_in(void)
+{
+        if (Io_input_next < Io_input_end) {
+                return Io_input[Io_input_next++];
+        }
+        return Io_refill();
+}
+
+#endif
@@ -0,0 +1,1319 @@
+/* jit.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ *
+ * Implements a just-in-time compiler for the universal machine. Straight-line
+ * runs of segment 0 (blocks) are translated into x86-64 machine code the
+ * first time they're jumped to, and the translation is run from then on.
+ *
+ * A block ends at LOADP, HALT, IN, an invalid instruction, or after
+ * MAX_BLOCK_LENGTH instructions. While translated code runs, the eight UM
+ * registers live in host registers. Arithmetic is done inline; memory
+ * instructions and I/O call back into C, which uses SegMem_T exactly like
+ * um.c does.
+ *
+ * LOADP of segment 0 and falling off the end of a block look the target up
+ * in a table of translated blocks without leaving machine code. Everything
+ * else (untranslated targets, loads of other segments, HALT) returns to the
+ * C loop in Jit_run.
+ *
+ * Translations are thrown away when a store hits a word of segment 0 which
+ * has been translated, when a LOADP replaces segment 0, and when the code
+ * buffer fills up.
+ *
+ * Jit_run_tiered starts by interpreting instead, one block (up to the next
+ * LOADP) at a time, and counts how often each block is jumped to. Blocks
+ * jumped to TIER_THRESHOLD times are handed to a compiler thread, so
+ * translating them happens on another core while the interpreter carries
+ * on. The main thread runs a block's translation from the next time it gets
+ * to the block once the translation is ready.
+ */
+
+/* Header */
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+/* C Std Libs */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* System Libs */
+#include <sys/mman.h>
+#include <pthread.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* Our Modules */
+#include "interp.h"
+#include "io.h"
+
+const bool Jit_supported = true;
+
+/* Bytes of memory set aside for translated code. When it fills up every
+ * translation is thrown away and blocks are translated again as needed */
+static const size_t CODE_BUFFER_SIZE = 64 << 20;
+
+/* Longest run of instructions translated as one block */
+static const unsigned MAX_BLOCK_LENGTH = 256;
+
+/* Upper bound on the bytes of machine code one instruction turns into,
+ * including the code ending a block */
+static const unsigned MAX_INSTR_BYTES = 128;
+
+/* Times Jit_run_tiered interprets a block before having it translated */
+static const uint32_t TIER_THRESHOLD = 64;
+
+/* Why translated code gave control back to Jit_run */
+typedef enum Exit_reason {
+        EXIT_CONTINUE = 0, /* carry on at next_ip */
+        EXIT_LOADP,        /* load segment aux as the program, go to next_ip */
+        EXIT_HALT,         /* stop */
+        EXIT_INVALID       /* the instruction at next_ip is invalid */
+} Exit_reason;
+
+/* x86-64 register numbers, as encoded in instructions */
+enum Host_reg {
+        RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* Which host register holds each UM register in translated code. The first
+ * six are callee-saved; r8 and r9 are saved around calls into C */
+static const int HOST_REG[8] = { RBX, RBP, R12, R13, R14, R15, R8, R9 };
+
+/* A block waiting for the compiler thread of Jit_run_tiered. Everything
+ * translating it needs is copied, since the main thread carries on changing
+ * the program and the block tables while it waits */
+typedef struct Request {
+        word_t start;          /* index in segment 0 of the block */
+        Um_instr *instrs;      /* the block's instructions */
+        uint8_t **entry;       /* jit->entry and jit->length when queued */
+        word_t length;
+        uint64_t generation;   /* jit->generation when queued */
+        struct Request *next;
+} Request;
+
+/* The JIT's state. Translated code reads and writes the first six fields
+ * at fixed offsets */
+typedef struct Jit_T {
+        uint32_t regs[8];    /* UM registers while not in translated code */
+        uint32_t next_ip;    /* where to continue after leaving code */
+        uint32_t reason;     /* an Exit_reason */
+        uint32_t aux;        /* segment to load for EXIT_LOADP */
+        uint32_t access_ip;  /* last SLOAD or SSTORE, with guard pages on */
+
+        SegMem_T mem;
+
+        /* Set by a store into a translated word of segment 0. Translations
+         * are thrown away once control is back in Jit_run */
+        bool flush_pending;
+
+        uint8_t *code;       /* CODE_BUFFER_SIZE bytes of executable memory */
+        uint8_t *blocks;     /* where block code starts (after the stubs) */
+        uint8_t *code_free;  /* first unused byte of code */
+        uint8_t *exit_stub;  /* code every block leaves through */
+
+        /* One entry per instruction of segment 0, plus the one past the end.
+         * entry[i] is the code for the block starting at i or NULL, and
+         * covered[i] is nonzero if word i is part of a translated block */
+        word_t length;
+        uint8_t **entry;
+        uint8_t *covered;
+
+        /* Jit_run_tiered only: times each word of segment 0 has started an
+         * interpreted block since translations were last thrown away */
+        uint32_t *counts;
+
+        /* The compiler thread of Jit_run_tiered, if there is one. lock is
+         * held for changes to code_free, entry, generation, the request
+         * lists and stopping. Entries are also stored and loaded atomically
+         * since the main thread looks at them without the lock */
+        bool tiered;
+        pthread_t compiler;
+        pthread_mutex_t lock;
+        pthread_cond_t work;       /* signalled when queued or stopping */
+        bool stopping;             /* tells the compiler thread to exit */
+        bool buffer_full;          /* no room to translate; flush please */
+        uint64_t generation;       /* bumped whenever code is thrown away */
+        Request *queued;           /* oldest first */
+        Request *queued_last;
+        Request *done;             /* for the main thread to free */
+
+#ifdef UM_STATS
+        uint64_t blocks_translated;
+        uint64_t flushes;
+        uint64_t blocks_interpreted;
+#endif
+} *Jit_T;
+
+/* The stub which enters translated code */
+typedef void (*Enter_fn)(Jit_T jit, uint8_t *code);
+
+/* Helpers translated code calls into */
+typedef uint32_t (*Helper_fn)(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+
+/* Where machine code is being written, and the block table (entry and
+ * length of the Jit_T) of the program it is for */
+typedef struct Emitter {
+        uint8_t *p;
+        uint8_t **entry;
+        word_t length;
+} Emitter;
+
+/***************************************************************************
+ *                         x86-64 instruction encoding                     *
+ ***************************************************************************/
+
+/* emit_byte
+ * Purpose:
+ *      Writes one byte of machine code
+ */
+static void emit_byte(Emitter *e, uint8_t byte)
+{
+        *e->p++ = byte;
+}
+
+/* emit_u32
+ * Purpose:
+ *      Writes a 32-bit immediate (little endian, like the host)
+ */
+static void emit_u32(Emitter *e, uint32_t value)
+{
+        memcpy(e->p, &value, sizeof(value));
+        e->p += sizeof(value);
+}
+
+/* emit_u64
+ * Purpose:
+ *      Writes a 64-bit immediate
+ */
+static void emit_u64(Emitter *e, uint64_t value)
+{
+        memcpy(e->p, &value, sizeof(value));
+        e->p += sizeof(value);
+}
+
+/* emit_rex
+ * Purpose:
+ *      Writes a REX prefix if one is needed
+ * Arguments:
+ *      (Emitter *) e - Where to write
+ *      (bool) wide - Whether the operation is 64-bit
+ *      (int) reg - The register in the ModRM reg field (or 0)
+ *      (int) rm - The register in the ModRM rm field (or 0)
+ */
+static void emit_rex(Emitter *e, bool wide, int reg, int rm)
+{
+        uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (rex != 0x40) {
+                emit_byte(e, rex);
+        }
+}
+
+/* emit_rr
+ * Purpose:
+ *      Writes a 32-bit register to register instruction of the form
+ *      "opcode /r" with both operands in registers
+ * Arguments:
+ *      (Emitter *) e - Where to write
+ *      (uint8_t) prefix - 0x0f for two byte opcodes, 0 for one byte opcodes
+ *      (uint8_t) opcode - The (last) opcode byte
+ *      (int) reg - The register (or opcode extension) in the reg field
+ *      (int) rm - The register in the rm field
+ */
+static void emit_rr(Emitter *e, uint8_t prefix, uint8_t opcode, int reg,
+                    int rm)
+{
+        emit_rex(e, false, reg, rm);
+        if (prefix != 0) {
+                emit_byte(e, prefix);
+        }
+        emit_byte(e, opcode);
+        emit_byte(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* mov dst, src (32-bit) */
+static void emit_mov(Emitter *e, int dst, int src)
+{
+        emit_rr(e, 0, 0x89, src, dst);
+}
+
+/* mov dst, imm32 */
+static void emit_mov_imm(Emitter *e, int dst, uint32_t imm)
+{
+        emit_rex(e, false, 0, dst);
+        emit_byte(e, 0xb8 + (dst & 7));
+        emit_u32(e, imm);
+}
+
+/* movabs dst, imm64 */
+static void emit_mov_imm64(Emitter *e, int dst, uint64_t imm)
+{
+        emit_rex(e, true, 0, dst);
+        emit_byte(e, 0xb8 + (dst & 7));
+        emit_u64(e, imm);
+}
+
+/* push reg (64-bit) */
+static void emit_push(Emitter *e, int reg)
+{
+        emit_rex(e, false, 0, reg);
+        emit_byte(e, 0x50 + (reg & 7));
+}
+
+/* pop reg (64-bit) */
+static void emit_pop(Emitter *e, int reg)
+{
+        emit_rex(e, false, 0, reg);
+        emit_byte(e, 0x58 + (reg & 7));
+}
+
+/* mov [rdi + disp], src (32-bit) */
+static void emit_store_rdi(Emitter *e, uint8_t disp, int src)
+{
+        emit_rex(e, false, src, RDI);
+        emit_byte(e, 0x89);
+        emit_byte(e, 0x40 | ((src & 7) << 3) | (RDI & 7));
+        emit_byte(e, disp);
+}
+
+/* mov dst, [rdi + disp] (32-bit) */
+static void emit_load_rdi(Emitter *e, int dst, uint8_t disp)
+{
+        emit_rex(e, false, dst, RDI);
+        emit_byte(e, 0x8b);
+        emit_byte(e, 0x40 | ((dst & 7) << 3) | (RDI & 7));
+        emit_byte(e, disp);
+}
+
+/* mov rdi, [rsp + disp] (64-bit) */
+static void emit_load_jit(Emitter *e, uint8_t disp)
+{
+        emit_byte(e, 0x48);
+        emit_byte(e, 0x8b);
+        emit_byte(e, 0x44 | ((RDI & 7) << 3));
+        emit_byte(e, 0x24);
+        emit_byte(e, disp);
+}
+
+/* jcc rel32 with the target filled in later by patch_jump. Returns where
+ * the displacement goes */
+static uint8_t *emit_jcc(Emitter *e, uint8_t condition)
+{
+        emit_byte(e, 0x0f);
+        emit_byte(e, 0x80 | condition);
+        uint8_t *displacement = e->p;
+        emit_u32(e, 0);
+        return displacement;
+}
+
+/* jmp rel32 to target */
+static void emit_jmp(Emitter *e, uint8_t *target)
+{
+        emit_byte(e, 0xe9);
+        emit_u32(e, (uint32_t)(target - (e->p + 4)));
+}
+
+/* Points the jump whose displacement is at displacement to the current end
+ * of the code */
+static void patch_jump(Emitter *e, uint8_t *displacement)
+{
+        uint32_t rel = (uint32_t)(e->p - (displacement + 4));
+        memcpy(displacement, &rel, sizeof(rel));
+}
+
+/* Condition codes for jcc */
+enum { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+/* helper function definitions */
+static Jit_T jit_new(SegMem_T mem, bool tiered);
+static void jit_free(Jit_T *jit_p);
+static bool leave_code(Jit_T jit, word_t *ip);
+static void new_program(Jit_T jit);
+static void flush_code(Jit_T jit);
+static void drop_queued(Jit_T jit);
+static void free_requests(Request *list);
+static uint8_t *block_at(Jit_T jit, word_t ip);
+static uint8_t *translate(Jit_T jit, word_t start);
+static word_t block_length(const Um_instr *program, word_t start);
+static void emit_block(Jit_T jit, Emitter *e, const Um_instr *instrs,
+                       word_t start);
+static void request_translation(Jit_T jit, word_t start);
+static void *compiler_main(void *arg);
+static void emit_stubs(Jit_T jit);
+static void translate_instr(Jit_T jit, Emitter *e, const Um_instr *instr,
+                            word_t ip);
+static void emit_call(Emitter *e, Helper_fn helper, int a, int b, int c);
+static void emit_note_access(Emitter *e, word_t ip);
+static void emit_exit(Jit_T jit, Emitter *e, Exit_reason reason);
+static void emit_goto_eax(Jit_T jit, Emitter *e, Exit_reason reason);
+
+static uint32_t helper_sload(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+static uint32_t helper_sstore(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+static uint32_t helper_map(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+static uint32_t helper_unmap(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+static uint32_t helper_out(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+static uint32_t helper_in(Jit_T jit, uint32_t a, uint32_t b, uint32_t c);
+
+/* Jit_run
+ * Purpose:
+ *      Runs the program in mem until it halts by translating it to machine
+ *      code block by block
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (Registers_T) regs - The registers to run the program with. Holds the
+ *                           final register values when the program halts
+ * Notes:
+ *      - CRE for mem or regs to be NULL
+ *      - CRE for regs to have fewer than 8 registers
+ *      - An invalid opcode, or running off the end of segment 0, writes
+ *        the output and exits with EXIT_FAILURE (see leave_code)
+ *      - CRE for the program to LOADP outside of the new program
+ *      - CRE if executable memory cannot be allocated
+ */
+void Jit_run(SegMem_T mem, Registers_T regs)
+{
+        assert(mem != NULL);
+        assert(regs != NULL);
+
+        Jit_T jit = jit_new(mem, false);
+        for (int r = 0; r < 8; r++) {
+                jit->regs[r] = Registers_get(regs, r);
+        }
+
+        /* Can't cast a data pointer to a function pointer in ISO C */
+        Enter_fn enter;
+        memcpy(&enter, &jit->code, sizeof(enter));
+
+        word_t ip = 0;
+        bool halted = false;
+        while (!halted) {
+                enter(jit, block_at(jit, ip));
+                halted = leave_code(jit, &ip);
+        }
+
+        for (int r = 0; r < 8; r++) {
+                Registers_set(regs, r, jit->regs[r]);
+        }
+
+#ifdef UM_STATS
+        fprintf(stderr, "um: jit translated %llu blocks, flushed %llu times\n",
+                (unsigned long long)jit->blocks_translated,
+                (unsigned long long)jit->flushes);
+#endif
+
+        jit_free(&jit);
+}
+
+/* Jit_run_tiered
+ * Purpose:
+ *      Runs the program in mem until it halts by interpreting it, and running
+ *      translations of the blocks jumped to most once a second thread has
+ *      made them
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (Registers_T) regs - The registers to run the program with. Holds the
+ *                           final register values when the program halts
+ * Notes:
+ *      - CRE for mem or regs to be NULL
+ *      - CRE for regs to have fewer than 8 registers
+ *      - An invalid opcode, or running off the end of segment 0, in a
+ *        translated block writes the output and exits with EXIT_FAILURE
+ *        (see leave_code). In the interpreter it does what it does in
+ *        Interp_run_block
+ *      - CRE for the program to LOADP outside of the new program
+ *      - CRE if executable memory or the thread cannot be had
+ *      - Interpreted blocks stop before their LOADP, which is run here like
+ *        a LOADP leaving translated code, so every jump to a block comes
+ *        through here unless translated code makes it directly
+ */
+void Jit_run_tiered(SegMem_T mem, Registers_T regs)
+{
+        assert(mem != NULL);
+        assert(regs != NULL);
+
+        Jit_T jit = jit_new(mem, true);
+        for (int r = 0; r < 8; r++) {
+                jit->regs[r] = Registers_get(regs, r);
+        }
+
+        /* Can't cast a data pointer to a function pointer in ISO C */
+        Enter_fn enter;
+        memcpy(&enter, &jit->code, sizeof(enter));
+
+        word_t ip = 0, length;
+        bool halted = false;
+        while (!halted) {
+                /* Stores by the interpreter into words given to the compiler
+                 * thread make their translations out of date */
+                if (SegMem_watch_hit(mem) ||
+                    __atomic_load_n(&jit->buffer_full, __ATOMIC_ACQUIRE)) {
+                        flush_code(jit);
+                }
+
+                uint8_t *code = __atomic_load_n(&jit->entry[ip],
+                                                __ATOMIC_ACQUIRE);
+                if (code != NULL) {
+                        enter(jit, code);
+                        halted = leave_code(jit, &ip);
+                        continue;
+                }
+
+                if (++jit->counts[ip] == TIER_THRESHOLD) {
+                        request_translation(jit, ip);
+                }
+#ifdef UM_STATS
+                jit->blocks_interpreted++;
+#endif
+
+                for (int r = 0; r < 8; r++) {
+                        Registers_set(regs, r, jit->regs[r]);
+                }
+                halted = !Interp_run_block(mem, regs, &ip);
+                for (int r = 0; r < 8; r++) {
+                        jit->regs[r] = Registers_get(regs, r);
+                }
+
+                if (!halted) {
+                        /* Do the LOADP the block stopped at */
+                        const Um_instr *loadp =
+                                &SegMem_program(mem, &length)[ip];
+                        jit->next_ip = jit->regs[loadp->rC];
+                        jit->reason = EXIT_LOADP;
+                        jit->aux = jit->regs[loadp->rB];
+                        halted = leave_code(jit, &ip);
+                }
+        }
+
+        for (int r = 0; r < 8; r++) {
+                Registers_set(regs, r, jit->regs[r]);
+        }
+
+#ifdef UM_STATS
+        fprintf(stderr, "um: jit interpreted %llu blocks, translated %llu "
+                "blocks, flushed %llu times\n",
+                (unsigned long long)jit->blocks_interpreted,
+                (unsigned long long)jit->blocks_translated,
+                (unsigned long long)jit->flushes);
+#endif
+
+        jit_free(&jit);
+}
+
+/* leave_code
+ * Purpose:
+ *      Does what translated code left for Jit_run to do
+ * Arguments:
+ *      (Jit_T) jit - The JIT whose code was left. Its next_ip, reason and
+ *                    aux say why
+ *      (word_t *) ip - Set to the index in segment 0 to carry on at
+ * Returns:
+ *      (bool) true if the program halted
+ * Notes:
+ *      - An invalid instruction ends the run, in every build: its output
+ *        is written and the process exits with EXIT_FAILURE. Returning
+ *        would only run the same instruction again
+ *      - CRE for a LOADP outside of the program
+ */
+static bool leave_code(Jit_T jit, word_t *ip)
+{
+        if (jit->flush_pending) {
+                flush_code(jit);
+        }
+
+        word_t length;
+        *ip = jit->next_ip;
+        switch (jit->reason) {
+        case EXIT_CONTINUE:
+                break;
+        case EXIT_LOADP:
+                SegMem_load_program(jit->mem, jit->aux, *ip);
+                if (jit->aux != 0) {
+                        new_program(jit);
+                }
+                assert(*ip < jit->length);
+                break;
+        case EXIT_HALT:
+                return true;
+        default:
+                fprintf(stderr, "Instruction opcode not valid: %u\n",
+                        SegMem_program(jit->mem, &length)[*ip].opcode);
+                Io_flush();
+                exit(EXIT_FAILURE);
+        }
+        return false;
+}
+
+/* jit_new
+ * Purpose:
+ *      Makes a JIT for the program in mem with an empty code buffer
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program to run
+ *      (bool) tiered - Whether to start a compiler thread for
+ *                      Jit_run_tiered
+ * Returns:
+ *      (Jit_T) the new JIT, all registers 0
+ * Notes:
+ *      - CRE if executable memory cannot be allocated or the thread cannot
+ *        be started
+ */
+static Jit_T jit_new(SegMem_T mem, bool tiered)
+{
+        Jit_T jit;
+        NEW0(jit);
+        jit->mem = mem;
+        jit->tiered = tiered;
+        pthread_mutex_init(&jit->lock, NULL);
+        pthread_cond_init(&jit->work, NULL);
+
+        void *code = mmap(NULL, CODE_BUFFER_SIZE,
+                          PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(code != MAP_FAILED);
+        jit->code = code;
+
+        emit_stubs(jit);
+        new_program(jit);
+
+        if (tiered) {
+                int failed = pthread_create(&jit->compiler, NULL,
+                                            compiler_main, jit);
+                assert(!failed);
+                (void)failed;
+        }
+
+        return jit;
+}
+
+/* jit_free
+ * Purpose:
+ *      Frees a JIT and its code
+ * Arguments:
+ *      (Jit_T *) jit_p - Address of the JIT to free. Set to NULL
+ * Notes:
+ *      - CRE for jit_p or *jit_p to be NULL
+ */
+static void jit_free(Jit_T *jit_p)
+{
+        assert(jit_p != NULL);
+        Jit_T jit = *jit_p;
+        assert(jit != NULL);
+
+        if (jit->tiered) {
+                pthread_mutex_lock(&jit->lock);
+                jit->stopping = true;
+                pthread_cond_signal(&jit->work);
+                pthread_mutex_unlock(&jit->lock);
+                pthread_join(jit->compiler, NULL);
+
+                free_requests(jit->queued);
+                free_requests(jit->done);
+                SegMem_watch_program(jit->mem, NULL);
+        }
+        pthread_mutex_destroy(&jit->lock);
+        pthread_cond_destroy(&jit->work);
+
+        munmap(jit->code, CODE_BUFFER_SIZE);
+        FREE(jit->entry);
+        FREE(jit->covered);
+        FREE(jit->counts);
+        FREE(jit);
+        *jit_p = NULL;
+}
+
+/* new_program
+ * Purpose:
+ *      Throws away every translation and sizes the block tables for the
+ *      program now in segment 0
+ * Arguments:
+ *      (Jit_T) jit - The JIT whose program changed
+ */
+static void new_program(Jit_T jit)
+{
+        pthread_mutex_lock(&jit->lock);
+        if (jit->entry != NULL) {
+                FREE(jit->entry);
+                FREE(jit->covered);
+                FREE(jit->counts);
+        }
+
+        SegMem_program(jit->mem, &jit->length);
+        jit->entry = CALLOC(jit->length + 1, sizeof(uint8_t *));
+        jit->covered = CALLOC(jit->length + 1, sizeof(uint8_t));
+        jit->counts = CALLOC(jit->length + 1, sizeof(uint32_t));
+        jit->code_free = jit->blocks;
+        jit->flush_pending = false;
+        __atomic_store_n(&jit->buffer_full, false, __ATOMIC_RELAXED);
+        jit->generation++;
+        drop_queued(jit);
+        pthread_mutex_unlock(&jit->lock);
+
+        if (jit->tiered) {
+                SegMem_watch_program(jit->mem, jit->covered);
+        }
+}
+
+/* flush_code
+ * Purpose:
+ *      Throws away every translation of the current program
+ * Arguments:
+ *      (Jit_T) jit - The JIT to flush
+ * Notes:
+ *      - Must not be called while translated code is running
+ *      - Blocks waiting for the compiler thread are thrown away too, and
+ *        how often blocks have been jumped to is forgotten
+ */
+static void flush_code(Jit_T jit)
+{
+        pthread_mutex_lock(&jit->lock);
+        memset(jit->entry, 0, (jit->length + 1) * sizeof(uint8_t *));
+        memset(jit->covered, 0, jit->length + 1);
+        memset(jit->counts, 0, (jit->length + 1) * sizeof(uint32_t));
+        jit->code_free = jit->blocks;
+        jit->flush_pending = false;
+        __atomic_store_n(&jit->buffer_full, false, __ATOMIC_RELAXED);
+        jit->generation++;
+        drop_queued(jit);
+        pthread_mutex_unlock(&jit->lock);
+
+        /* A store into a word that was watched doesn't matter any more */
+        if (jit->tiered) {
+                SegMem_watch_program(jit->mem, jit->covered);
+        }
+
+#ifdef UM_STATS
+        jit->flushes++;
+#endif
+}
+
+/* drop_queued
+ * Purpose:
+ *      Moves every block waiting for the compiler thread onto the list of
+ *      requests to free
+ * Arguments:
+ *      (Jit_T) jit - The JIT whose queue to empty
+ * Notes:
+ *      - jit->lock must be held
+ */
+static void drop_queued(Jit_T jit)
+{
+        if (jit->queued != NULL) {
+                jit->queued_last->next = jit->done;
+                jit->done = jit->queued;
+        }
+        jit->queued = NULL;
+        jit->queued_last = NULL;
+}
+
+/* free_requests
+ * Purpose:
+ *      Frees a list of requests
+ * Arguments:
+ *      (Request *) list - The first request of the list, or NULL
+ * Notes:
+ *      - Only the main thread allocates and frees, since Hanson's memory
+ *        functions aren't made for threads
+ */
+static void free_requests(Request *list)
+{
+        while (list != NULL) {
+                Request *next = list->next;
+                FREE(list->instrs);
+                FREE(list);
+                list = next;
+        }
+}
+
+/* block_at
+ * Purpose:
+ *      Gets the code for the block starting at ip, translating it if needed
+ * Arguments:
+ *      (Jit_T) jit - The JIT to get the block from
+ *      (word_t) ip - Index in segment 0 the block starts at
+ * Returns:
+ *      (uint8_t *) the block's code
+ * Notes:
+ *      - CRE for ip to be past the end of segment 0 (ip == length is the
+ *        end itself, which translates to an invalid instruction)
+ */
+static uint8_t *block_at(Jit_T jit, word_t ip)
+{
+        assert(ip <= jit->length);
+
+        if (jit->entry[ip] != NULL) {
+                return jit->entry[ip];
+        }
+        return translate(jit, ip);
+}
+
+/* translate
+ * Purpose:
+ *      Translates the block of segment 0 starting at start into machine code
+ * Arguments:
+ *      (Jit_T) jit - The JIT to translate with
+ *      (word_t) start - Index in segment 0 of the block's first instruction
+ * Returns:
+ *      (uint8_t *) the new block's code, also recorded in jit->entry
+ * Notes:
+ *      - Flushes every translation first if the code buffer is too full
+ */
+static uint8_t *translate(Jit_T jit, word_t start)
+{
+        size_t worst_case = (size_t)(MAX_BLOCK_LENGTH + 1) * MAX_INSTR_BYTES;
+        if ((size_t)(jit->code + CODE_BUFFER_SIZE - jit->code_free) <
+            worst_case) {
+                flush_code(jit);
+        }
+
+        word_t length;
+        const Um_instr *program = SegMem_program(jit->mem, &length);
+        assert(length == jit->length);
+
+        memset(jit->covered + start, 1, block_length(program, start));
+
+        Emitter e = { jit->code_free, jit->entry, jit->length };
+        uint8_t *block = e.p;
+        emit_block(jit, &e, program + start, start);
+
+        jit->code_free = e.p;
+        jit->entry[start] = block;
+
+#ifdef UM_STATS
+        jit->blocks_translated++;
+#endif
+
+        return block;
+}
+
+/* block_length
+ * Purpose:
+ *      Counts the words of segment 0 which the block starting at start
+ *      covers
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) start - Index in program of the block's first instruction
+ * Returns:
+ *      (word_t) how many words from start on emit_block reads
+ * Notes:
+ *      - Entry length of the program is an invalid instruction, so blocks
+ *        always end
+ */
+static word_t block_length(const Um_instr *program, word_t start)
+{
+        word_t count = 0;
+        for (;;) {
+                Um_opcode opcode = program[start + count].opcode;
+                count++;
+                if (count > MAX_BLOCK_LENGTH || opcode == LOADP ||
+                    opcode == HALT || opcode == IN || opcode > LV) {
+                        return count;
+                }
+        }
+}
+
+/* emit_block
+ * Purpose:
+ *      Writes the machine code for a block
+ * Arguments:
+ *      (Jit_T) jit - The JIT translating
+ *      (Emitter *) e - Where to write
+ *      (const Um_instr *) instrs - The block's instructions, as many as
+ *                                  block_length says
+ *      (word_t) start - Index in segment 0 of the block's first instruction
+ * Notes:
+ *      - Reads nothing of jit that changes, so the compiler thread can run
+ *        it without the lock
+ */
+static void emit_block(Jit_T jit, Emitter *e, const Um_instr *instrs,
+                       word_t start)
+{
+        for (unsigned count = 0; ; count++) {
+                const Um_instr *instr = &instrs[count];
+                word_t ip = start + count;
+
+                if (count == MAX_BLOCK_LENGTH) {
+                        /* Long block; carry on in the next one */
+                        emit_mov_imm(e, RAX, ip);
+                        emit_goto_eax(jit, e, EXIT_CONTINUE);
+                        return;
+                }
+
+                translate_instr(jit, e, instr, ip);
+
+                Um_opcode opcode = instr->opcode;
+                if (opcode == LOADP || opcode == HALT || opcode == IN ||
+                    opcode > LV) {
+                        return;
+                }
+        }
+}
+
+/* request_translation
+ * Purpose:
+ *      Queues the block starting at start for the compiler thread
+ * Arguments:
+ *      (Jit_T) jit - The JIT of Jit_run_tiered
+ *      (word_t) start - Index in segment 0 of the block's first instruction
+ * Notes:
+ *      - The block's words are marked covered straight away, so a store to
+ *        one before the translation is ready throws it away
+ *      - Frees the requests the compiler thread is done with
+ */
+static void request_translation(Jit_T jit, word_t start)
+{
+        word_t length;
+        const Um_instr *program = SegMem_program(jit->mem, &length);
+        word_t count = block_length(program, start);
+
+        Request *request;
+        NEW(request);
+        request->start = start;
+        request->instrs = ALLOC(count * sizeof(Um_instr));
+        memcpy(request->instrs, program + start, count * sizeof(Um_instr));
+        request->next = NULL;
+        memset(jit->covered + start, 1, count);
+
+        pthread_mutex_lock(&jit->lock);
+        request->entry = jit->entry;
+        request->length = jit->length;
+        request->generation = jit->generation;
+        if (jit->queued == NULL) {
+                jit->queued = request;
+        } else {
+                jit->queued_last->next = request;
+        }
+        jit->queued_last = request;
+        Request *done = jit->done;
+        jit->done = NULL;
+        pthread_cond_signal(&jit->work);
+        pthread_mutex_unlock(&jit->lock);
+
+        free_requests(done);
+}
+
+/* compiler_main
+ * Purpose:
+ *      The compiler thread of Jit_run_tiered. Translates queued blocks
+ *      until told to stop
+ * Arguments:
+ *      (void *) arg - The Jit_T
+ * Returns:
+ *      (void *) NULL
+ * Notes:
+ *      - Translations are written while not holding the lock and only put
+ *        in the block table if nothing was thrown away in the meantime.
+ *        Only this thread writes code, so nothing else is written where it
+ *        is writing
+ *      - When the code buffer is full it sets buffer_full, and the main
+ *        thread flushes the next time it is between blocks
+ */
+static void *compiler_main(void *arg)
+{
+        Jit_T jit = arg;
+        size_t worst_case = (size_t)(MAX_BLOCK_LENGTH + 1) * MAX_INSTR_BYTES;
+
+        pthread_mutex_lock(&jit->lock);
+        for (;;) {
+                while (jit->queued == NULL && !jit->stopping) {
+                        pthread_cond_wait(&jit->work, &jit->lock);
+                }
+                if (jit->stopping) {
+                        break;
+                }
+
+                Request *request = jit->queued;
+                jit->queued = request->next;
+
+                if ((size_t)(jit->code + CODE_BUFFER_SIZE - jit->code_free) >=
+                    worst_case) {
+                        Emitter e = { jit->code_free, request->entry,
+                                      request->length };
+                        uint8_t *block = e.p;
+                        pthread_mutex_unlock(&jit->lock);
+                        emit_block(jit, &e, request->instrs, request->start);
+                        pthread_mutex_lock(&jit->lock);
+
+                        word_t start = request->start;
+                        if (request->generation == jit->generation) {
+                                jit->code_free = e.p;
+                                __atomic_store_n(&request->entry[start],
+                                                 block, __ATOMIC_RELEASE);
+#ifdef UM_STATS
+                                jit->blocks_translated++;
+#endif
+                        }
+                } else {
+                        __atomic_store_n(&jit->buffer_full, true,
+                                         __ATOMIC_RELEASE);
+                }
+
+                request->next = jit->done;
+                jit->done = request;
+        }
+        pthread_mutex_unlock(&jit->lock);
+
+        return NULL;
+}
+
+/***************************************************************************
+ *                                Translation                              *
+ ***************************************************************************/
+
+/* emit_stubs
+ * Purpose:
+ *      Writes the code that enters translated code and the code that every
+ *      block leaves through at the start of the code buffer
+ * Arguments:
+ *      (Jit_T) jit - The JIT whose code buffer to write to
+ * Notes:
+ *      - Entering is a call enter(jit, code). It saves the callee-saved
+ *        registers and jit on the stack (leaving it 16-byte aligned), loads
+ *        the UM registers and jumps to code
+ *      - Leaving expects eax = next ip, edx = reason, ecx = aux. It saves
+ *        those and the UM registers into jit and returns from enter
+ */
+static void emit_stubs(Jit_T jit)
+{
+        Emitter e = { jit->code, NULL, 0 };
+
+        /* Enter: rdi = jit, rsi = code */
+        emit_push(&e, RBX);
+        emit_push(&e, RBP);
+        emit_push(&e, R12);
+        emit_push(&e, R13);
+        emit_push(&e, R14);
+        emit_push(&e, R15);
+        emit_push(&e, RDI);
+        for (int r = 0; r < 8; r++) {
+                emit_load_rdi(&e, HOST_REG[r], offsetof(struct Jit_T, regs) +
+                              r * sizeof(uint32_t));
+        }
+        emit_rr(&e, 0, 0xff, 4, RSI); /* jmp rsi */
+
+        /* Exit */
+        jit->exit_stub = e.p;
+        emit_load_jit(&e, 0);
+        emit_store_rdi(&e, offsetof(struct Jit_T, next_ip), RAX);
+        emit_store_rdi(&e, offsetof(struct Jit_T, reason), RDX);
+        emit_store_rdi(&e, offsetof(struct Jit_T, aux), RCX);
+        for (int r = 0; r < 8; r++) {
+                emit_store_rdi(&e, offsetof(struct Jit_T, regs) +
+                               r * sizeof(uint32_t), HOST_REG[r]);
+        }
+        emit_pop(&e, RDI);
+        emit_pop(&e, R15);
+        emit_pop(&e, R14);
+        emit_pop(&e, R13);
+        emit_pop(&e, R12);
+        emit_pop(&e, RBP);
+        emit_pop(&e, RBX);
+        emit_byte(&e, 0xc3); /* ret */
+
+        jit->blocks = e.p;
+}
+
+/* emit_exit
+ * Purpose:
+ *      Writes code leaving translated code for the given reason. eax and ecx
+ *      must already hold the next ip and aux
+ */
+static void emit_exit(Jit_T jit, Emitter *e, Exit_reason reason)
+{
+        emit_mov_imm(e, RDX, reason);
+        emit_jmp(e, jit->exit_stub);
+}
+
+/* emit_goto_eax
+ * Purpose:
+ *      Writes code jumping to the UM instruction whose index is in eax. If
+ *      its block is translated this goes straight there, otherwise it leaves
+ *      translated code for the given reason (with ecx as aux)
+ */
+static void emit_goto_eax(Jit_T jit, Emitter *e, Exit_reason reason)
+{
+        /* cmp eax, length; jae out */
+        emit_byte(e, 0x3d);
+        emit_u32(e, e->length);
+        uint8_t *out_of_range = emit_jcc(e, CC_AE);
+
+        /* mov rdx, [entry + rax * 8]; test rdx, rdx; jz out; jmp rdx */
+        emit_mov_imm64(e, RDX, (uintptr_t)e->entry);
+        emit_byte(e, 0x48);
+        emit_byte(e, 0x8b);
+        emit_byte(e, 0x14);
+        emit_byte(e, 0xc2);
+        emit_byte(e, 0x48);
+        emit_byte(e, 0x85);
+        emit_byte(e, 0xd2);
+        uint8_t *untranslated = emit_jcc(e, CC_E);
+        emit_rr(e, 0, 0xff, 4, RDX);
+
+        patch_jump(e, out_of_range);
+        patch_jump(e, untranslated);
+        emit_exit(jit, e, reason);
+}
+
+/* emit_call
+ * Purpose:
+ *      Writes a call of helper(jit, UM register a, b, c). The result is left
+ *      in eax
+ * Arguments:
+ *      (Emitter *) e - Where to write
+ *      (Helper_fn) helper - The helper to call
+ *      (int) a, b, c - UM registers to pass, or -1 for arguments the helper
+ *                      doesn't use
+ * Notes:
+ *      - Saves r8 and r9 (UM registers 6 and 7) around the call, which also
+ *        keeps the stack 16-byte aligned
+ */
+static void emit_call(Emitter *e, Helper_fn helper, int a, int b, int c)
+{
+        emit_push(e, R8);
+        emit_push(e, R9);
+        emit_load_jit(e, 16);
+        if (a >= 0) {
+                emit_mov(e, RSI, HOST_REG[a]);
+        }
+        if (b >= 0) {
+                emit_mov(e, RDX, HOST_REG[b]);
+        }
+        if (c >= 0) {
+                emit_mov(e, RCX, HOST_REG[c]);
+        }
+        emit_mov_imm64(e, RAX, (uintptr_t)helper);
+        emit_rr(e, 0, 0xff, 2, RAX); /* call rax */
+        emit_pop(e, R9);
+        emit_pop(e, R8);
+}
+
+/* emit_note_access
+ * Purpose:
+ *      Writes code noting down the instruction about to load or store, for
+ *      the helper to pass on to SegMem (see SegMem_note_access), so a fault
+ *      in a guarded memory is reported against it
+ * Arguments:
+ *      (Emitter *) e - Where to write
+ *      (word_t) ip - Index of the instruction in segment 0
+ * Notes:
+ *      - Only written with guard pages on. Uses rdi and eax, which the call
+ *        after it sets anyway
+ */
+static void emit_note_access(Emitter *e, word_t ip)
+{
+        emit_load_jit(e, 0);
+        emit_mov_imm(e, RAX, ip);
+        emit_store_rdi(e, offsetof(struct Jit_T, access_ip), RAX);
+}
+
+/* translate_instr
+ * Purpose:
+ *      Writes the machine code for one UM instruction
+ * Arguments:
+ *      (Jit_T) jit - The JIT translating
+ *      (Emitter *) e - Where to write
+ *      (const Um_instr *) instr - The instruction to translate
+ *      (word_t) ip - Index of the instruction in segment 0
+ * Notes:
+ *      - LOADP, HALT, IN and invalid instructions end with code leaving the
+ *        block; every other instruction falls through to the next one
+ */
+static void translate_instr(Jit_T jit, Emitter *e, const Um_instr *instr,
+                            word_t ip)
+{
+        int a = HOST_REG[instr->rA];
+        int b = HOST_REG[instr->rB];
+        int c = HOST_REG[instr->rC];
+        uint8_t *skip;
+
+        switch (instr->opcode) {
+        case CMOV:
+                emit_rr(e, 0, 0x85, c, c);        /* test c, c */
+                emit_rr(e, 0x0f, 0x45, a, b);     /* cmovne a, b */
+                break;
+        case SLOAD:
+                if (jit->mem->guard) {
+                        emit_note_access(e, ip);
+                }
+                emit_call(e, helper_sload, -1, instr->rB, instr->rC);
+                emit_mov(e, a, RAX);
+                break;
+        case SSTORE:
+                if (jit->mem->guard) {
+                        emit_note_access(e, ip);
+                }
+                emit_call(e, helper_sstore, instr->rA, instr->rB, instr->rC);
+                /* Leave if the store hit translated code */
+                emit_rr(e, 0, 0x85, RAX, RAX);
+                skip = emit_jcc(e, CC_E);
+                emit_mov_imm(e, RAX, ip + 1);
+                emit_exit(jit, e, EXIT_CONTINUE);
+                patch_jump(e, skip);
+                break;
+        case ADD:
+                emit_mov(e, RAX, b);
+                emit_rr(e, 0, 0x01, c, RAX);      /* add eax, c */
+                emit_mov(e, a, RAX);
+                break;
+        case MUL:
+                emit_mov(e, RAX, b);
+                emit_rr(e, 0x0f, 0xaf, RAX, c);   /* imul eax, c */
+                emit_mov(e, a, RAX);
+                break;
+        case DIV:
+                emit_mov(e, RAX, b);
+                emit_rr(e, 0, 0x31, RDX, RDX);    /* xor edx, edx */
+                emit_rr(e, 0, 0xf7, 6, c);        /* div c */
+                emit_mov(e, a, RAX);
+                break;
+        case NAND:
+                emit_mov(e, RAX, b);
+                emit_rr(e, 0, 0x21, c, RAX);      /* and eax, c */
+                emit_rr(e, 0, 0xf7, 2, RAX);      /* not eax */
+                emit_mov(e, a, RAX);
+                break;
+        case HALT:
+                emit_mov_imm(e, RAX, ip);
+                emit_exit(jit, e, EXIT_HALT);
+                break;
+        case MAP:
+                emit_call(e, helper_map, -1, -1, instr->rC);
+                emit_mov(e, b, RAX);
+                break;
+        case UNMAP:
+                emit_call(e, helper_unmap, -1, -1, instr->rC);
+                break;
+        case OUT:
+                emit_call(e, helper_out, -1, -1, instr->rC);
+                break;
+        case IN:
+                emit_call(e, helper_in, -1, -1, -1);
+                emit_mov(e, c, RAX);
+                emit_mov_imm(e, RAX, ip + 1);
+                emit_exit(jit, e, EXIT_CONTINUE);
+                break;
+        case LOADP:
+                emit_mov(e, RCX, b);
+                emit_mov(e, RAX, c);
+                /* Only loads of segment 0 can stay in translated code */
+                emit_rr(e, 0, 0x85, RCX, RCX);
+                skip = emit_jcc(e, CC_NE);
+                emit_goto_eax(jit, e, EXIT_LOADP);
+                patch_jump(e, skip);
+                emit_exit(jit, e, EXIT_LOADP);
+                break;
+        case LV:
+                emit_mov_imm(e, a, instr->value);
+                break;
+        default:
+                emit_mov_imm(e, RAX, ip);
+                emit_exit(jit, e, EXIT_INVALID);
+                break;
+        }
+}
+
+/***************************************************************************
+ *                    Helpers called from translated code                  *
+ ***************************************************************************/
+
+/* SLOAD: gives back word c of segment b */
+static uint32_t helper_sload(Jit_T jit, uint32_t a, uint32_t b, uint32_t c)
+{
+        (void)a;
+        SegMem_note_access(jit->mem, jit->access_ip);
+        return SegMem_get_word(jit->mem, b, c);
+}
+
+/* SSTORE: puts c into word b of segment a. Gives back nonzero if that word
+ * was translated, in which case every translation is now out of date */
+static uint32_t helper_sstore(Jit_T jit, uint32_t a, uint32_t b, uint32_t c)
+{
+        SegMem_note_access(jit->mem, jit->access_ip);
+        SegMem_put_word(jit->mem, a, b, c);
+
+        if (a == 0 && jit->covered[b]) {
+                jit->flush_pending = true;
+                return 1;
+        }
+        return 0;
+}
+
+/* MAP: gives back the id of a new segment of c words */
+static uint32_t helper_map(Jit_T jit, uint32_t a, uint32_t b, uint32_t c)
+{
+        (void)a;
+        (void)b;
+        return SegMem_map(jit->mem, c);
+}
+
+/* UNMAP: unmaps segment c */
+static uint32_t helper_unmap(Jit_T jit, uint32_t a, uint32_t b, uint32_t c)
+{
+        (void)a;
+        (void)b;
+        SegMem_unmap(jit->mem, c);
+        return 0;
+}
+
+/* OUT: outputs c */
+static uint32_t helper_out(Jit_T jit, uint32_t a, uint32_t b, uint32_t c)
+{
+        (void)jit;
+        (void)a;
+        (void)b;
+        /* URE to out a value larger than 255 */
+        Io_out(c);
+        return 0;
+}
+
+/* IN: gives back the next byte of input, like um.c */
+static uint32_t helper_in(Jit_T jit, uint32_t a, uint32_t b, uint32_t c)
+{
+        (void)jit;
+        (void)a;
+        (void)b;
+        (void)c;
+        return Io_in();
+}
+
+#else /* not Linux on x86-64 */
+
+/* Hanson Libs */
+#include <assert.h>
+
+const bool Jit_supported = false;
+
+/* Jit_run
+ * Purpose:
+ *      Stands in for the JIT where it isn't supported
+ * Notes:
+ *      - Always a CRE
+ */
+void Jit_run(SegMem_T mem, Registers_T regs)
+{
+        (void)mem;
+        (void)regs;
+        assert(Jit_supported);
+}
+
+/* Jit_run_tiered
+ * Purpose:
+ *      Stands in for the tiered JIT where it isn't supported
+ * Notes:
+ *      - Always a CRE
+ */
+void Jit_run_tiered(SegMem_T mem, Registers_T regs)
+{
+        (void)mem;
+        (void)regs;
+        assert(Jit_supported);
+}
+
+#endif
@@ -0,0 +1,31 @@
+/* jit.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ *
+ * Exports a second execution engine for the universal machine which
+ * translates straight-line runs of segment 0 into x86-64 machine code and
+ * runs that instead of interpreting. It works on the same SegMem_T and
+ * Registers_T as the interpreter in um.c. Jit_run_tiered interprets first,
+ * and only runs translations of the blocks jumped to most, which a second
+ * thread makes while the interpreter carries on
+ *
+ * Only Linux on x86-64 is supported; elsewhere Jit_supported is false and
+ * Jit_run and Jit_run_tiered are CREs
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+
+#include "segmem.h"
+#include "registers.h"
+
+extern const bool Jit_supported;
+
+extern void Jit_run(SegMem_T mem, Registers_T regs);
+extern void Jit_run_tiered(SegMem_T mem, Registers_T regs);
+
+#endif
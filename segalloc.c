@@ -0,0 +1,314 @@
+/* segalloc.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * The allocators SegMem can get its segments from: malloc, arena and pool
+ * (see segalloc.h)
+ */
+
+/* Header */
+#include "segalloc.h"
+
+/* C Std Libs */
+#include <string.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* Segments are carved from chunks of this many bytes, except ones bigger
+ * than a quarter of it, which get a chunk of their own */
+static const size_t CHUNK_BYTES = 1 << 20;
+
+/* A chunk of an arena, with its segments after the header, each rounded
+ * up to a multiple of 8 bytes */
+typedef struct Chunk {
+        struct Chunk *next;
+        size_t size;            /* bytes after the header */
+        size_t used;            /* bytes of them given out */
+        Segment *last;          /* the segment given out last, or NULL */
+        uint64_t bytes[];
+} Chunk;
+
+/* An arena: its chunks, the one segments are carved from first */
+typedef struct Arena {
+        Chunk *chunks;
+} Arena;
+
+static size_t segment_bytes(uint32_t length);
+static Chunk *new_chunk(size_t size, Chunk *next);
+
+/* malloc */
+
+static void *malloc_open(void)
+{
+        return NULL;
+}
+
+static Segment *malloc_new_segment(void *state, uint32_t length)
+{
+        (void)state;
+        Segment *segment = CALLOC(1, segment_bytes(length));
+        segment->length = length;
+        segment->kind = SEGMENT_HEAP;
+
+        return segment;
+}
+
+static void malloc_free_segment(void *state, Segment *segment)
+{
+        (void)state;
+        FREE(segment);
+}
+
+static Segment *malloc_resize(void *state, Segment *segment, uint32_t length)
+{
+        (void)state;
+        uint32_t old_length = segment->length;
+        RESIZE(segment, segment_bytes(length));
+        if (length > old_length) {
+                memset(&segment->words[old_length], 0,
+                       (size_t)(length - old_length) * sizeof(uint32_t));
+        }
+        segment->length = length;
+
+        return segment;
+}
+
+static void malloc_reset(void *state)
+{
+        (void)state;
+}
+
+static void malloc_close(void *state)
+{
+        (void)state;
+}
+
+/* The malloc allocator: each segment is one CALLOC */
+const SegAlloc SegAlloc_malloc = {
+        "malloc", malloc_open, malloc_new_segment, malloc_free_segment,
+        malloc_resize, malloc_reset, malloc_close
+};
+
+/* arena */
+
+static void *arena_open(void)
+{
+        Arena *arena = NEW(arena);
+        arena->chunks = NULL;
+
+        return arena;
+}
+
+/* Carves a segment from the first chunk, starting a new one if it doesn't
+ * fit. A big segment gets a chunk to itself, behind the first so the first
+ * keeps being carved from */
+static Segment *arena_new_segment(void *state, uint32_t length)
+{
+        Arena *arena = state;
+        size_t bytes = segment_bytes(length);
+
+        Chunk *chunk = arena->chunks;
+        if (bytes > CHUNK_BYTES / 4) {
+                if (chunk == NULL) {
+                        arena->chunks = new_chunk(bytes, NULL);
+                        chunk = arena->chunks;
+                } else {
+                        chunk->next = new_chunk(bytes, chunk->next);
+                        chunk = chunk->next;
+                }
+        } else if (chunk == NULL || chunk->size - chunk->used < bytes) {
+                arena->chunks = new_chunk(CHUNK_BYTES, arena->chunks);
+                chunk = arena->chunks;
+        }
+
+        /* Chunks start zeroed, and no part of one is given out twice */
+        Segment *segment = (Segment *)(void *)((char *)chunk->bytes +
+                                               chunk->used);
+        chunk->used += bytes;
+        chunk->last = segment;
+        segment->length = length;
+        segment->kind = SEGMENT_ARENA;
+
+        return segment;
+}
+
+/* Segments are only freed by reset */
+static void arena_free_segment(void *state, Segment *segment)
+{
+        (void)state;
+        (void)segment;
+}
+
+/* Grows or shrinks the segment carved last in place while it fits in its
+ * chunk, and moves any other to a new segment. Words a shrink gives back to
+ * the chunk are zeroed, as arena_new_segment expects of the rest of it */
+static Segment *arena_resize(void *state, Segment *segment, uint32_t length)
+{
+        Arena *arena = state;
+        Chunk *chunk = arena->chunks;
+        uint32_t old_length = segment->length;
+
+        if (chunk != NULL && chunk->last == segment) {
+                size_t start = (char *)segment - (char *)chunk->bytes;
+                size_t bytes = segment_bytes(length);
+                if (chunk->size - start >= bytes) {
+                        if (length > old_length) {
+                                memset(&segment->words[old_length], 0,
+                                       (size_t)(length - old_length) *
+                                       sizeof(uint32_t));
+                        } else {
+                                memset(&segment->words[length], 0,
+                                       (size_t)(old_length - length) *
+                                       sizeof(uint32_t));
+                        }
+                        chunk->used = start + bytes;
+                        segment->length = length;
+                        return segment;
+                }
+        }
+
+        Segment *moved = arena_new_segment(state, length);
+        memcpy(moved->words, segment->words,
+               (size_t)(length < old_length ? length : old_length) *
+               sizeof(uint32_t));
+        return moved;
+}
+
+/* Frees every chunk, and with them every segment */
+static void arena_reset(void *state)
+{
+        Arena *arena = state;
+        while (arena->chunks != NULL) {
+                Chunk *next = arena->chunks->next;
+                FREE(arena->chunks);
+                arena->chunks = next;
+        }
+}
+
+static void arena_close(void *state)
+{
+        Arena *arena = state;
+        FREE(arena);
+}
+
+/* The arena allocator: bump allocation from 1MB chunks, freed in bulk */
+const SegAlloc SegAlloc_arena = {
+        "arena", arena_open, arena_new_segment, arena_free_segment,
+        arena_resize, arena_reset, arena_close
+};
+
+/* pool */
+
+static void *pool_open(void)
+{
+        return SegPool_new();
+}
+
+static Segment *pool_new_segment(void *state, uint32_t length)
+{
+        return SegPool_get(state, length);
+}
+
+static void pool_free_segment(void *state, Segment *segment)
+{
+        SegPool_put(state, segment);
+}
+
+/* Pooled segments are in classes by size, so a resize moves the words to
+ * a segment of the new size */
+static Segment *pool_resize(void *state, Segment *segment, uint32_t length)
+{
+        Segment *moved = SegPool_get(state, length);
+        memcpy(moved->words, segment->words,
+               (size_t)(length < segment->length ? length : segment->length) *
+               sizeof(uint32_t));
+        SegPool_put(state, segment);
+
+        return moved;
+}
+
+static void pool_reset(void *state)
+{
+        SegPool_reset(state);
+}
+
+static void pool_close(void *state)
+{
+        SegPool_T pool = state;
+        SegPool_free(&pool);
+}
+
+/* The pool allocator (see segpool.h) */
+const SegAlloc SegAlloc_pool = {
+        "pool", pool_open, pool_new_segment, pool_free_segment, pool_resize,
+        pool_reset, pool_close
+};
+
+/* SegAlloc_find
+ * Purpose:
+ *      Finds an allocator by name
+ * Arguments:
+ *      (const char *) name - "malloc", "arena" or "pool"
+ * Returns:
+ *      (const SegAlloc *) the allocator, or NULL if there is none by that
+ *      name
+ * Notes:
+ *      - CRE for name to be NULL
+ */
+const SegAlloc *SegAlloc_find(const char *name)
+{
+        assert(name != NULL);
+
+        static const SegAlloc *const allocators[] = {
+                &SegAlloc_malloc, &SegAlloc_arena, &SegAlloc_pool
+        };
+        for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]);
+             i++) {
+                if (strcmp(allocators[i]->name, name) == 0) {
+                        return allocators[i];
+                }
+        }
+        return NULL;
+}
+
+/* segment_bytes
+ * Purpose:
+ *      Works out how big a segment is, rounded up to a multiple of 8 bytes
+ *      so segments carved one after another stay aligned
+ * Arguments:
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (size_t) its size in bytes, header included
+ */
+static size_t segment_bytes(uint32_t length)
+{
+        size_t bytes = sizeof(Segment) + (size_t)length * sizeof(uint32_t);
+
+        return (bytes + 7) & ~(size_t)7;
+}
+
+/* new_chunk
+ * Purpose:
+ *      Allocates a zeroed chunk for an arena
+ * Arguments:
+ *      (size_t) size - How many bytes it has room for
+ *      (Chunk *) next - The chunk to link it in front of
+ * Returns:
+ *      (Chunk *) the chunk, with nothing given out
+ * Notes:
+ *      - CRE if there isn't enough memory for it
+ */
+static Chunk *new_chunk(size_t size, Chunk *next)
+{
+        Chunk *chunk = CALLOC(1, sizeof(Chunk) + size);
+        chunk->next = next;
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->last = NULL;
+
+        return chunk;
+}
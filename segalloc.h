@@ -0,0 +1,57 @@
+/* segalloc.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * The interface between SegMem and whatever allocates its segments, so
+ * allocation strategies can be compared on real programs (um --allocator).
+ * An allocator is a table of hooks, called with the state its open hook
+ * made. Three come with it:
+ *      malloc - every segment is its own allocation from Hanson's mem
+ *      arena  - segments are carved from big chunks and never freed one by
+ *               one; the chunks are freed all at once by reset
+ *      pool   - the size-class pool of segpool.h (the default), which also
+ *               mmaps big segments and can guard them
+ * Every segment an allocator gives out has every word 0
+ */
+
+#ifndef SEGALLOC_H
+#define SEGALLOC_H
+
+#include <stdint.h>
+
+#include "segpool.h"
+
+typedef struct SegAlloc {
+        /* What um --allocator calls it */
+        const char *name;
+
+        /* Makes the state the other hooks are given */
+        void *(*open)(void);
+
+        /* Gives out a segment of length words, every one 0 */
+        Segment *(*new_segment)(void *state, uint32_t length);
+
+        /* Takes back a segment from new_segment or resize */
+        void (*free_segment)(void *state, Segment *segment);
+
+        /* Changes a segment's length, keeping the words it still has and
+         * making any new ones 0. Gives back where the segment is now */
+        Segment *(*resize)(void *state, Segment *segment, uint32_t length);
+
+        /* Frees everything the allocator is holding on to. Any segment it
+         * gave out and which hasn't been freed may be freed with it */
+        void (*reset)(void *state);
+
+        /* Frees the state itself, after a reset */
+        void (*close)(void *state);
+} SegAlloc;
+
+extern const SegAlloc SegAlloc_malloc;
+extern const SegAlloc SegAlloc_arena;
+extern const SegAlloc SegAlloc_pool;
+
+const SegAlloc *SegAlloc_find(const char *name);
+
+#endif
@@ -8,6 +8,10 @@
  * Stores the currently executing code as well as data in 
  * memory. It fetches the next instruction, fetches words from memory, stores 
  * words in memory, maps new segments and unmaps existing segments.
+ *
+ * In guard mode a SIGSEGV handler turns a fault in a guard region (or near
+ * address 0, from an unmapped segment's NULL) into a report of the machine
+ * failure. Only one memory at a time can be guarded
  */
 
 /* Header */
@@ -15,41 +19,81 @@
 
 /* C Std Libs */
 #include <stdint.h> 
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* POSIX */
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* SSE2, which every x86-64 has, for the byte swaps of the loader */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Hanson Libs */
-#include <seq.h>
 #include <mem.h>
 #include <assert.h>
 
-/* Course Libs */
-#include <bitpack.h>
+/* Our Modules */
+#include "fuse.h"
+#include "trace.h"
+#include "io.h"
 
 /* 32 bit words */
 static const int BYTES_IN_WORD = sizeof(word_t) / sizeof(char); 
-static const int BITS_IN_BYTE = sizeof(char) * 8;
 
-/* Guess of how many words a program is when loaded for the first time */
+/* Guess of how many words a program is when it is read from something
+ * other than a file (a pipe), which doesn't say how big it is */
 static const unsigned PROGRAM_SIZE_GUESS = 65536;
-/* Guess of how many segments a program will use */
-static const unsigned SEGMENTS_TO_USE_GUESS = 1024;
+/* Segments of at least this many words (64MB) start out sparse unless
+ * SegMem is told otherwise */
+static const word_t DEFAULT_SPARSE_WORDS = 1 << 24;
+
+/* The segment table has an entry for every possible segment ID: 32GB of
+ * address space, of which only the pages touched take memory */
+static const size_t TABLE_BYTES = ((size_t)UINT32_MAX + 1) * sizeof(Segment *);
+
+/* An unmapped ID's entry holds the next unmapped ID (0 for none) shifted
+ * left, with this bit set to tell it from a segment */
+static const uintptr_t FREE_TAG = 1;
+
+/* A snapshot's memory (see SegMem_save) starts with this many words:
+ * the table's length, the free list's head, the shared ID and padding */
+#define SNAPSHOT_HEADER_WORDS 4
+
+/* An instruction word with an invalid opcode, placed after the last
+ * predecoded instruction so running off the end of the program fails */
+static const word_t END_OF_PROGRAM = 0xf0000000;
 
 /* helper function defintions */
-static word_t read_word(FILE *input);
+static SegMem_T empty_memory(void);
+static Segment *load_image(SegMem_T mem, FILE *input);
+static void check_image_length(size_t bytes);
+static void from_big_endian(word_t *words, size_t count);
+static Segment *mapped_segment(SegMem_T mem, word_t seg_id);
+static void set_entry(SegMem_T mem, word_t seg_id, Segment *segment);
+static Segment *new_segment(SegMem_T mem, word_t length);
+static void release_segment(SegMem_T mem, Segment *segment);
+static void make_dense(SegMem_T mem, word_t seg_id);
+static void save_words(const Segment *segment, FILE *snapshot);
+static bool restore_table(SegMem_T mem, const char *image, size_t bytes);
+static uint64_t snapshot_segment_bytes(word_t length);
+static void unshare(SegMem_T mem);
+static void drop_parked(SegMem_T mem);
+static void decode_program(SegMem_T mem);
+static void free_program(SegMem_T mem);
+static void guard_fault(int sig, siginfo_t *info, void *context);
+static void write_text(const char *text);
+static void write_number(uint64_t number);
 
-/* Defines the implementation of a SegMen_T instance */
-struct SegMem_T {
-        /* Sequence of segments (represented as sequences) */
-        Seq_T data_segments;
-        
-        /* Sequence of segment IDs. Seq represents a stack
-         * INVARIANT: Holds unmapped segment IDs (which had been previously 
-         * mapped)
-         * Note: Use high as the top of the stack */
-        Seq_T unmapped_stack;
-        
-        /* Index in seg0 of next instruction to run (instruction pointer) */
-        word_t ip;
-};
+/* The memory whose faults guard_fault reports, or NULL */
+static SegMem_T guarded_mem = NULL;
+
+/* struct SegMem_T is in segmem.h, for the inline fast paths */
 
 /* SegMem_new
  * Purpose: 
@@ -64,65 +108,230 @@ struct SegMem_T {
  *                 the universal machine 
  * Notes: 
  *      - CRE for input_file to be NULL
- *      - CRE for the file to end in the middle of a 32-bit word
+ *      - CRE if the segment table's address space can't be reserved
+ *      - Exits with an error if the file ends in the middle of a 32-bit
+ *        word, in every build (asserts are compiled out of um-fast)
  *      - Reads file till the end but does not close it
  */
 SegMem_T SegMem_new(FILE *input)
 {
         assert(input != NULL);
         
-        Seq_T seg0 = Seq_new(PROGRAM_SIZE_GUESS);
-        
-        /* Read in file one 32-bit word at a time */
-        int c;
-        while (!feof(input)) {
-                /* Check to make sure we aren't at the end of a file */
-                c = fgetc(input);
-                if (c != EOF) {
-                        ungetc(c, input);
-                        Seq_addhi(seg0, (void *)(uintptr_t)read_word(input)); 
-                }
+        SegMem_T new_mem = empty_memory();
+        Segment *seg0 = load_image(new_mem, input);
+        new_mem->segments[0] = seg0;
+        new_mem->segments_length = 1;
+        for (word_t k = 0; k < SEGMENT_CACHE_WAYS; k++) {
+                new_mem->cached_segment[k] = seg0;
         }
+        
+        return new_mem;
+}
 
-        /* Put struct together */
+/* empty_memory
+ * Purpose:
+ *      Puts together a memory with no segments at all, not even segment 0
+ * Returns:
+ *      (SegMem_T) the memory, whose segments_length is 0
+ * Notes:
+ *      - Every segment comes from the pool allocator until
+ *        SegMem_set_allocator says otherwise
+ *      - CRE if the segment table's address space can't be reserved
+ *      - The fast paths' cache holds NULL for segment 0 until the caller
+ *        puts segment 0 into it
+ */
+static SegMem_T empty_memory(void)
+{
         SegMem_T new_mem = NEW(new_mem);
-        Seq_T data_segments = Seq_new(SEGMENTS_TO_USE_GUESS);
-        Seq_addhi(data_segments, seg0);
-        new_mem->data_segments = data_segments;
-        new_mem->unmapped_stack = Seq_new(SEGMENTS_TO_USE_GUESS);
+        new_mem->alloc = &SegAlloc_pool;
+        new_mem->alloc_state = SegAlloc_pool.open();
+        new_mem->sparse_words = DEFAULT_SPARSE_WORDS;
+        new_mem->sparse_segments = 0;
+        new_mem->guard = false;
+        new_mem->access_ip = 0;
+        new_mem->shared_id = 0;
+        new_mem->parked_id = 0;
+        new_mem->parked_program = NULL;
+        new_mem->parked_length = 0;
+        new_mem->segments = mmap(NULL, TABLE_BYTES, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0);
+        assert(new_mem->segments != MAP_FAILED);
+        new_mem->segments_length = 0;
+        new_mem->free_head = 0;
+        new_mem->trace = NULL;
+        new_mem->snapshot = NULL;
+        new_mem->snapshot_bytes = 0;
+        for (word_t k = 0; k < SEGMENT_CACHE_WAYS; k++) {
+                new_mem->cached_id[k] = 0;
+                new_mem->cached_segment[k] = NULL;
+        }
+        new_mem->cache_lookups = 0;
+        new_mem->cache_hits = 0;
         new_mem->ip = 0;
-        
+        new_mem->program = NULL;
+        new_mem->program_length = 0;
+        new_mem->fuse = true;
+        new_mem->watched = NULL;
+        new_mem->watch_hit = false;
+
         return new_mem;
 }
 
 
 
-/* read_word
+/* load_image
  * Purpose:
- *      Read a single 32-bit word from an input in Big-Endian order
+ *      Reads a program into a new segment, which is to be segment 0
  * Arguments:
- *      (FILE *) input
- * Returns: 
- *      (word_t) the bitpacked word in big endian from input
+ *      (SegMem_T) mem - The memory, whose allocator the segment comes from
+ *      (FILE *) input - Where to read the program from, to its end
+ * Returns:
+ *      (Segment *) the segment, as long as the program exactly
  * Notes:
- *      - CRE for input to be NULL
- *      - CRE for file to end in the middle of a 32-bit word
+ *      - A regular file is read with one fread straight into a segment of
+ *        the size it says it is; anything else through a buffer doubled
+ *        whenever it fills up
+ *      - The words are then swapped from big-endian all at once (see
+ *        from_big_endian)
+ *      - Exits with an error if the program isn't a whole number of words
  */
-static word_t read_word(FILE *input) 
+static Segment *load_image(SegMem_T mem, FILE *input)
 {
-        assert(input != NULL);
-        
-        /* bitpack 32 bit word with data from file in big endian order */
-        word_t word = 0;
-        int c;
-        for (int i = BYTES_IN_WORD - 1; i >= 0; i--) {
-                c = fgetc(input);
-                assert(c != EOF);
+        struct stat info;
+        long start = ftell(input);
+        if (start >= 0 && fstat(fileno(input), &info) == 0 &&
+            S_ISREG(info.st_mode)) {
+                size_t bytes = info.st_size > start ?
+                               (size_t)(info.st_size - start) : 0;
+                check_image_length(bytes);
+
+                Segment *seg0 = new_segment(mem, bytes / BYTES_IN_WORD);
+                size_t got = fread(seg0->words, 1, bytes, input);
+                check_image_length(got);
+                if (got < bytes) {
+                        /* The file shrank since fstat */
+                        seg0 = mem->alloc->resize(mem->alloc_state, seg0,
+                                                  got / BYTES_IN_WORD);
+                }
+                from_big_endian(seg0->words, seg0->length);
+                return seg0;
+        }
 
-                word = Bitpack_newu(word, 8, i * BITS_IN_BYTE, c); 
+        size_t capacity = PROGRAM_SIZE_GUESS * BYTES_IN_WORD;
+        size_t bytes = 0;
+        char *buffer = ALLOC(capacity);
+        size_t got;
+        while ((got = fread(buffer + bytes, 1, capacity - bytes, input)) > 0) {
+                bytes += got;
+                if (bytes == capacity) {
+                        capacity *= 2;
+                        RESIZE(buffer, capacity);
+                }
         }
+        check_image_length(bytes);
 
-        return word;
+        Segment *seg0 = new_segment(mem, bytes / BYTES_IN_WORD);
+        memcpy(seg0->words, buffer, bytes);
+        FREE(buffer);
+        from_big_endian(seg0->words, seg0->length);
+        return seg0;
+}
+
+/* check_image_length
+ * Purpose:
+ *      Makes sure a program is a whole number of 32-bit words, and no more
+ *      than a segment can hold
+ * Arguments:
+ *      (size_t) bytes - How long the program is
+ * Notes:
+ *      - Exits with EXIT_FAILURE, after saying why on stderr, if it isn't
+ */
+static void check_image_length(size_t bytes)
+{
+        if (bytes % BYTES_IN_WORD != 0) {
+                fprintf(stderr, "um: the program is %zu bytes, which isn't "
+                        "a whole number of 32-bit words\n", bytes);
+                exit(EXIT_FAILURE);
+        }
+        if (bytes / BYTES_IN_WORD > UINT32_MAX) {
+                fprintf(stderr, "um: the program is %zu bytes, more than "
+                        "segment 0 can hold\n", bytes);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* from_big_endian
+ * Purpose:
+ *      Turns words read straight from a program, which stores them
+ *      big-endian, into words of this machine
+ * Arguments:
+ *      (word_t *) words - The words, swapped in place
+ *      (size_t) count - How many there are
+ * Notes:
+ *      - With SSE2 it swaps 4 words at a time: the bytes of each 16-bit
+ *        half by shifting, then the halves by shuffling. pshufb could do
+ *        both at once, but needs SSSE3, which the build doesn't assume
+ *      - Does nothing on a big-endian machine
+ */
+static void from_big_endian(word_t *words, size_t count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= count; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i *)&words[i]);
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+                v = _mm_shufflelo_epi16(v, 0xb1);
+                v = _mm_shufflehi_epi16(v, 0xb1);
+                _mm_storeu_si128((__m128i *)&words[i], v);
+        }
+#endif
+        for (; i < count; i++) {
+                words[i] = __builtin_bswap32(words[i]);
+        }
+#else
+        (void)words;
+        (void)count;
+#endif
+}
+
+/* mapped_segment
+ * Purpose:
+ *      Looks up a segment ID in the segment table
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (word_t) seg_id - Any segment ID
+ * Returns:
+ *      (Segment *) the segment, or NULL if seg_id isn't mapped
+ * Notes:
+ *      - Safe to call from a signal handler
+ */
+static Segment *mapped_segment(SegMem_T mem, word_t seg_id)
+{
+        Segment *segment = mem->segments[seg_id];
+        if (((uintptr_t)segment & FREE_TAG) != 0) {
+                return NULL;
+        }
+        return segment;
+}
+
+/* set_entry
+ * Purpose:
+ *      Changes the table entry of a segment ID, and the fast paths' cache
+ *      if it holds that entry
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (word_t) seg_id - Which entry
+ *      (Segment *) segment - Its new value
+ */
+static void set_entry(SegMem_T mem, word_t seg_id, Segment *segment)
+{
+        word_t k = seg_id & (SEGMENT_CACHE_WAYS - 1);
+        mem->segments[seg_id] = segment;
+        if (seg_id == mem->cached_id[k]) {
+                mem->cached_segment[k] = segment;
+        }
 }
 
 /* SegMem_fetch_next_i
@@ -134,18 +343,253 @@ static word_t read_word(FILE *input)
  *      (word_t) that contains the next instruction for the um to execute
  * Notes:
  *      - CRE for mem to be NULL 
- *      - CRE for mem->data_segments to be NULL
- *      - URE for the next instruction to be asked for when there are no more
+ *      - CRE for mem->segments to be NULL
+ *      - CRE for the next instruction to be asked for when there are no more
  *        instructions
  */
 word_t SegMem_fetch_next_i(SegMem_T mem)
 {
         assert(mem != NULL);
-        assert(mem->data_segments != NULL);
+        assert(mem->segments != NULL);
 
-        Seq_T seg0 = Seq_get(mem->data_segments, 0);
+        Segment *seg0 = mem->segments[0];
+        assert(mem->ip < seg0->length);
         
-        return (uintptr_t)Seq_get(seg0, mem->ip++);
+        return seg0->words[mem->ip++];
+}
+
+/* SegMem_program
+ * Purpose:
+ *      Gives back segment 0 as an array of predecoded instructions, decoding
+ *      it first if it was replaced since it was last decoded
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program
+ *      (word_t *) length - Set to the number of instructions in segment 0
+ * Returns:
+ *      (const Um_instr *) array of length + 1 instructions. Entry i is word i
+ *                         of segment 0 decoded, entry length has an invalid
+ *                         opcode so running off the end fails
+ * Notes:
+ *      - CRE for mem or length to be NULL
+ *      - The array stays valid (and is updated in place by stores into
+ *        segment 0) until the next SegMem_load_program from a segment other
+ *        than 0 or SegMem_free
+ */
+const Um_instr *SegMem_program(SegMem_T mem, word_t *length)
+{
+        assert(mem != NULL);
+        assert(length != NULL);
+
+        if (mem->program == NULL) {
+                decode_program(mem);
+        }
+
+        *length = mem->program_length;
+        return mem->program;
+}
+
+/* SegMem_set_fusion
+ * Purpose:
+ *      Turns superinstructions (see fuse.h) in the predecoded program on or
+ *      off. They are on by default
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program
+ *      (bool) fuse - Whether to use superinstructions
+ * Notes:
+ *      - CRE for mem to be NULL
+ *      - Invalidates any array SegMem_program gave out
+ */
+void SegMem_set_fusion(SegMem_T mem, bool fuse)
+{
+        assert(mem != NULL);
+
+        mem->fuse = fuse;
+        free_program(mem);
+        drop_parked(mem);
+}
+
+/* SegMem_watch_program
+ * Purpose:
+ *      Asks to hear about stores into some words of segment 0, for engines
+ *      which keep their own translations of the program
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program
+ *      (const uint8_t *) watched - One flag per word of segment 0, nonzero
+ *                                  for the words to watch, or NULL to stop
+ *                                  watching. Read, never written or freed
+ * Notes:
+ *      - CRE for mem to be NULL
+ *      - watched must stay alive until it is replaced or the program is
+ *        replaced by a LOADP, which stops the watching
+ *      - Clears any hit not yet reported
+ */
+void SegMem_watch_program(SegMem_T mem, const uint8_t *watched)
+{
+        assert(mem != NULL);
+
+        mem->watched = watched;
+        mem->watch_hit = false;
+}
+
+/* SegMem_watch_hit
+ * Purpose:
+ *      Tells whether a watched word of segment 0 (see SegMem_watch_program)
+ *      has been stored into since the last time it was asked
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the program
+ * Returns:
+ *      (bool) true if there has been such a store
+ * Notes:
+ *      - CRE for mem to be NULL
+ */
+bool SegMem_watch_hit(SegMem_T mem)
+{
+        assert(mem != NULL);
+
+        bool hit = mem->watch_hit;
+        mem->watch_hit = false;
+        return hit;
+}
+
+/* new_segment
+ * Purpose:
+ *      Gets a dense segment, every word 0, from the memory's allocator
+ * Arguments:
+ *      (SegMem_T) mem - The memory the segment is for
+ *      (word_t) length - How many words it holds
+ * Returns:
+ *      (Segment *) the segment
+ */
+static Segment *new_segment(SegMem_T mem, word_t length)
+{
+        return mem->alloc->new_segment(mem->alloc_state, length);
+}
+
+/* release_segment
+ * Purpose:
+ *      Gives back a segment which is no longer in use: a sparse one is
+ *      freed, one in a restored snapshot is left there (the snapshot is
+ *      unmapped all at once by SegMem_free), any other goes back to the
+ *      allocator
+ * Arguments:
+ *      (SegMem_T) mem - The memory the segment belonged to
+ *      (Segment *) segment - The segment
+ */
+static void release_segment(SegMem_T mem, Segment *segment)
+{
+        if (segment->kind == SEGMENT_SPARSE) {
+                Sparse_free(&segment);
+                mem->sparse_segments--;
+        } else if (segment->kind != SEGMENT_SNAPSHOT) {
+                mem->alloc->free_segment(mem->alloc_state, segment);
+        }
+}
+
+/* make_dense
+ * Purpose:
+ *      Replaces a sparse segment with a dense copy of it
+ * Arguments:
+ *      (SegMem_T) mem - The memory holding the segment
+ *      (word_t) seg_id - Which segment, which must be sparse
+ * Notes:
+ *      - With the pool allocator a big dense copy is mmapped, so only the
+ *        pages written so far are touched
+ */
+static void make_dense(SegMem_T mem, word_t seg_id)
+{
+        Segment *sparse = mem->segments[seg_id];
+        assert(sparse->kind == SEGMENT_SPARSE);
+
+        Segment *dense = new_segment(mem, sparse->length);
+        Sparse_copy(sparse, dense->words);
+        Sparse_free(&sparse);
+        mem->sparse_segments--;
+        set_entry(mem, seg_id, dense);
+}
+
+/* unshare
+ * Purpose:
+ *      Gives segment 0 a copy of the words it shares with another segment,
+ *      so that either can be stored into
+ * Arguments:
+ *      (SegMem_T) mem - The memory, whose segment 0 shares its words
+ * Notes:
+ *      - The predecoded program stays valid, since the words are the same
+ */
+static void unshare(SegMem_T mem)
+{
+        Segment *shared = mem->segments[0];
+        assert(mem->shared_id != 0);
+
+        Segment *copy = new_segment(mem, shared->length);
+        memcpy(copy->words, shared->words,
+               (size_t)shared->length * sizeof(word_t));
+        set_entry(mem, 0, copy);
+        mem->shared_id = 0;
+}
+
+/* drop_parked
+ * Purpose:
+ *      Throws away the decoding kept for a segment segment 0 shared before
+ *      (if there is one)
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ */
+static void drop_parked(SegMem_T mem)
+{
+        if (mem->parked_program != NULL) {
+                FREE(mem->parked_program);
+        }
+        mem->parked_id = 0;
+        mem->parked_length = 0;
+}
+
+/* decode_program
+ * Purpose:
+ *      Decodes every word of segment 0 into mem->program, and finds the
+ *      superinstructions in it unless fusion is turned off
+ * Arguments:
+ *      (SegMem_T) mem - The memory whose segment 0 should be decoded
+ * Notes:
+ *      - CRE for mem to be NULL or for mem->program to already exist
+ */
+static void decode_program(SegMem_T mem)
+{
+        assert(mem != NULL);
+        assert(mem->program == NULL);
+
+        Segment *seg0 = mem->segments[0];
+        word_t length = seg0->length;
+
+        Um_instr *program = CALLOC(length + 1, sizeof(Um_instr));
+        for (word_t i = 0; i < length; i++) {
+                decode_instr(seg0->words[i], &program[i]);
+        }
+        decode_instr(END_OF_PROGRAM, &program[length]);
+        if (mem->fuse) {
+                Fuse_program(program, length);
+        }
+
+        mem->program = program;
+        mem->program_length = length;
+}
+
+/* free_program
+ * Purpose:
+ *      Throws away the predecoded copy of segment 0 (if there is one)
+ * Arguments:
+ *      (SegMem_T) mem - The memory whose predecoded program to free
+ * Notes:
+ *      - CRE for mem to be NULL
+ */
+static void free_program(SegMem_T mem)
+{
+        assert(mem != NULL);
+
+        if (mem->program != NULL) {
+                FREE(mem->program);
+        }
+        mem->program_length = 0;
 }
 
 /* SegMem_map
@@ -158,41 +602,39 @@ word_t SegMem_fetch_next_i(SegMem_T mem)
  *      (word_t) that contains the segment identifier for the newly mapped
  *                 segment
  * Notes:
- *      - CRE for mem to be NULL or mem->data_segments, or mem_unmapped_stack
- *        to be NULL
- *      - CRE for a segment to be mapped if 2^32 segments are already mapped
+ *      - CRE for mem or mem->segments to be NULL
+ *      - CRE for a segment to be mapped if 2^32 - 1 segments are already
+ *        mapped
  *      - CRE if there isn't enough memory to map a segment of the given size
- *      - The Hanson sequence implementation can only store a max of 2^31 
- *        segements at once
- *              - Regardless, storing 2^31 segments (if empty, they're still
- *                void pointers which take 8 bytes of memory) would use ~17 GB 
- *                of memory, which is outside the mem scope (of our program)
- *              - And storing 2^32 32-bit words (hypothetically the max in
- *                one segment) would take the same amount of memory and would
- *                not be supported by the Hanson sequence 
+ *      - A segment takes 4 bytes per word plus an 8 byte header, so the
+ *        largest (2^32 - 1 words) needs 16 GB, unless it is sparse
  */
 word_t SegMem_map(SegMem_T mem, word_t size)
 {
         assert(mem != NULL); 
-        assert(mem->data_segments != NULL);
-        assert(mem->unmapped_stack != NULL); 
+        assert(mem->segments != NULL);
 
-        /* make a new sequence of the correct length filled with 0s */
-        Seq_T new_seg = Seq_new(size);
-        for (uint32_t i = 0; i < size; i++) {
-                Seq_addhi(new_seg, (void *)(uintptr_t)0x0);
+        /* make a new segment of the correct length filled with 0s */
+        Segment *new_seg;
+        if (size >= mem->sparse_words && !mem->guard) {
+                new_seg = Sparse_new(size);
+                mem->sparse_segments++;
+        } else {
+                new_seg = new_segment(mem, size);
         }
         
-        /* Figure out what segment id this segment should be */
+        /* Take the last unmapped ID off the free list, or a new one */
         word_t segment_id;
-        if (Seq_length(mem->unmapped_stack) > 0) {
-                /* We have an unmapped space in data_segments */
-                segment_id = (uintptr_t)Seq_remhi(mem->unmapped_stack);
-                Seq_put(mem->data_segments, segment_id, new_seg);
+        if (mem->free_head != 0) {
+                segment_id = mem->free_head;
+                mem->free_head = (uintptr_t)mem->segments[segment_id] >> 1;
         } else {
-                /* Need to expand data_segments */
-                Seq_addhi(mem->data_segments, new_seg);
-                segment_id = Seq_length(mem->data_segments) - 1;
+                assert(mem->segments_length < UINT32_MAX);
+                segment_id = mem->segments_length++;
+        }
+        set_entry(mem, segment_id, new_seg);
+        if (mem->trace != NULL) {
+                Trace_map(mem->trace, size, segment_id);
         }
 
         return segment_id;
@@ -205,27 +647,558 @@ word_t SegMem_map(SegMem_T mem, word_t size)
  *      (SegMem_T) mem - The memory to unmap the segment in
  *      (word_t) seg_id - Which segment to unmap
  * Notes:
- *      - CRE for mem, mem->data_segments, or mem->unmapped_stack to be NULL
- *      - URE if unmapping a segment that is not mapped.
+ *      - CRE for mem or mem->segments to be NULL
+ *      - CRE if unmapping a segment that is not mapped (or segment 0)
  */
 void SegMem_unmap(SegMem_T mem, word_t seg_id)
 {
         assert(mem != NULL);
-        assert(mem->data_segments != NULL);
-        assert(mem->unmapped_stack != NULL);
+        assert(mem->segments != NULL);
 
         /* Get segment to unmap */
-        Seq_T segment = Seq_get(mem->data_segments, seg_id);
+        assert(seg_id != 0);
+        Segment *segment = mapped_segment(mem, seg_id);
         assert(segment != NULL);
 
-        /* Free it and put NULL in its place */
-        Seq_free(&segment);
-        Seq_put(mem->data_segments, seg_id, NULL); 
+        /* Give it back. If segment 0 shares it, segment 0 keeps it */
+        if (seg_id == mem->shared_id) {
+                mem->shared_id = 0;
+        } else {
+                release_segment(mem, segment);
+        }
+        if (seg_id == mem->parked_id) {
+                drop_parked(mem);
+        }
         
-        /* Save its ID in our stack to reuse */
-        Seq_addhi(mem->unmapped_stack, (void *)(uintptr_t)seg_id);
+        /* Put its ID at the head of the free list to reuse */
+        set_entry(mem, seg_id, (Segment *)(((uintptr_t)mem->free_head << 1) |
+                                           FREE_TAG));
+        mem->free_head = seg_id;
+        if (mem->trace != NULL) {
+                Trace_unmap(mem->trace, seg_id);
+        }
+}
+
+
+/* SegMem_set_allocator
+ * Purpose:
+ *      Switches the memory to another allocator (see segalloc.h) for its
+ *      segments
+ * Arguments:
+ *      (SegMem_T) mem - The memory, with only segment 0 ever mapped
+ *      (const SegAlloc *) alloc - The allocator to use from then on
+ * Notes:
+ *      - Does nothing if alloc is already the memory's allocator
+ *      - Otherwise CRE for mem or alloc to be NULL, for a segment other
+ *        than 0 to have been mapped, or for guard pages to be on
+ *      - Segment 0 is moved into a segment from the new allocator, and the
+ *        old allocator is reset and closed
+ */
+void SegMem_set_allocator(SegMem_T mem, const SegAlloc *alloc)
+{
+        assert(mem != NULL);
+        assert(alloc != NULL);
+
+        if (alloc == mem->alloc) {
+                return;
+        }
+        assert(mem->segments_length == 1);
+        assert(!mem->guard);
+
+        const SegAlloc *old_alloc = mem->alloc;
+        void *old_state = mem->alloc_state;
+        mem->alloc = alloc;
+        mem->alloc_state = alloc->open();
+
+        Segment *seg0 = mem->segments[0];
+        Segment *copy = new_segment(mem, seg0->length);
+        memcpy(copy->words, seg0->words, (size_t)seg0->length *
+                                         sizeof(word_t));
+        set_entry(mem, 0, copy);
+
+        old_alloc->free_segment(old_state, seg0);
+        old_alloc->reset(old_state);
+        old_alloc->close(old_state);
+}
+
+/* SegMem_set_mmap_words
+ * Purpose:
+ *      Sets how big a segment has to be to get its memory straight from
+ *      mmap, zeroed by the kernel page by page as it is first touched
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (word_t) words - The smallest length of segment to mmap
+ * Notes:
+ *      - CRE for mem to be NULL, or for its allocator not to be the pool
+ *      - Only affects segments mapped (or loaded) from then on
+ */
+void SegMem_set_mmap_words(SegMem_T mem, word_t words)
+{
+        assert(mem != NULL);
+        assert(mem->alloc == &SegAlloc_pool);
+
+        SegPool_set_mmap_words(mem->alloc_state, words);
+}
+
+/* SegMem_set_sparse_words
+ * Purpose:
+ *      Sets how big a segment has to be to start out sparse, storing only
+ *      the pages written (see sparse.h)
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (word_t) words - The smallest length of segment to map as sparse
+ * Notes:
+ *      - CRE for mem to be NULL
+ *      - Only affects segments mapped from then on
+ */
+void SegMem_set_sparse_words(SegMem_T mem, word_t words)
+{
+        assert(mem != NULL);
+
+        mem->sparse_words = words;
+}
+
+/* SegMem_set_guard
+ * Purpose:
+ *      Turns guard pages on or off: every segment mapped (or loaded) from
+ *      then on is followed by GUARD_BYTES which fault when touched (see
+ *      segpool.h), and a fault there or in an unmapped segment is reported,
+ *      with the instruction and segment, before exiting with EXIT_FAILURE
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (bool) guard - Whether to guard its segments
+ * Notes:
+ *      - CRE for mem to be NULL, for its allocator not to be the pool, or
+ *        for another memory to be guarded
+ *      - Segment 0 is moved into a guarded segment straight away
+ *      - No segments are sparse while guarded
+ *      - Only catches overruns of less than GUARD_BYTES; the checks of
+ *        SegMem_get_word and SegMem_put_word (outside NDEBUG) catch all
+ */
+void SegMem_set_guard(SegMem_T mem, bool guard)
+{
+        assert(mem != NULL);
+        assert(mem->alloc == &SegAlloc_pool);
+        assert(guarded_mem == NULL || guarded_mem == mem);
+
+        mem->guard = guard;
+        SegPool_set_guard(mem->alloc_state, guard);
+        if (!guard) {
+                guarded_mem = NULL;
+                return;
+        }
+
+        Segment *seg0 = mem->segments[0];
+        Segment *copy = new_segment(mem, seg0->length);
+        memcpy(copy->words, seg0->words, (size_t)seg0->length *
+                                         sizeof(word_t));
+        if (mem->shared_id == 0) {
+                release_segment(mem, seg0);
+        }
+        set_entry(mem, 0, copy);
+        mem->shared_id = 0;
+
+        guarded_mem = mem;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = guard_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, NULL);
+        sigaction(SIGBUS, &action, NULL);
+}
+
+/* SegMem_set_trace
+ * Purpose:
+ *      Starts recording every MAP and UNMAP to a trace (see trace.h)
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (FILE *) trace - A file opened for writing, at its start, or NULL
+ *                       to stop recording
+ * Notes:
+ *      - CRE for mem to be NULL
+ *      - The file is the caller's to close, after the memory is freed or
+ *        recording is stopped
+ */
+void SegMem_set_trace(SegMem_T mem, FILE *trace)
+{
+        assert(mem != NULL);
+
+        if (trace != NULL) {
+                Trace_start(trace);
+        }
+        mem->trace = trace;
+}
+
+/* SegMem_save
+ * Purpose:
+ *      Writes the whole memory into a snapshot (see snapshot.h), for
+ *      SegMem_restore to restore: the segment table, with the stack of
+ *      unmapped IDs threaded through it, and every mapped segment
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (FILE *) snapshot - A file opened for writing, where the memory goes
+ * Notes:
+ *      - CRE for either argument to be NULL
+ *      - Writes, in the machine's own byte order:
+ *              the table's length, the head of the free list, the ID
+ *              segment 0 shares (or 0), and a word of padding
+ *              an 8 byte entry per ID: where its segment is, counting from
+ *              the start of the memory, or the next unmapped ID shifted
+ *              left with FREE_TAG set, as in the table
+ *              every segment, as a Segment (marked SEGMENT_SNAPSHOT)
+ *              padded to 8 bytes
+ *      - Segment 0 and the segment it shares are written once, and both
+ *        entries point there. A sparse segment's pages of zeros are left as
+ *        holes in the file (see save_words)
+ *      - Whether it could all be written is the caller's to check, with
+ *        ferror
+ */
+void SegMem_save(SegMem_T mem, FILE *snapshot)
+{
+        assert(mem != NULL);
+        assert(snapshot != NULL);
+
+        word_t header[SNAPSHOT_HEADER_WORDS] = {
+                mem->segments_length, mem->free_head, mem->shared_id, 0
+        };
+        fwrite(header, sizeof(word_t), SNAPSHOT_HEADER_WORDS, snapshot);
+
+        /* Lay the segments out after the table */
+        uint64_t *table = CALLOC(mem->segments_length, sizeof(uint64_t));
+        uint64_t at = sizeof(header) +
+                      (uint64_t)mem->segments_length * sizeof(uint64_t);
+        for (word_t i = 0; i < mem->segments_length; i++) {
+                Segment *segment = mapped_segment(mem, i);
+                if (segment == NULL) {
+                        table[i] = (uintptr_t)mem->segments[i];
+                } else if (i != 0 || mem->shared_id == 0) {
+                        table[i] = at;
+                        at += snapshot_segment_bytes(segment->length);
+                }
+        }
+        if (mem->shared_id != 0) {
+                table[0] = table[mem->shared_id];
+        }
+        fwrite(table, sizeof(uint64_t), mem->segments_length, snapshot);
+        FREE(table);
+
+        for (word_t i = 0; i < mem->segments_length; i++) {
+                Segment *segment = mapped_segment(mem, i);
+                if (segment == NULL || (i == 0 && mem->shared_id != 0)) {
+                        continue;
+                }
+                Segment saved = { segment->length, SEGMENT_SNAPSHOT };
+                fwrite(&saved, sizeof(saved), 1, snapshot);
+                save_words(segment, snapshot);
+                if (segment->length % 2 != 0) {
+                        word_t padding = 0;
+                        fwrite(&padding, sizeof(padding), 1, snapshot);
+                }
+        }
+}
+
+/* save_words
+ * Purpose:
+ *      Writes every word of a segment
+ * Arguments:
+ *      (const Segment *) segment - The segment, of any kind
+ *      (FILE *) snapshot - Where to write them
+ * Notes:
+ *      - A sparse segment goes a page (1K words) at a time, and a page
+ *        of zeros is seeked past rather than written, leaving a hole in
+ *        the file that reads back as zeros. A huge sparse segment so
+ *        takes only the disk its written pages do
+ *      - The segment's last page is always written, so the file reaches
+ *        its end even when the memory ends in a hole. If the seek fails
+ *        the zeros are written instead
+ */
+static void save_words(const Segment *segment, FILE *snapshot)
+{
+        if (segment->kind != SEGMENT_SPARSE) {
+                fwrite(segment->words, sizeof(word_t), segment->length,
+                       snapshot);
+                return;
+        }
+
+        word_t chunk[1024];
+        for (word_t i = 0; i < segment->length; ) {
+                word_t count = 0;
+                bool zeros = true;
+                while (count < 1024 && i < segment->length) {
+                        chunk[count] = Sparse_get(segment, i++);
+                        zeros = zeros && chunk[count] == 0;
+                        count++;
+                }
+                if (zeros && i < segment->length &&
+                    fseek(snapshot, sizeof(chunk), SEEK_CUR) == 0) {
+                        continue;
+                }
+                fwrite(chunk, sizeof(word_t), count, snapshot);
+        }
+}
+
+/* SegMem_restore
+ * Purpose:
+ *      Restores a memory saved by SegMem_save, with the same segments
+ *      mapped and the same IDs to be mapped next
+ * Arguments:
+ *      (FILE *) snapshot - A snapshot opened for reading, at the start of
+ *                          the memory
+ * Returns:
+ *      (SegMem_T) the memory, or NULL if snapshot isn't a regular file or
+ *                 what follows isn't a memory SegMem_save wrote
+ * Notes:
+ *      - CRE for snapshot to be NULL
+ *      - The whole file is mmapped (privately, so nothing is written back
+ *        to it), and the segments are left where they are in it, so this
+ *        takes about as long as reading the segment table. Only the pages
+ *        the program goes on to use are ever read, and only those it
+ *        stores into are copied
+ *      - Segments unmapped later are left in the mapping, which is
+ *        unmapped by SegMem_free
+ *      - The file may be closed straight away
+ *      - The memory has the pool allocator for the segments mapped from
+ *        then on, and SegMem_set_allocator can't change that
+ */
+SegMem_T SegMem_restore(FILE *snapshot)
+{
+        assert(snapshot != NULL);
+
+        struct stat info;
+        long start = ftell(snapshot);
+        if (start < 0 || fstat(fileno(snapshot), &info) != 0 ||
+            !S_ISREG(info.st_mode) || info.st_size <= start) {
+                return NULL;
+        }
+        void *map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fileno(snapshot), 0);
+        if (map == MAP_FAILED) {
+                return NULL;
+        }
+
+        SegMem_T mem = empty_memory();
+        mem->snapshot = map;
+        mem->snapshot_bytes = info.st_size;
+        if (!restore_table(mem, (char *)map + start, info.st_size - start)) {
+                SegMem_free(&mem);
+                return NULL;
+        }
+        for (word_t k = 0; k < SEGMENT_CACHE_WAYS; k++) {
+                mem->cached_segment[k] = mem->segments[0];
+        }
+
+        return mem;
+}
+
+/* restore_table
+ * Purpose:
+ *      Fills in an empty memory's segment table from a snapshot, checking
+ *      that every entry is in bounds
+ * Arguments:
+ *      (SegMem_T) mem - The memory, from empty_memory
+ *      (const char *) image - The memory in the snapshot's mapping
+ *      (size_t) bytes - How much of the mapping is from image on
+ * Returns:
+ *      (bool) false if image isn't a memory SegMem_save wrote, in which
+ *             case the memory is left with no segments, true otherwise
+ */
+static bool restore_table(SegMem_T mem, const char *image, size_t bytes)
+{
+        word_t header[SNAPSHOT_HEADER_WORDS];
+        if (bytes < sizeof(header)) {
+                return false;
+        }
+        memcpy(header, image, sizeof(header));
+        word_t length = header[0];
+        word_t free_head = header[1];
+        word_t shared_id = header[2];
+        uint64_t table_end = sizeof(header) + (uint64_t)length *
+                                              sizeof(uint64_t);
+        if (length == 0 || table_end > bytes || free_head >= length ||
+            shared_id >= length) {
+                return false;
+        }
+
+        for (word_t i = 0; i < length; i++) {
+                uint64_t entry;
+                memcpy(&entry, image + sizeof(header) + (uint64_t)i *
+                                                        sizeof(entry),
+                       sizeof(entry));
+                if ((entry & FREE_TAG) != 0) {
+                        if (i == 0 || (entry >> 1) >= length) {
+                                return false;
+                        }
+                        mem->segments[i] = (Segment *)(uintptr_t)entry;
+                        continue;
+                }
+
+                Segment *segment = (Segment *)(image + entry);
+                if (entry < table_end || entry % 8 != 0 ||
+                    entry + sizeof(Segment) > bytes ||
+                    entry + snapshot_segment_bytes(segment->length) > bytes ||
+                    segment->kind != SEGMENT_SNAPSHOT) {
+                        return false;
+                }
+                mem->segments[i] = segment;
+        }
+        if ((shared_id != 0 && mem->segments[0] != mem->segments[shared_id]) ||
+            (free_head != 0 && mapped_segment(mem, free_head) != NULL)) {
+                return false;
+        }
+
+        mem->segments_length = length;
+        mem->free_head = free_head;
+        mem->shared_id = shared_id;
+        return true;
+}
+
+/* snapshot_segment_bytes
+ * Purpose:
+ *      Works out how much of a snapshot a segment takes
+ * Arguments:
+ *      (word_t) length - How many words the segment holds
+ * Returns:
+ *      (uint64_t) the size of its Segment, padded to 8 bytes
+ */
+static uint64_t snapshot_segment_bytes(word_t length)
+{
+        return (sizeof(Segment) + (uint64_t)length * sizeof(word_t) + 7) &
+               ~(uint64_t)7;
 }
 
+/* guard_fault
+ * Purpose:
+ *      Handles SIGSEGV and SIGBUS in guard mode: reports a fault in the
+ *      guard region of a segment, or in an unmapped segment, and exits
+ * Arguments:
+ *      (int) sig - Which signal
+ *      (siginfo_t *) info - Holds the address which faulted
+ *      (void *) context - Unused
+ * Notes:
+ *      - Any other fault is a bug in the um itself, so the default action
+ *        is put back and the fault happens again when this returns
+ *      - The output so far is written first (Io_flush_at_fault), since
+ *        _exit skips Io_close
+ *      - Only calls async-signal-safe functions
+ */
+static void guard_fault(int sig, siginfo_t *info, void *context)
+{
+        (void)context;
+        uintptr_t address = (uintptr_t)info->si_addr;
+        SegMem_T mem = guarded_mem;
+
+        /* An unmapped ID's entry is NULL or a tagged ID under 2^33, which
+         * the words would start just after */
+        if (mem != NULL && address < ((uintptr_t)UINT32_MAX << 1 | FREE_TAG) +
+                                     sizeof(Segment) +
+                                     ((uintptr_t)UINT32_MAX + 1) *
+                                     sizeof(word_t)) {
+                Io_flush_at_fault();
+                write_text("um: access to an unmapped segment at "
+                           "instruction ");
+                write_number(mem->access_ip);
+                write_text("\n");
+                _exit(EXIT_FAILURE);
+        }
+        for (word_t id = 0; mem != NULL && id < mem->segments_length; id++) {
+                Segment *segment = mapped_segment(mem, id);
+                if (segment == NULL || segment->kind != SEGMENT_GUARDED) {
+                        continue;
+                }
+                uintptr_t end = (uintptr_t)&segment->words[segment->length];
+                if (address >= end && address - end < GUARD_BYTES) {
+                        Io_flush_at_fault();
+                        write_text("um: access past the end of segment ");
+                        write_number(id);
+                        write_text(" at instruction ");
+                        write_number(mem->access_ip);
+                        write_text("\n");
+                        _exit(EXIT_FAILURE);
+                }
+        }
+
+        signal(sig, SIG_DFL);
+}
+
+/* write_text
+ * Purpose:
+ *      Writes text to stderr from a signal handler, without stdio
+ * Arguments:
+ *      (const char *) text - What to write
+ */
+static void write_text(const char *text)
+{
+        ssize_t written = write(STDERR_FILENO, text, strlen(text));
+        (void)written;
+}
+
+/* write_number
+ * Purpose:
+ *      Writes a number in decimal to stderr from a signal handler
+ * Arguments:
+ *      (uint64_t) number - What to write
+ */
+static void write_number(uint64_t number)
+{
+        char digits[20];
+        size_t start = sizeof(digits);
+        do {
+                digits[--start] = '0' + number % 10;
+                number /= 10;
+        } while (number != 0);
+
+        ssize_t written = write(STDERR_FILENO, &digits[start],
+                                sizeof(digits) - start);
+        (void)written;
+}
+
+/* SegMem_pool_counts
+ * Purpose:
+ *      Tells how often segments were reused instead of allocated
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (uint64_t *) gets - Set to how many segments were asked for (by maps
+ *                          and by program loads, the first included)
+ *      (uint64_t *) hits - Set to how many of those reused an unmapped one
+ * Notes:
+ *      - CRE for any argument to be NULL
+ *      - Both are 0 unless the allocator is the pool
+ */
+void SegMem_pool_counts(SegMem_T mem, uint64_t *gets, uint64_t *hits)
+{
+        assert(mem != NULL);
+
+        if (mem->alloc == &SegAlloc_pool) {
+                SegPool_counts(mem->alloc_state, gets, hits);
+        } else {
+                assert(gets != NULL && hits != NULL);
+                *gets = 0;
+                *hits = 0;
+        }
+}
+
+/* SegMem_cache_counts
+ * Purpose:
+ *      Tells how often the fast paths found the segment they wanted in
+ *      their last-segment cache (see SegMem_lookup_fast)
+ * Arguments:
+ *      (SegMem_T) mem - The memory
+ *      (uint64_t *) lookups - Set to how many segments they looked up
+ *      (uint64_t *) hits - Set to how many of those were cached
+ * Notes:
+ *      - CRE for any argument to be NULL
+ *      - Both are 0 unless built with UM_STATS and UM_SEGMENT_CACHE
+ */
+void SegMem_cache_counts(SegMem_T mem, uint64_t *lookups, uint64_t *hits)
+{
+        assert(mem != NULL);
+        assert(lookups != NULL);
+        assert(hits != NULL);
+
+        *lookups = mem->cache_lookups;
+        *hits = mem->cache_hits;
+}
 
 /* SegMem_get_word
  * Purpose:
@@ -238,20 +1211,23 @@ void SegMem_unmap(SegMem_T mem, word_t seg_id)
  *      (word_t) holding the value stored at that location in memory
  * Notes:
  *      - CRE for mem to be NULL
- *      - CRE for mem->data_segments to be NULL
+ *      - CRE for mem->segments to be NULL
  *      - CRE for seg_id to refer to a segment which doesn't exist
- *      - URE for word_idx to refer to a word outside the bounds of the segment
- *        but the Hanson Sequence might CRE it
+ *      - CRE for word_idx to refer to a word outside the bounds of the segment
  */
 word_t SegMem_get_word(SegMem_T mem, word_t seg_id, word_t word_idx)
 {
         assert(mem != NULL);
-        assert(mem->data_segments != NULL);
+        assert(mem->segments != NULL);
 
-        Seq_T segment = Seq_get(mem->data_segments, seg_id); 
+        Segment *segment = mapped_segment(mem, seg_id); 
         assert(segment != NULL);
+        assert(word_idx < segment->length);
 
-        return (uintptr_t)Seq_get(segment, word_idx);
+        if (segment->kind == SEGMENT_SPARSE) {
+                return Sparse_get(segment, word_idx);
+        }
+        return segment->words[word_idx];
 }
 
 
@@ -265,72 +1241,138 @@ word_t SegMem_get_word(SegMem_T mem, word_t seg_id, word_t word_idx)
  *      (word_t) word - the word to be put into memory 
  * Notes:
  *      - CRE for mem to be NULL
- *      - CRE for mem->data_segments to be NULL
+ *      - CRE for mem->segments to be NULL
  *      - CRE for seg_id to refer to a segment which is unmapped
- *      - URE for word_idx to refer to a word outside of a segment (although
- *        the Hanson sequence might CRE it)
+ *      - CRE for word_idx to refer to a word outside of a segment
+ *      - Stores into segment 0 also update the predecoded program (and the
+ *        superinstructions around the word stored), so self-modifying code
+ *        sees its own changes
+ *      - A store into segment 0, or the segment it shares, first gives
+ *        segment 0 a copy of its own
+ *      - A store which fills up enough of a sparse segment makes it dense
  */
 void SegMem_put_word(SegMem_T mem, word_t seg_id, word_t word_idx, 
                          word_t word)
 {
         assert(mem != NULL);
-        assert(mem->data_segments != NULL);
+        assert(mem->segments != NULL);
 
-        Seq_T segment = Seq_get(mem->data_segments, seg_id); 
+        if (mem->shared_id != 0 && (seg_id == 0 || seg_id == mem->shared_id)) {
+                unshare(mem);
+        }
+        if (mem->parked_id != 0 && seg_id == mem->parked_id) {
+                drop_parked(mem);
+        }
+        Segment *segment = mapped_segment(mem, seg_id); 
         assert(segment != NULL);
+        assert(word_idx < segment->length);
 
-        Seq_put(segment, word_idx, (void *)(uintptr_t)word);
+        if (segment->kind == SEGMENT_SPARSE) {
+                if (Sparse_put(segment, word_idx, word)) {
+                        make_dense(mem, seg_id);
+                }
+                return;
+        }
+        segment->words[word_idx] = word;
+
+        if (seg_id == 0 && mem->watched != NULL && mem->watched[word_idx]) {
+                mem->watch_hit = true;
+        }
+        if (seg_id == 0 && mem->program != NULL) {
+                /* Superinstructions only depend on opcodes, and most stores
+                 * into segment 0 are to data which keeps its opcode. Direct
+                 * jumps also depend on the fields of LVs and LOADPs */
+                Um_instr *instr = &mem->program[word_idx];
+                Um_instr old = *instr;
+                decode_instr(word, instr);
+                bool same_jumps = (old.opcode != LV && old.opcode != LOADP) ||
+                                  (old.rA == instr->rA && old.rB == instr->rB &&
+                                   old.rC == instr->rC &&
+                                   old.value == instr->value);
+                if (instr->opcode == old.opcode && same_jumps) {
+                        if (old.handler >= UM_FIRST_FUSED_HANDLER) {
+                                instr->handler = old.handler;
+                        }
+                } else if (mem->fuse) {
+                        Fuse_around(mem->program, mem->program_length,
+                                    word_idx);
+                }
+        }
 }
 
 /* SegMem_load_program
  * Purpose: 
- *      Loads a new program stored in the given segment to run by copying the
- *      contents of that segment into segment 0 and setting the program counter
- *      to the provided value. Quick to load segment 0
+ *      Loads a new program stored in the given segment to run by making
+ *      segment 0 share the words of that segment (copied when either is
+ *      stored into) and setting the program counter to the provided value.
+ *      Quick to load segment 0
  * Arguments:
  *      (SegMem_T) mem - The memory to load the program from/into
  *      (word_t) seg_id - The segment in mem to load the program from
  *      (word_t) new_program_counter - The word index in the new program to 
  *                                       start reading instructions from
  * Notes:
- *      - CRE for mem, mem->data_segments, or mem->unmapped_stack to be NULL
- *      - CRE for seg_id to not 
- *      - URE for seg_id to not refer to a mapped segment
+ *      - CRE for mem or mem->segments to be NULL
+ *      - CRE for seg_id to not refer to a mapped segment
  *      - URE for new_program_counter to refer to an instruction out of bounds
  *        of the new program
- *      - Incredibly quick to load segment 0
+ *      - Incredibly quick to load segment 0, or the segment segment 0
+ *        already shares, which keeps the predecoded program. Loading the
+ *        one shared before that takes back its kept decoding
+ *      - A sparse segment is copied straight away
  * */
 void SegMem_load_program(SegMem_T mem, word_t seg_id,
                          word_t new_program_counter)
 {
         assert(mem != NULL);
-        assert(mem->data_segments != NULL);
-        assert(mem->unmapped_stack != NULL);
+        assert(mem->segments != NULL);
 
         /* Update instruction pointer */
         mem->ip = new_program_counter;
 
-        /* Fast case - don't need to copy anything! */
-        if (seg_id == 0) { 
+        /* Fast case - don't need to copy anything! Nor when segment 0
+         * still shares the words of the segment to load */
+        if (seg_id == 0 || seg_id == mem->shared_id) { 
                 return; 
         } 
+        Segment *to_load = mapped_segment(mem, seg_id); 
+        assert(to_load != NULL);       
 
-        /* Free the old seg0 */
-        Seq_T old_seg0 = Seq_get(mem->data_segments, 0);
-        Seq_free(&old_seg0); 
-        
-        /* Make a copy of the segment to load */
-        assert(seg_id < (uint32_t)Seq_length(mem->data_segments));
-        Seq_T to_copy = Seq_get(mem->data_segments, seg_id); 
-        assert(to_copy != NULL);       
-        int length = Seq_length(to_copy);
-        Seq_T new_seg_0 = Seq_new(length);
-        for (int i = 0; i < length; i++) {
-                Seq_addhi(new_seg_0, Seq_get(to_copy, i)); 
+        /* Take the decoding kept for the segment to load, if there is one */
+        Um_instr *program = NULL;
+        word_t program_length = 0;
+        if (seg_id == mem->parked_id) {
+                program = mem->parked_program;
+                program_length = mem->parked_length;
+                mem->parked_program = NULL;
         }
+        drop_parked(mem);
 
-        /* Put the new segment in segment 0 */
-        Seq_put(mem->data_segments, 0, new_seg_0);
+        /* Free the old seg0 and its decoding (redecoded when next asked
+         * for), unless another segment still has them, and stop watching
+         * its words */
+        if (mem->shared_id == 0) {
+                release_segment(mem, mem->segments[0]);
+                free_program(mem);
+        } else if (mem->program != NULL) {
+                mem->parked_id = mem->shared_id;
+                mem->parked_program = mem->program;
+                mem->parked_length = mem->program_length;
+        }
+        mem->shared_id = 0;
+        mem->program = program;
+        mem->program_length = program_length;
+        mem->watched = NULL;
+        
+        /* Share the segment to load, unless it is sparse */
+        if (to_load->kind == SEGMENT_SPARSE) {
+                Segment *new_seg_0 = new_segment(mem, to_load->length);
+                Sparse_copy(to_load, new_seg_0->words);
+                set_entry(mem, 0, new_seg_0);
+        } else {
+                set_entry(mem, 0, to_load);
+                mem->shared_id = seg_id;
+        }
 }
 
 /* SegMem_free
@@ -340,8 +1382,7 @@ void SegMem_load_program(SegMem_T mem, word_t seg_id,
  *      (SegMem_T) mem - The memory to free
  * Notes:
  *      - CRE if mem is null
- *      - CRE mem->data_segments is NULL
- *      - CRE if mem->unmapped_stack is NULL
+ *      - CRE mem->segments is NULL
  */
 void SegMem_free(SegMem_T *mem)
 {
@@ -349,23 +1390,35 @@ void SegMem_free(SegMem_T *mem)
         assert(*mem != NULL);
 
         SegMem_T memory = *mem;
-        assert(memory->data_segments != NULL);
-        assert(memory->unmapped_stack != NULL);
-
-        /* Free all segments in our data segments */
-        uint32_t length = Seq_length(memory->data_segments);
-        for (uint32_t i = 0; i < length; i++) {
-                Seq_T to_delete = Seq_get(memory->data_segments, i);
-                if (to_delete != NULL) {
-                        Seq_free(&to_delete);
+        assert(memory->segments != NULL);
+
+        /* Free all segments in our data segments (a shared one once) */
+        for (word_t i = memory->shared_id != 0 ? 1 : 0;
+             i < memory->segments_length; i++) {
+                Segment *segment = mapped_segment(memory, i);
+                if (segment != NULL) {
+                        release_segment(memory, segment);
                 }
         }
 
-        /* Free the collection of segments */
-        Seq_free(&(memory->data_segments));
-        
-        /* Free the stack holding unmapped memory addresses */
-        Seq_free(&(memory->unmapped_stack));
+        /* Give back the segment table, and have the allocator free all it
+         * still holds (an arena's chunks, the pool's kept segments) */
+        munmap(memory->segments, TABLE_BYTES);
+        memory->alloc->reset(memory->alloc_state);
+        memory->alloc->close(memory->alloc_state);
+
+        /* Free the predecoded programs */
+        free_program(memory);
+        drop_parked(memory);
+
+        /* Unmap the snapshot the segments restored from it were in */
+        if (memory->snapshot != NULL) {
+                munmap(memory->snapshot, memory->snapshot_bytes);
+        }
+
+        if (guarded_mem == memory) {
+                guarded_mem = NULL;
+        }
 
         /* Free struct */
         FREE(memory);
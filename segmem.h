@@ -10,6 +10,32 @@
  * words in memory, maps new segments and unmaps existing segments.
  *
  * Exports a type representing the 32-bit words stored in memory
+ *
+ * Segments are allocated from, and unmapped into, an allocator (see
+ * segalloc.h): by default a SegPool_T (see segpool.h), which reuses them
+ * for later maps. Huge segments start out sparse (see sparse.h) and become
+ * dense once enough of them is written.
+ *
+ * LOADP of a segment other than 0 doesn't copy it: segment 0 shares its
+ * words until either of them is stored into, and only then gets a copy.
+ * The decoding of the segment shared before is kept too, so switching back
+ * and forth between two code segments doesn't decode them each time.
+ *
+ * Also keeps a predecoded copy of segment 0 (see SegMem_program) which it
+ * keeps in sync with every store into segment 0 and every program load,
+ * with the superinstructions in it marked (see fuse.h)
+ *
+ * With guard pages on (SegMem_set_guard) an access past the end of a
+ * segment, or to an unmapped one, faults, and is reported as a machine
+ * failure with the instruction and segment at fault
+ *
+ * Every MAP and UNMAP can be recorded to a trace (SegMem_set_trace, see
+ * trace.h) for umreplay to replay
+ *
+ * The whole memory can be saved into a snapshot (SegMem_save, see
+ * snapshot.h) and restored from it (SegMem_restore). A restored memory's
+ * segments are the snapshot's own bytes, mmapped, and are only copied (by
+ * the kernel, a page at a time) as they are stored into
  */
 
 
@@ -18,6 +44,11 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "decode.h"
+#include "segalloc.h"
+#include "sparse.h"
 
 /* Uses 32 bit words */
 typedef uint32_t word_t;
@@ -28,12 +59,194 @@ typedef struct SegMem_T *SegMem_T;
 /* Methods */
 SegMem_T SegMem_new(FILE *input);
 word_t SegMem_fetch_next_i(SegMem_T mem);
+const Um_instr *SegMem_program(SegMem_T mem, word_t *length);
+void SegMem_set_fusion(SegMem_T mem, bool fuse);
+void SegMem_watch_program(SegMem_T mem, const uint8_t *watched);
+bool SegMem_watch_hit(SegMem_T mem);
 void SegMem_put_word(SegMem_T mem, word_t seg_id, word_t word_idx, word_t word);
 word_t SegMem_get_word(SegMem_T mem, word_t seg_id, word_t word_idx);
 void SegMem_load_program(SegMem_T mem, word_t seg_id,
                          word_t new_program_counter); 
 void SegMem_unmap(SegMem_T mem, word_t seg_id);
 word_t SegMem_map(SegMem_T mem, word_t size);
+void SegMem_set_allocator(SegMem_T mem, const SegAlloc *alloc);
+void SegMem_set_mmap_words(SegMem_T mem, word_t words);
+void SegMem_set_sparse_words(SegMem_T mem, word_t words);
+void SegMem_set_guard(SegMem_T mem, bool guard);
+void SegMem_set_trace(SegMem_T mem, FILE *trace);
+void SegMem_save(SegMem_T mem, FILE *snapshot);
+SegMem_T SegMem_restore(FILE *snapshot);
+void SegMem_pool_counts(SegMem_T mem, uint64_t *gets, uint64_t *hits);
+void SegMem_cache_counts(SegMem_T mem, uint64_t *lookups, uint64_t *hits);
 void SegMem_free(SegMem_T *mem);
 
+/* Inline fast paths for the hot loop of the interpreter in the um-fast build
+ * (see the Makefile). They skip the argument checks, and the function call,
+ * of SegMem_get_word and SegMem_put_word, so the representation has to be
+ * visible here. Nothing else should use it */
+
+/* Entries in the last-segment cache (a power of two) */
+#define SEGMENT_CACHE_WAYS 8
+
+struct SegMem_T {
+        /* Table of segments, indexed by segment ID, with an entry for every
+         * ID: a reservation of address space, which the kernel gives pages
+         * as they are first touched. segments_length is one more than the
+         * highest ID ever mapped
+         * INVARIANT: entries from segments_length on are NULL, and the entry
+         * of an unmapped ID below it holds the next ID on the free list */
+        Segment **segments;
+        word_t segments_length;
+
+        /* What allocates segments, and takes back unmapped ones (see
+         * segalloc.h), with the state it opened */
+        const SegAlloc *alloc;
+        void *alloc_state;
+
+        /* Smallest segment to map as a sparse one, and how many sparse
+         * segments there are (so the fast paths needn't look at a segment's
+         * kind while there are none) */
+        word_t sparse_words;
+        word_t sparse_segments;
+
+        /* Whether segments are followed by guard regions, and the index of
+         * the instruction in the last load or store (which the interpreter
+         * notes down, see SegMem_note_access) for reporting faults */
+        bool guard;
+        volatile word_t access_ip;
+
+        /* The segment whose words segment 0 shares since it was loaded as
+         * the program, or 0 when segment 0 has words of its own
+         * INVARIANT: when not 0, segments[shared_id] == segments[0] */
+        word_t shared_id;
+
+        /* The predecoded program of the segment segment 0 shared before
+         * the one it shares now, in case it is loaded again, or 0 and NULL.
+         * Thrown away when that segment is stored into or unmapped */
+        word_t parked_id;
+        Um_instr *parked_program;
+        word_t parked_length;
+
+        /* The most recently unmapped ID, or 0 when there are none: the head
+         * of a stack of unmapped IDs linked through their table entries */
+        word_t free_head;
+
+        /* Where every MAP and UNMAP is recorded (see trace.h), or NULL */
+        FILE *trace;
+
+        /* The mapping of the snapshot the memory was restored from, which
+         * its SEGMENT_SNAPSHOT segments are in, or NULL */
+        void *snapshot;
+        size_t snapshot_bytes;
+
+        /* The segments the fast paths looked up last, direct-mapped by
+         * the low bits of their IDs, so runs of accesses to a few segments
+         * skip the table. Only used with UM_SEGMENT_CACHE (make SEGCACHE=1),
+         * and lookups and hits only counted with UM_STATS too. Kept up to
+         * date when an entry changes (by MAP, UNMAP, LOADP, or a copy
+         * replacing a segment)
+         * INVARIANT: cached_segment[k] == segments[cached_id[k]] whenever
+         * cached_id[k] % SEGMENT_CACHE_WAYS == k */
+        word_t cached_id[SEGMENT_CACHE_WAYS];
+        Segment *cached_segment[SEGMENT_CACHE_WAYS];
+        uint64_t cache_lookups;
+        uint64_t cache_hits;
+        
+        /* Index in seg0 of next instruction to run (instruction pointer) */
+        word_t ip;
+
+        /* Segment 0 with every word already decoded, plus one invalid
+         * instruction past the end. NULL when segment 0 has been replaced
+         * since it was last decoded; rebuilt on demand by SegMem_program
+         * INVARIANT: when not NULL, program[i] is the decoding of word i of
+         * segment 0 for every i < program_length */
+        Um_instr *program;
+        word_t program_length;
+
+        /* Whether program gets superinstructions (see fuse.h) */
+        bool fuse;
+
+        /* One flag per word of segment 0 (or NULL) marking the words stores
+         * to should be reported, and whether one has been since last asked
+         * (see SegMem_watch_program) */
+        const uint8_t *watched;
+        bool watch_hit;
+};
+
+/* SegMem_lookup_fast
+ * Purpose:
+ *      Finds a segment for the fast paths: straight from the table, or
+ *      through the last-segment cache with UM_SEGMENT_CACHE
+ * Notes:
+ *      - URE for seg_id not to be mapped
+ *      - The table is already one load away, and the cache hasn't been
+ *        measured to beat it, so it is off by default
+ */
+static inline Segment *SegMem_lookup_fast(SegMem_T mem, word_t seg_id)
+{
+#ifdef UM_SEGMENT_CACHE
+        word_t k = seg_id & (SEGMENT_CACHE_WAYS - 1);
+#ifdef UM_STATS
+        mem->cache_lookups++;
+        mem->cache_hits += seg_id == mem->cached_id[k];
+#endif
+        if (seg_id != mem->cached_id[k]) {
+                mem->cached_id[k] = seg_id;
+                mem->cached_segment[k] = mem->segments[seg_id];
+        }
+        return mem->cached_segment[k];
+#else
+        return mem->segments[seg_id];
+#endif
+}
+
+/* SegMem_get_word_fast
+ * Purpose:
+ *      SegMem_get_word without any checks
+ * Notes:
+ *      - URE for seg_id not to be mapped or word_idx to be out of bounds
+ */
+static inline word_t SegMem_get_word_fast(SegMem_T mem, word_t seg_id,
+                                          word_t word_idx)
+{
+        Segment *segment = SegMem_lookup_fast(mem, seg_id);
+        if (mem->sparse_segments != 0 && segment->kind == SEGMENT_SPARSE) {
+                return Sparse_get(segment, word_idx);
+        }
+        return segment->words[word_idx];
+}
+
+/* SegMem_note_access
+ * Purpose:
+ *      Notes down which instruction is about to load or store, so a fault
+ *      in a guarded memory can be reported against it
+ */
+static inline void SegMem_note_access(SegMem_T mem, word_t ip)
+{
+        mem->access_ip = ip;
+}
+
+/* SegMem_put_word_fast
+ * Purpose:
+ *      SegMem_put_word without any checks
+ * Notes:
+ *      - URE for seg_id not to be mapped or word_idx to be out of bounds
+ *      - Stores into segment 0 go through SegMem_put_word, which keeps the
+ *        predecoded program up to date, and so do stores into sparse
+ *        segments, which it makes dense when they fill up, and into the
+ *        segments whose decoding is kept after LOADP
+ */
+static inline void SegMem_put_word_fast(SegMem_T mem, word_t seg_id,
+                                        word_t word_idx, word_t word)
+{
+        Segment *segment = SegMem_lookup_fast(mem, seg_id);
+        if (seg_id == 0 || seg_id == mem->shared_id ||
+            seg_id == mem->parked_id ||
+            (mem->sparse_segments != 0 && segment->kind == SEGMENT_SPARSE)) {
+                SegMem_put_word(mem, seg_id, word_idx, word);
+                return;
+        }
+        segment->words[word_idx] = word;
+}
+
 #endif
\ No newline at end of file
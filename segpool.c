@@ -0,0 +1,574 @@
+/* segpool.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Allocates segments for SegMem, and keeps unmapped ones in per-size-class
+ * free lists to hand out again, zeroed, for the next MAP of a size in the
+ * same class. Each class keeps only so many, so a program which once used
+ * a lot of memory doesn't hold on to it. Counts how many requests reused a
+ * kept segment
+ *
+ * In guard mode the classes are instead by how many pages a guarded segment
+ * takes, and a kept one is reused by moving its header so that its words
+ * end at the guard again
+ */
+
+/* Header */
+#include "segpool.h"
+
+/* C Std Libs */
+#include <stddef.h>
+#include <string.h>
+
+/* POSIX */
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* Segments of up to SMALL_WORDS words each have a class of their own
+ * (programs map the same few small sizes over and over). Bigger ones share
+ * STEPS classes per power of two, so a segment wastes at most a quarter of
+ * its room, up to MAX_POOLED_WORDS; bigger still aren't kept at all */
+#define SMALL_WORDS 16
+#define STEPS 4
+#define POOL_CLASSES (SMALL_WORDS + 1 + 12 * STEPS)
+#define MAX_POOLED_WORDS class_capacity(POOL_CLASSES - 1)
+
+/* The most each class keeps (its high-water mark): as many segments as fit
+ * in CLASS_BYTES, but at least 1. sandmark frees tens of thousands of small
+ * segments at a time and then maps as many again, so this is generous */
+static const size_t CLASS_BYTES = 16 << 20;
+
+/* The same for guarded segments, by the pages they take. A new one costs
+ * two system calls, so these classes keep many more (midmark reuses only a
+ * fifth of its segments with CLASS_BYTES) */
+static const size_t GUARD_CLASS_BYTES = 256 << 20;
+
+/* Segments of at least this many words are mmapped unless the pool is told
+ * otherwise: one 2MB huge page */
+static const uint32_t DEFAULT_MMAP_WORDS = (2 << 20) / sizeof(uint32_t);
+
+/* How many kept segments a class first has room for. It doubles as needed,
+ * up to the class's limit */
+static const unsigned FIRST_ROOM = 64;
+
+struct SegPool_T {
+        /* Stack of kept segments for each class, allocated when first used,
+         * with how many are on it, how many it has room for, and how many it
+         * may keep at most
+         * INVARIANT: every segment on kept[c] was allocated with room for
+         * class_capacity(c) words (c + 1 pages in guard mode), and
+         * count[c] <= room[c] <= limit[c] */
+        Segment **kept[POOL_CLASSES];
+        unsigned count[POOL_CLASSES];
+        unsigned room[POOL_CLASSES];
+        unsigned limit[POOL_CLASSES];
+
+        /* Smallest segment to mmap, and whether every segment gets a guard
+         * region instead */
+        uint32_t mmap_words;
+        bool guard;
+
+        /* The size of a page, which guarded segments are laid out in */
+        size_t page;
+
+        /* Requests, and requests which reused a kept segment */
+        uint64_t gets;
+        uint64_t hits;
+};
+
+static unsigned size_class(uint32_t length);
+static uint32_t class_capacity(unsigned c);
+static Segment *new_segment(uint32_t capacity, uint32_t length);
+static Segment *map_segment(uint32_t length);
+static size_t mapped_bytes(uint32_t length);
+static Segment *guard_segment(SegPool_T pool, uint32_t length);
+static Segment *place_guarded(SegPool_T pool, char *region, size_t pages,
+                              uint32_t length);
+static void unguard_segment(SegPool_T pool, Segment *segment);
+static size_t guard_pages(SegPool_T pool, uint32_t length);
+static void grow_room(SegPool_T pool, unsigned c);
+static void set_limits(SegPool_T pool);
+static void free_kept(SegPool_T pool);
+
+/* SegPool_new
+ * Purpose:
+ *      Makes a new pool with nothing kept in it
+ * Returns:
+ *      (SegPool_T) the pool, to be freed with SegPool_free
+ */
+SegPool_T SegPool_new(void)
+{
+        SegPool_T pool = NEW(pool);
+        for (unsigned c = 0; c < POOL_CLASSES; c++) {
+                pool->kept[c] = NULL;
+                pool->count[c] = 0;
+                pool->room[c] = 0;
+        }
+        pool->mmap_words = DEFAULT_MMAP_WORDS;
+        pool->guard = false;
+        pool->page = sysconf(_SC_PAGESIZE);
+        set_limits(pool);
+        pool->gets = 0;
+        pool->hits = 0;
+
+        return pool;
+}
+
+/* SegPool_set_mmap_words
+ * Purpose:
+ *      Sets the size from which segments are mmapped instead of allocated
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (uint32_t) words - The smallest length of segment to mmap
+ * Notes:
+ *      - CRE for pool to be NULL
+ *      - Segments already given out keep the memory they have
+ */
+void SegPool_set_mmap_words(SegPool_T pool, uint32_t words)
+{
+        assert(pool != NULL);
+
+        pool->mmap_words = words;
+}
+
+/* SegPool_set_guard
+ * Purpose:
+ *      Turns guard regions after segments on or off
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (bool) guard - Whether each segment from now on is followed by an
+ *                     inaccessible region
+ * Notes:
+ *      - CRE for pool to be NULL
+ *      - Guarded segments each take at least a page of memory (and the
+ *        kernel only allows so many mappings, so a program can have only
+ *        tens of thousands of them)
+ *      - Frees every segment kept so far, since the classes change
+ */
+void SegPool_set_guard(SegPool_T pool, bool guard)
+{
+        assert(pool != NULL);
+
+        if (guard != pool->guard) {
+                free_kept(pool);
+                pool->guard = guard;
+                set_limits(pool);
+        }
+}
+
+/* SegPool_get
+ * Purpose:
+ *      Gives out a segment of the given length with every word 0, reusing
+ *      a kept one of the same class if there is one
+ * Arguments:
+ *      (SegPool_T) pool - The pool to get the segment from
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (Segment *) the segment, to be given back with SegPool_put
+ * Notes:
+ *      - CRE for pool to be NULL
+ *      - CRE if there isn't enough memory for the segment
+ */
+Segment *SegPool_get(SegPool_T pool, uint32_t length)
+{
+        assert(pool != NULL);
+
+        pool->gets++;
+        if (pool->guard) {
+                size_t pages = guard_pages(pool, length);
+                if (pages > POOL_CLASSES || pool->count[pages - 1] == 0) {
+                        return guard_segment(pool, length);
+                }
+
+                pool->hits++;
+                unsigned c = pages - 1;
+                Segment *kept = pool->kept[c][--pool->count[c]];
+                char *region = (char *)((uintptr_t)kept &
+                                        ~(uintptr_t)(pool->page - 1));
+                Segment *segment = place_guarded(pool, region, pages, length);
+                memset(segment->words, 0, (size_t)length * sizeof(uint32_t));
+                return segment;
+        }
+        if (length >= pool->mmap_words) {
+                return map_segment(length);
+        }
+        if (length > MAX_POOLED_WORDS) {
+                return new_segment(length, length);
+        }
+
+        unsigned c = size_class(length);
+        if (pool->count[c] == 0) {
+                return new_segment(class_capacity(c), length);
+        }
+
+        pool->hits++;
+        Segment *segment = pool->kept[c][--pool->count[c]];
+        segment->length = length;
+        memset(segment->words, 0, (size_t)length * sizeof(uint32_t));
+        return segment;
+}
+
+/* SegPool_put
+ * Purpose:
+ *      Takes back a segment which is no longer mapped, keeping it for reuse
+ *      if its class isn't full and freeing it otherwise
+ * Arguments:
+ *      (SegPool_T) pool - The pool the segment came from
+ *      (Segment *) segment - The segment
+ * Notes:
+ *      - CRE for pool or segment to be NULL
+ *      - URE for segment not to have come from SegPool_get of this pool
+ *      - mmapped segments are always unmapped, never kept
+ */
+void SegPool_put(SegPool_T pool, Segment *segment)
+{
+        assert(pool != NULL);
+        assert(segment != NULL);
+
+        if (segment->kind == SEGMENT_MAPPED) {
+                munmap(segment, mapped_bytes(segment->length));
+                return;
+        }
+        unsigned c = POOL_CLASSES;
+        if (segment->kind == SEGMENT_GUARDED) {
+                if (pool->guard) {
+                        c = guard_pages(pool, segment->length) - 1;
+                }
+        } else if (!pool->guard && segment->length <= MAX_POOLED_WORDS) {
+                c = size_class(segment->length);
+        }
+        if (c < POOL_CLASSES) {
+                if (pool->count[c] == pool->room[c] &&
+                    pool->room[c] < pool->limit[c]) {
+                        grow_room(pool, c);
+                }
+                if (pool->count[c] < pool->room[c]) {
+                        pool->kept[c][pool->count[c]++] = segment;
+                        return;
+                }
+        }
+
+        if (segment->kind == SEGMENT_GUARDED) {
+                unguard_segment(pool, segment);
+        } else {
+                FREE(segment);
+        }
+}
+
+/* SegPool_counts
+ * Purpose:
+ *      Tells how well the pool has done
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (uint64_t *) gets - Set to the number of SegPool_gets
+ *      (uint64_t *) hits - Set to how many of them reused a kept segment
+ * Notes:
+ *      - CRE for any argument to be NULL
+ */
+void SegPool_counts(SegPool_T pool, uint64_t *gets, uint64_t *hits)
+{
+        assert(pool != NULL);
+        assert(gets != NULL);
+        assert(hits != NULL);
+
+        *gets = pool->gets;
+        *hits = pool->hits;
+}
+
+/* SegPool_reset
+ * Purpose:
+ *      Frees every segment kept in a pool, keeping the pool
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ * Notes:
+ *      - CRE for pool to be NULL
+ */
+void SegPool_reset(SegPool_T pool)
+{
+        assert(pool != NULL);
+
+        free_kept(pool);
+}
+
+/* SegPool_free
+ * Purpose:
+ *      Frees a pool and every segment kept in it
+ * Arguments:
+ *      (SegPool_T *) pool - The pool to free. Set to NULL
+ * Notes:
+ *      - CRE for pool or *pool to be NULL
+ *      - Segments given out and not put back are not freed
+ */
+void SegPool_free(SegPool_T *pool)
+{
+        assert(pool != NULL);
+        assert(*pool != NULL);
+
+        free_kept(*pool);
+        FREE(*pool);
+}
+
+/* size_class
+ * Purpose:
+ *      Works out which class a segment belongs to
+ * Arguments:
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (unsigned) the class: length itself for small segments, and
+ *      SMALL_WORDS + 1 and up, STEPS per power of two, after that
+ * Notes:
+ *      - URE for length to be more than MAX_POOLED_WORDS
+ */
+static unsigned size_class(uint32_t length)
+{
+        if (length <= SMALL_WORDS) {
+                return length;
+        }
+
+        /* length is in (base, 2 * base] */
+        uint32_t base = SMALL_WORDS;
+        unsigned doublings = 0;
+        while (length > 2 * base) {
+                base *= 2;
+                doublings++;
+        }
+        unsigned step = (length - base - 1) / (base / STEPS);
+        return SMALL_WORDS + 1 + doublings * STEPS + step;
+}
+
+/* class_capacity
+ * Purpose:
+ *      Gives how many words every segment of a class has room for
+ * Arguments:
+ *      (unsigned) c - The class
+ * Returns:
+ *      (uint32_t) the room, which is the largest length in the class
+ */
+static uint32_t class_capacity(unsigned c)
+{
+        if (c <= SMALL_WORDS) {
+                return c;
+        }
+
+        unsigned k = c - SMALL_WORDS - 1;
+        uint32_t base = (uint32_t)SMALL_WORDS << (k / STEPS);
+        return base + (k % STEPS + 1) * (base / STEPS);
+}
+
+/* new_segment
+ * Purpose:
+ *      Allocates a segment with every word 0
+ * Arguments:
+ *      (uint32_t) capacity - How many words to make room for
+ *      (uint32_t) length - How many words the segment holds (<= capacity)
+ * Returns:
+ *      (Segment *) the new segment
+ * Notes:
+ *      - CRE if there isn't enough memory for it
+ */
+static Segment *new_segment(uint32_t capacity, uint32_t length)
+{
+        Segment *segment = CALLOC(1, sizeof(Segment) +
+                                     (size_t)capacity * sizeof(uint32_t));
+        segment->length = length;
+        segment->kind = SEGMENT_HEAP;
+
+        return segment;
+}
+
+/* map_segment
+ * Purpose:
+ *      Gets a segment straight from anonymous mmap, so its pages are only
+ *      zeroed (by the kernel) when the program first touches them
+ * Arguments:
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (Segment *) the new segment, every word 0
+ * Notes:
+ *      - Asks for transparent huge pages where there are any, so a big
+ *        segment needs few TLB entries
+ *      - Falls back on the heap if mmap fails
+ */
+static Segment *map_segment(uint32_t length)
+{
+        size_t bytes = mapped_bytes(length);
+        Segment *segment = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (segment == MAP_FAILED) {
+                return new_segment(length, length);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(segment, bytes, MADV_HUGEPAGE);
+#endif
+        segment->length = length;
+        segment->kind = SEGMENT_MAPPED;
+
+        return segment;
+}
+
+/* mapped_bytes
+ * Purpose:
+ *      Gives the size of the mapping for an mmapped segment
+ * Arguments:
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (size_t) the bytes mapped for it
+ */
+static size_t mapped_bytes(uint32_t length)
+{
+        return sizeof(Segment) + (size_t)length * sizeof(uint32_t);
+}
+
+/* grow_room
+ * Purpose:
+ *      Makes room for more kept segments in a class: FIRST_ROOM to start
+ *      with, then twice as many, up to the class's limit
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (unsigned) c - The class
+ */
+static void grow_room(SegPool_T pool, unsigned c)
+{
+        size_t room = pool->room[c] == 0 ? FIRST_ROOM : 2 * pool->room[c];
+        if (room > pool->limit[c]) {
+                room = pool->limit[c];
+        }
+
+        if (pool->kept[c] == NULL) {
+                pool->kept[c] = ALLOC(room * sizeof(Segment *));
+        } else {
+                RESIZE(pool->kept[c], room * sizeof(Segment *));
+        }
+        pool->room[c] = room;
+}
+
+/* set_limits
+ * Purpose:
+ *      Works out how many segments each class may keep: as many as fit in
+ *      CLASS_BYTES (GUARD_CLASS_BYTES in guard mode), but at least 1
+ * Arguments:
+ *      (SegPool_T) pool - The pool, whose classes depend on its guard mode
+ */
+static void set_limits(SegPool_T pool)
+{
+        for (unsigned c = 0; c < POOL_CLASSES; c++) {
+                size_t limit = CLASS_BYTES /
+                               (sizeof(Segment) +
+                                class_capacity(c) * sizeof(uint32_t));
+                if (pool->guard) {
+                        limit = GUARD_CLASS_BYTES / ((c + 1) * pool->page);
+                }
+                pool->limit[c] = limit > 0 ? limit : 1;
+        }
+}
+
+/* free_kept
+ * Purpose:
+ *      Frees (or unmaps) every segment kept in a pool, and the stacks of
+ *      them
+ * Arguments:
+ *      (SegPool_T) pool - The pool, which keeps nothing afterwards
+ */
+static void free_kept(SegPool_T pool)
+{
+        for (unsigned c = 0; c < POOL_CLASSES; c++) {
+                for (unsigned k = 0; k < pool->count[c]; k++) {
+                        if (pool->kept[c][k]->kind == SEGMENT_GUARDED) {
+                                unguard_segment(pool, pool->kept[c][k]);
+                        } else {
+                                FREE(pool->kept[c][k]);
+                        }
+                }
+                if (pool->kept[c] != NULL) {
+                        FREE(pool->kept[c]);
+                }
+                pool->count[c] = 0;
+                pool->room[c] = 0;
+        }
+}
+
+/* guard_segment
+ * Purpose:
+ *      mmaps a segment whose words end exactly at a page boundary, followed
+ *      by GUARD_BYTES mapped with no access at all
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (Segment *) the new segment, every word 0
+ * Notes:
+ *      - CRE if the memory can't be mapped
+ */
+static Segment *guard_segment(SegPool_T pool, uint32_t length)
+{
+        size_t pages = guard_pages(pool, length);
+        char *region = mmap(NULL, pages * pool->page + GUARD_BYTES,
+                            PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                            0);
+        assert(region != MAP_FAILED);
+        int failed = mprotect(region, pages * pool->page,
+                              PROT_READ | PROT_WRITE);
+        assert(failed == 0);
+        (void)failed;
+
+        return place_guarded(pool, region, pages, length);
+}
+
+/* place_guarded
+ * Purpose:
+ *      Puts a segment's header where its words end at the guard region
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (char *) region - Start of the pages the segment goes in
+ *      (size_t) pages - How many accessible pages there are
+ *      (uint32_t) length - How many words the segment holds, which must fit
+ * Returns:
+ *      (Segment *) the segment, its words left as they were
+ */
+static Segment *place_guarded(SegPool_T pool, char *region, size_t pages,
+                              uint32_t length)
+{
+        Segment *segment = (Segment *)(void *)(region + pages * pool->page -
+                                               mapped_bytes(length));
+        segment->length = length;
+        segment->kind = SEGMENT_GUARDED;
+
+        return segment;
+}
+
+/* unguard_segment
+ * Purpose:
+ *      Unmaps a segment made by guard_segment, guard region and all
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (Segment *) segment - The guarded segment
+ */
+static void unguard_segment(SegPool_T pool, Segment *segment)
+{
+        size_t pages = guard_pages(pool, segment->length);
+        char *region = (char *)((uintptr_t)segment &
+                                ~(uintptr_t)(pool->page - 1));
+
+        munmap(region, pages * pool->page + GUARD_BYTES);
+}
+
+/* guard_pages
+ * Purpose:
+ *      Works out how many accessible pages a guarded segment takes
+ * Arguments:
+ *      (SegPool_T) pool - The pool
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (size_t) the pages its header and words fill up to the end of
+ */
+static size_t guard_pages(SegPool_T pool, uint32_t length)
+{
+        return (mapped_bytes(length) + pool->page - 1) / pool->page;
+}
@@ -0,0 +1,64 @@
+/* segpool.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Allocates segments for SegMem, and keeps unmapped ones in per-size-class
+ * free lists to hand out again, zeroed, for the next MAP of a size in the
+ * same class. Each class keeps only so many, so a program which once used
+ * a lot of memory doesn't hold on to it. Counts how many requests reused a
+ * kept segment
+ *
+ * Segments of at least a threshold number of words (SegPool_set_mmap_words)
+ * come straight from anonymous mmap instead, so the kernel zeroes their
+ * pages when they are first touched, and are unmapped again on UNMAP
+ *
+ * With guard pages on (SegPool_set_guard) every segment is mmapped so that
+ * its last word ends a page and the next GUARD_BYTES can't be touched:
+ * reading or writing past its end raises SIGSEGV instead of going unnoticed
+ */
+
+#ifndef SEGPOOL_H
+#define SEGPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The inaccessible region after a guarded segment */
+#define GUARD_BYTES ((uintptr_t)1 << 20)
+
+/* Where a segment's memory came from. Heap, mmapped and guarded segments
+ * come from the pool, arena ones from the arena allocator (heap ones from
+ * the malloc allocator too), snapshot ones from a snapshot's mapping (see
+ * SegMem_restore), and all but sparse ones hold their words in
+ * Segment.words */
+typedef enum Segment_kind {
+        SEGMENT_HEAP = 0,       /* Hanson's ALLOC */
+        SEGMENT_MAPPED,         /* mmap */
+        SEGMENT_GUARDED,        /* mmap, followed by GUARD_BYTES of guard */
+        SEGMENT_SPARSE,         /* only written pages, see sparse.h */
+        SEGMENT_ARENA,          /* part of a chunk, see segalloc.h */
+        SEGMENT_SNAPSHOT        /* part of a restored snapshot */
+} Segment_kind;
+
+/* A segment: its length and kind followed by its words, in a single
+ * allocation */
+typedef struct Segment {
+        uint32_t length;
+        uint32_t kind;          /* a Segment_kind */
+        uint32_t words[];
+} Segment;
+
+typedef struct SegPool_T *SegPool_T;
+
+SegPool_T SegPool_new(void);
+void SegPool_set_mmap_words(SegPool_T pool, uint32_t words);
+void SegPool_set_guard(SegPool_T pool, bool guard);
+Segment *SegPool_get(SegPool_T pool, uint32_t length);
+void SegPool_put(SegPool_T pool, Segment *segment);
+void SegPool_counts(SegPool_T pool, uint64_t *gets, uint64_t *hits);
+void SegPool_reset(SegPool_T pool);
+void SegPool_free(SegPool_T *pool);
+
+#endif
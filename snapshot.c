@@ -0,0 +1,133 @@
+/* snapshot.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Writes and restores snapshots of a whole machine (see snapshot.h)
+ */
+
+/* Header */
+#include "snapshot.h"
+
+/* C Std Libs */
+#include <stdio.h>
+#include <string.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* The words after SNAPSHOT_MAGIC: the instruction index, the registers
+ * and padding, so the memory starts 8 byte aligned */
+#define SNAPSHOT_WORDS 10
+
+/* Snapshot_save
+ * Purpose:
+ *      Writes a snapshot of a machine, which Snapshot_restore resumes from
+ *      the given instruction
+ * Arguments:
+ *      (const char *) path - Where to write it
+ *      (SegMem_T) mem - The machine's memory
+ *      (Registers_T) regs - Its 8 registers
+ *      (word_t) ip - Index in segment 0 of the instruction to run next
+ * Returns:
+ *      (bool) false if the snapshot couldn't be written, true otherwise
+ * Notes:
+ *      - CRE for path, mem or regs to be NULL
+ *      - It is written to path with ".tmp" added, then renamed to path, so
+ *        path is never half written, and a memory restored from path
+ *        itself (whose segments are still in the old file) can be saved
+ *        over it
+ */
+bool Snapshot_save(const char *path, SegMem_T mem, Registers_T regs,
+                   word_t ip)
+{
+        assert(path != NULL);
+        assert(mem != NULL);
+        assert(regs != NULL);
+
+        size_t length = strlen(path);
+        char *temporary = ALLOC(length + sizeof(".tmp"));
+        memcpy(temporary, path, length);
+        memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+        FILE *snapshot = fopen(temporary, "wb");
+        if (snapshot == NULL) {
+                FREE(temporary);
+                return false;
+        }
+
+        word_t words[SNAPSHOT_WORDS] = { ip };
+        for (unsigned k = 0; k < 8; k++) {
+                words[1 + k] = Registers_get(regs, k);
+        }
+        fputs(SNAPSHOT_MAGIC, snapshot);
+        fwrite(words, sizeof(word_t), SNAPSHOT_WORDS, snapshot);
+        SegMem_save(mem, snapshot);
+
+        bool written = !ferror(snapshot);
+        written = (fclose(snapshot) == 0) && written;
+        written = written && rename(temporary, path) == 0;
+        if (!written) {
+                remove(temporary);
+        }
+        FREE(temporary);
+
+        return written;
+}
+
+/* Snapshot_restore
+ * Purpose:
+ *      Restores a machine from a snapshot written by Snapshot_save
+ * Arguments:
+ *      (const char *) path - The snapshot
+ *      (Registers_T) regs - Set to the 8 registers in the snapshot
+ *      (word_t *) ip - Set to the index in segment 0 of the instruction to
+ *                      run next
+ * Returns:
+ *      (SegMem_T) the machine's memory (see SegMem_restore), or NULL if
+ *                 path can't be read or isn't a snapshot, in which case
+ *                 regs and ip are left alone
+ * Notes:
+ *      - CRE for any argument to be NULL
+ */
+SegMem_T Snapshot_restore(const char *path, Registers_T regs, word_t *ip)
+{
+        assert(path != NULL);
+        assert(regs != NULL);
+        assert(ip != NULL);
+
+        FILE *snapshot = fopen(path, "rb");
+        if (snapshot == NULL) {
+                return NULL;
+        }
+
+        char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+        word_t words[SNAPSHOT_WORDS];
+        SegMem_T mem = NULL;
+        if (fread(magic, 1, sizeof(magic), snapshot) == sizeof(magic) &&
+            memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0 &&
+            fread(words, sizeof(word_t), SNAPSHOT_WORDS, snapshot) ==
+            SNAPSHOT_WORDS) {
+                mem = SegMem_restore(snapshot);
+        }
+        fclose(snapshot);
+        if (mem == NULL) {
+                return NULL;
+        }
+
+        /* The instruction to run next has to be in segment 0 */
+        word_t length;
+        SegMem_program(mem, &length);
+        if (words[0] >= length) {
+                SegMem_free(&mem);
+                return NULL;
+        }
+
+        *ip = words[0];
+        for (unsigned k = 0; k < 8; k++) {
+                Registers_set(regs, k, words[1 + k]);
+        }
+        return mem;
+}
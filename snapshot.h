@@ -0,0 +1,35 @@
+/* snapshot.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Snapshots of a whole machine, written by um --snapshot-at-halt FILE or
+ * --snapshot-on-signal FILE and resumed by um --restore FILE, so a program
+ * which takes a long time to start (codex.umz) only has to start once.
+ *
+ * A snapshot is SNAPSHOT_MAGIC, the index in segment 0 of the instruction
+ * to run next, the 8 registers and a word of padding, followed by the
+ * memory (see SegMem_save): every mapped segment and the stack of unmapped
+ * IDs, so the restored machine maps the same IDs the original would have.
+ * Everything is in the byte order of the machine which wrote it, so that
+ * restoring can mmap the segments as they are; a snapshot can only be
+ * restored on the same kind of machine
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+
+#include "segmem.h"
+#include "registers.h"
+
+/* What every snapshot starts with */
+#define SNAPSHOT_MAGIC "UMSNAP01"
+
+bool Snapshot_save(const char *path, SegMem_T mem, Registers_T regs,
+                   word_t ip);
+SegMem_T Snapshot_restore(const char *path, Registers_T regs, word_t *ip);
+
+#endif
@@ -0,0 +1,240 @@
+/* sparse.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Sparse segments, for huge maps of which a program only writes a little
+ * (hash tables, bitmaps). Only the pages which have been written are
+ * stored, in a two-level page table, and words never written read as 0.
+ * Once enough of a sparse segment has been written, Sparse_put says so, and
+ * SegMem replaces it with an ordinary (dense) one
+ */
+
+/* Header */
+#include "sparse.h"
+
+/* C Std Libs */
+#include <stddef.h>
+#include <string.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* A word index splits into a directory index, a table index and an index
+ * in the page: a page is 1K words (4KB) and a table covers 1M words, so a
+ * directory has at most 4K tables */
+#define PAGE_BITS 10
+#define TABLE_BITS 10
+static const uint32_t PAGE_WORDS = 1u << PAGE_BITS;
+static const uint32_t TABLE_PAGES = 1u << TABLE_BITS;
+
+/* A segment is worth making dense once more than 1 / DENSE_FRACTION of it
+ * has been written */
+static const uint64_t DENSE_FRACTION = 4;
+
+/* The page table of a sparse segment, which lives where a dense segment's
+ * words would (Segment.words) */
+typedef struct Sparse_table {
+        uint32_t pages_written;  /* pages allocated so far */
+        uint32_t ***directory;   /* tables of pages, NULL until written */
+} Sparse_table;
+
+static Sparse_table *table_of(const Segment *segment);
+static uint32_t directory_length(uint32_t length);
+
+/* Sparse_new
+ * Purpose:
+ *      Makes a sparse segment with every word 0, and no pages
+ * Arguments:
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (Segment *) the segment, of kind SEGMENT_SPARSE, to be freed with
+ *                  Sparse_free
+ * Notes:
+ *      - CRE if there isn't enough memory for it
+ */
+Segment *Sparse_new(uint32_t length)
+{
+        Segment *segment = ALLOC(sizeof(Segment) + sizeof(Sparse_table));
+        segment->length = length;
+        segment->kind = SEGMENT_SPARSE;
+
+        Sparse_table *table = table_of(segment);
+        table->pages_written = 0;
+        table->directory = CALLOC(directory_length(length),
+                                  sizeof(uint32_t **));
+
+        return segment;
+}
+
+/* Sparse_get
+ * Purpose:
+ *      Reads a word of a sparse segment
+ * Arguments:
+ *      (const Segment *) segment - The sparse segment
+ *      (uint32_t) word_idx - Which word
+ * Returns:
+ *      (uint32_t) the word, 0 if its page was never written
+ * Notes:
+ *      - CRE for segment to be NULL
+ *      - URE for word_idx to be out of bounds
+ */
+uint32_t Sparse_get(const Segment *segment, uint32_t word_idx)
+{
+        assert(segment != NULL);
+
+        uint32_t **pages = table_of(segment)->directory[word_idx >>
+                                                        (PAGE_BITS +
+                                                         TABLE_BITS)];
+        if (pages == NULL) {
+                return 0;
+        }
+        uint32_t *page = pages[(word_idx >> PAGE_BITS) & (TABLE_PAGES - 1)];
+        if (page == NULL) {
+                return 0;
+        }
+        return page[word_idx & (PAGE_WORDS - 1)];
+}
+
+/* Sparse_put
+ * Purpose:
+ *      Writes a word of a sparse segment, adding its page if it has none
+ * Arguments:
+ *      (Segment *) segment - The sparse segment
+ *      (uint32_t) word_idx - Which word
+ *      (uint32_t) word - What to write
+ * Returns:
+ *      (bool) true if so much of the segment has now been written that it
+ *      should be made dense
+ * Notes:
+ *      - CRE for segment to be NULL
+ *      - URE for word_idx to be out of bounds
+ *      - Writing 0 to a page which doesn't exist doesn't add it
+ */
+bool Sparse_put(Segment *segment, uint32_t word_idx, uint32_t word)
+{
+        assert(segment != NULL);
+
+        Sparse_table *table = table_of(segment);
+        uint32_t ***slot = &table->directory[word_idx >>
+                                             (PAGE_BITS + TABLE_BITS)];
+        uint32_t *page = NULL;
+        if (*slot != NULL) {
+                page = (*slot)[(word_idx >> PAGE_BITS) & (TABLE_PAGES - 1)];
+        }
+
+        if (page == NULL) {
+                if (word == 0) {
+                        return false;
+                }
+                if (*slot == NULL) {
+                        *slot = CALLOC(TABLE_PAGES, sizeof(uint32_t *));
+                }
+                page = CALLOC(PAGE_WORDS, sizeof(uint32_t));
+                (*slot)[(word_idx >> PAGE_BITS) & (TABLE_PAGES - 1)] = page;
+                table->pages_written++;
+        }
+        page[word_idx & (PAGE_WORDS - 1)] = word;
+
+        return (uint64_t)table->pages_written * PAGE_WORDS * DENSE_FRACTION >
+               segment->length;
+}
+
+/* Sparse_copy
+ * Purpose:
+ *      Writes out every word of a sparse segment
+ * Arguments:
+ *      (const Segment *) segment - The sparse segment
+ *      (uint32_t *) words - Where to write them: segment->length words,
+ *                           which must already be 0
+ * Notes:
+ *      - CRE for segment or words to be NULL
+ *      - Only touches the words of pages which exist
+ */
+void Sparse_copy(const Segment *segment, uint32_t *words)
+{
+        assert(segment != NULL);
+        assert(words != NULL);
+
+        Sparse_table *table = table_of(segment);
+        uint32_t tables = directory_length(segment->length);
+        for (uint32_t d = 0; d < tables; d++) {
+                if (table->directory[d] == NULL) {
+                        continue;
+                }
+                for (uint32_t p = 0; p < TABLE_PAGES; p++) {
+                        uint32_t *page = table->directory[d][p];
+                        if (page == NULL) {
+                                continue;
+                        }
+                        uint64_t start = ((uint64_t)d << TABLE_BITS | p) <<
+                                         PAGE_BITS;
+                        uint64_t count = segment->length - start;
+                        if (count > PAGE_WORDS) {
+                                count = PAGE_WORDS;
+                        }
+                        memcpy(&words[start], page, count * sizeof(uint32_t));
+                }
+        }
+}
+
+/* Sparse_free
+ * Purpose:
+ *      Frees a sparse segment and all of its pages
+ * Arguments:
+ *      (Segment **) segment - The sparse segment. Set to NULL
+ * Notes:
+ *      - CRE for segment or *segment to be NULL
+ */
+void Sparse_free(Segment **segment)
+{
+        assert(segment != NULL);
+        assert(*segment != NULL);
+
+        Sparse_table *table = table_of(*segment);
+        uint32_t tables = directory_length((*segment)->length);
+        for (uint32_t d = 0; d < tables; d++) {
+                if (table->directory[d] == NULL) {
+                        continue;
+                }
+                for (uint32_t p = 0; p < TABLE_PAGES; p++) {
+                        if (table->directory[d][p] != NULL) {
+                                FREE(table->directory[d][p]);
+                        }
+                }
+                FREE(table->directory[d]);
+        }
+        FREE(table->directory);
+
+        FREE(*segment);
+}
+
+/* table_of
+ * Purpose:
+ *      Finds the page table of a sparse segment
+ * Arguments:
+ *      (const Segment *) segment - The sparse segment
+ * Returns:
+ *      (Sparse_table *) its table, kept in place of its words
+ */
+static Sparse_table *table_of(const Segment *segment)
+{
+        assert(segment->kind == SEGMENT_SPARSE);
+
+        return (Sparse_table *)(void *)segment->words;
+}
+
+/* directory_length
+ * Purpose:
+ *      Gives how many tables it takes to cover a segment
+ * Arguments:
+ *      (uint32_t) length - How many words the segment holds
+ * Returns:
+ *      (uint32_t) the number of directory entries, at least 1
+ */
+static uint32_t directory_length(uint32_t length)
+{
+        return (uint32_t)(((uint64_t)length >> (PAGE_BITS + TABLE_BITS)) + 1);
+}
@@ -0,0 +1,28 @@
+/* sparse.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Sparse segments, for huge maps of which a program only writes a little
+ * (hash tables, bitmaps). Only the pages which have been written are
+ * stored, in a two-level page table, and words never written read as 0.
+ * Once enough of a sparse segment has been written, Sparse_put says so, and
+ * SegMem replaces it with an ordinary (dense) one
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "segpool.h"
+
+Segment *Sparse_new(uint32_t length);
+uint32_t Sparse_get(const Segment *segment, uint32_t word_idx);
+bool Sparse_put(Segment *segment, uint32_t word_idx, uint32_t word);
+void Sparse_copy(const Segment *segment, uint32_t *words);
+void Sparse_free(Segment **segment);
+
+#endif
@@ -0,0 +1,164 @@
+/* trace.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Writes and reads traces of MAPs and UNMAPs (see trace.h)
+ */
+
+/* Header */
+#include "trace.h"
+
+/* C Std Libs */
+#include <string.h>
+
+/* Hanson Libs */
+#include <assert.h>
+
+static void write_number(FILE *trace, uint32_t number);
+static bool read_number(FILE *trace, uint32_t *number);
+
+/* Trace_start
+ * Purpose:
+ *      Starts a trace, by writing TRACE_MAGIC
+ * Arguments:
+ *      (FILE *) trace - A file opened for writing, at its start
+ * Notes:
+ *      - CRE for trace to be NULL
+ */
+void Trace_start(FILE *trace)
+{
+        assert(trace != NULL);
+
+        fputs(TRACE_MAGIC, trace);
+}
+
+/* Trace_map
+ * Purpose:
+ *      Records a MAP
+ * Arguments:
+ *      (FILE *) trace - The trace, started with Trace_start
+ *      (uint32_t) size - How many words were asked for
+ *      (uint32_t) id - The ID mapped
+ * Notes:
+ *      - CRE for trace to be NULL
+ */
+void Trace_map(FILE *trace, uint32_t size, uint32_t id)
+{
+        assert(trace != NULL);
+
+        putc('M', trace);
+        write_number(trace, size);
+        write_number(trace, id);
+}
+
+/* Trace_unmap
+ * Purpose:
+ *      Records an UNMAP
+ * Arguments:
+ *      (FILE *) trace - The trace, started with Trace_start
+ *      (uint32_t) id - The ID unmapped
+ * Notes:
+ *      - CRE for trace to be NULL
+ */
+void Trace_unmap(FILE *trace, uint32_t id)
+{
+        assert(trace != NULL);
+
+        putc('U', trace);
+        write_number(trace, id);
+}
+
+/* Trace_check
+ * Purpose:
+ *      Reads the start of a trace, to make sure it is one
+ * Arguments:
+ *      (FILE *) trace - A file opened for reading, at its start
+ * Returns:
+ *      (bool) whether it starts with TRACE_MAGIC
+ * Notes:
+ *      - CRE for trace to be NULL
+ */
+bool Trace_check(FILE *trace)
+{
+        assert(trace != NULL);
+
+        char magic[sizeof(TRACE_MAGIC) - 1];
+        return fread(magic, 1, sizeof(magic), trace) == sizeof(magic) &&
+               memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+}
+
+/* Trace_read
+ * Purpose:
+ *      Reads the next record of a trace
+ * Arguments:
+ *      (FILE *) trace - The trace, after Trace_check
+ *      (Trace_record *) record - Set to the record read
+ * Returns:
+ *      (Trace_status) TRACE_RECORD if a whole record was read, TRACE_END at
+ *                     the end of the trace, and TRACE_BROKEN if it ends in
+ *                     the middle of a record (as it does when um is killed
+ *                     while writing it), has a record which is neither a
+ *                     MAP nor an UNMAP, or can't be read
+ * Notes:
+ *      - CRE for either argument to be NULL
+ *      - record is only whole for TRACE_RECORD
+ */
+Trace_status Trace_read(FILE *trace, Trace_record *record)
+{
+        assert(trace != NULL);
+        assert(record != NULL);
+
+        int op = getc(trace);
+        if (op == EOF) {
+                return ferror(trace) ? TRACE_BROKEN : TRACE_END;
+        }
+        if (op != 'M' && op != 'U') {
+                return TRACE_BROKEN;
+        }
+
+        record->map = (op == 'M');
+        record->size = 0;
+        bool whole = !record->map || read_number(trace, &record->size);
+        whole = whole && read_number(trace, &record->id);
+
+        return whole ? TRACE_RECORD : TRACE_BROKEN;
+}
+
+/* write_number
+ * Purpose:
+ *      Writes a number as 4 bytes, least significant first
+ * Arguments:
+ *      (FILE *) trace - Where to write it
+ *      (uint32_t) number - What to write
+ */
+static void write_number(FILE *trace, uint32_t number)
+{
+        for (int i = 0; i < 4; i++) {
+                putc((number >> (8 * i)) & 0xff, trace);
+        }
+}
+
+/* read_number
+ * Purpose:
+ *      Reads a number written by write_number
+ * Arguments:
+ *      (FILE *) trace - Where to read it from
+ *      (uint32_t *) number - Set to the number read
+ * Returns:
+ *      (bool) false if the trace ended first, true otherwise
+ */
+static bool read_number(FILE *trace, uint32_t *number)
+{
+        *number = 0;
+        for (int i = 0; i < 4; i++) {
+                int c = getc(trace);
+                if (c == EOF) {
+                        return false;
+                }
+                *number |= (uint32_t)c << (8 * i);
+        }
+
+        return true;
+}
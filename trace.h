@@ -0,0 +1,47 @@
+/* trace.h
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * Date: November 20, 2023
+ * CS40 HW 6 Universal Machine
+ *
+ * Traces of the MAPs and UNMAPs a program does, written by um --trace FILE
+ * and replayed by umreplay to measure allocators without running the
+ * program again.
+ *
+ * A trace is TRACE_MAGIC followed by one record per MAP or UNMAP, in the
+ * order they were done. Every number is 4 bytes, least significant first:
+ *      MAP     the byte 'M', the size asked for, the ID given back
+ *      UNMAP   the byte 'U', the ID unmapped
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* What every trace starts with */
+#define TRACE_MAGIC "UMTRACE1"
+
+/* One record of a trace */
+typedef struct Trace_record {
+        bool map;               /* A MAP, or else an UNMAP */
+        uint32_t size;          /* Words asked for by a MAP */
+        uint32_t id;            /* ID given back by a MAP, or unmapped */
+} Trace_record;
+
+/* What Trace_read found */
+typedef enum Trace_status {
+        TRACE_RECORD,           /* a whole record */
+        TRACE_END,              /* the end of the trace, after a record */
+        TRACE_BROKEN            /* part of a record, or something else */
+} Trace_status;
+
+void Trace_start(FILE *trace);
+void Trace_map(FILE *trace, uint32_t size, uint32_t id);
+void Trace_unmap(FILE *trace, uint32_t id);
+bool Trace_check(FILE *trace);
+Trace_status Trace_read(FILE *trace, Trace_record *record);
+
+#endif
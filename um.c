@@ -5,12 +5,33 @@
  * Tufts University
  * 11/20/2023
  * 
- * The UM module is the overarching module that handles the fetch, decode, 
- * and execute operations of the universal machine. It is a client of the 
- * registers and memory modules, as well as the decode module.
+ * The UM module is the overarching module that sets up the universal
+ * machine and hands it to an engine to run: the interpreter (interp module)
+ * or the JIT. It is a client of the registers and memory modules.
  *
  * The UM module takes the name of a file containing Universal Machine
  * assembly instructions as an argument. It loads that program and runs it
+ *
+ * With --jit the program is run by the JIT module (Linux on x86-64 only)
+ * instead of the interpreter, and with --tiered it is interpreted until the
+ * JIT has translated its busiest blocks on another thread. --no-fuse turns
+ * off the interpreter's superinstructions (see fuse.h), to check they don't
+ * change anything. --mmap-words N mmaps segments of N words or more (see
+ * segpool.h), and --sparse-words N maps them as sparse (see sparse.h).
+ * --guard puts a guard region after every segment, so that in um-fast
+ * (which has no bounds checks) an access out of bounds is still reported.
+ * --allocator NAME picks what allocates segments (see segalloc.h); the
+ * pool, which --mmap-words and --guard need, is the default. --trace FILE
+ * records every MAP and UNMAP to FILE (see trace.h) for umreplay.
+ * --io throughput writes output only when its buffer fills, at IN and at
+ * HALT; --io interactive after every newline too (see io.h). By default it
+ * is interactive when stdout is a terminal. --in FILE and --out FILE read
+ * input from and write output to files, mmapped when they are regular.
+ * --snapshot-at-halt FILE writes a snapshot of the machine (see snapshot.h)
+ * to FILE when it halts, or when IN reaches the end of input, which then
+ * stops it instead; --snapshot-on-signal FILE writes one when sent SIGUSR1,
+ * at the next IN which waits for input. --restore FILE resumes a machine
+ * from its snapshot instead of running a program from the start
  * 
  */
 
@@ -18,6 +39,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* POSIX */
+#include <signal.h>
 
 /* Hanson Libs */
 #include <assert.h>
@@ -25,41 +51,222 @@
 /* Our Modules */
 #include "segmem.h"
 #include "registers.h"
-#include "decode.h"
+#include "interp.h"
+#include "jit.h"
+#include "io.h"
+#include "snapshot.h"
 
 /* UM Parameters */
 static const int NUM_REGISTERS = 8;
 
+/* What the command line asked for */
+typedef struct Um_options {
+        const char *program; /* Path of the .um file to run */
+        bool jit;            /* Run with the JIT instead of interpreting */
+        bool tiered;         /* Interpret, then run what the JIT translates */
+        bool fuse;           /* Interpret with superinstructions */
+        uint32_t mmap_words; /* Smallest segment to mmap, or 0 for default */
+        uint32_t sparse_words; /* Smallest sparse segment, or 0 for default */
+        bool guard;          /* Whether to follow segments with guard pages */
+        const SegAlloc *alloc; /* What allocates segments */
+        const char *trace;   /* Where to record MAPs and UNMAPs, or NULL */
+        Io_mode io;          /* How often output is written */
+        const char *in;      /* File to input from instead of stdin, or NULL */
+        const char *out;     /* File to output to instead of stdout, or NULL */
+        const char *snapshot; /* Where to snapshot the machine, or NULL */
+        bool on_signal;      /* Snapshot on SIGUSR1 instead of at HALT */
+        const char *restore; /* Snapshot to resume instead of a program */
+} Um_options;
+
 /* Private helper functions */
-void Um_run(FILE *input);
+void Um_run(SegMem_T memory, Registers_T registers, word_t ip,
+            const Um_options *options);
+static Um_options parse_options(int argc, char *argv[]);
+static uint32_t parse_words(const char *arg);
+static Io_mode parse_io_mode(const char *arg);
 static void print_usage();
-void execute(SegMem_T mem, Registers_T regs, Um_opcode opcode, 
-             unsigned rA, unsigned rB, unsigned rC,
-             unsigned loadval_rA, unsigned loadval_value);
+static void request_snapshot(int sig);
 
 int main(int argc, char *argv[])
 {
-        /* Check the right number of input arguments */
-        if (argc != 2) {
-                print_usage();
+        /* Check the input arguments */
+        Um_options options = parse_options(argc, argv);
+
+        /* Initialize the memory and registers, from the snapshot or the
+         * program passed in */
+        Registers_T registers = Registers_new(NUM_REGISTERS);
+        word_t ip = 0;
+        SegMem_T memory;
+        if (options.restore != NULL) {
+                memory = Snapshot_restore(options.restore, registers, &ip);
+                if (memory == NULL) {
+                        fprintf(stderr, "%s: Not a snapshot from um\n",
+                                options.restore);
+                        exit(EXIT_FAILURE);
+                }
+        } else {
+                FILE *input = fopen(options.program, "r"); 
+                if (input == NULL) {
+                        fprintf(stderr, "%s: No such file or directory\n",
+                                options.program);
+                        exit(EXIT_FAILURE);
+                }
+                memory = SegMem_new(input);
+                fclose(input); 
         }
+
+        Um_run(memory, registers, ip, &options);
+
+        SegMem_free(&memory); 
+        Registers_free(&registers);
         
-        /* Open the file passed in and check it */
-        FILE *input = fopen(argv[1], "r"); 
-        if (input == NULL) {
-                fprintf(stderr, "%s: No such file or directory\n", argv[1]);
+        return EXIT_SUCCESS; 
+}
+
+
+/* parse_options
+ * Purpose:
+ *      Reads the command line into a Um_options
+ * Arguments:
+ *      (int) argc, (char **) argv - The command line given to main
+ * Returns:
+ *      (Um_options) what the command line asked for
+ * Notes:
+ *      - Prints the usage and exits if there isn't exactly one program (or
+ *        else --restore), an option isn't recognized or is missing its
+ *        argument, both --jit and --tiered are given, both
+ *        --snapshot-at-halt and --snapshot-on-signal are, or there is no
+ *        allocator by the name given
+ *      - Exits with an error if --jit or --tiered is given where there is
+ *        no JIT, or --mmap-words or --guard with an allocator other than
+ *        the pool, or any of --snapshot-at-halt, --snapshot-on-signal and
+ *        --restore with the JIT, or --restore with --allocator or --guard
+ */
+static Um_options parse_options(int argc, char *argv[])
+{
+        Um_options options = { NULL, false, false, true, 0, 0, false,
+                               &SegAlloc_pool, NULL, IO_AUTO, NULL, NULL,
+                               NULL, false, NULL };
+
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--jit") == 0) {
+                        options.jit = true;
+                } else if (strcmp(argv[i], "--tiered") == 0) {
+                        options.tiered = true;
+                } else if (strcmp(argv[i], "--no-fuse") == 0) {
+                        options.fuse = false;
+                } else if (strcmp(argv[i], "--mmap-words") == 0 &&
+                           i + 1 < argc) {
+                        options.mmap_words = parse_words(argv[++i]);
+                } else if (strcmp(argv[i], "--sparse-words") == 0 &&
+                           i + 1 < argc) {
+                        options.sparse_words = parse_words(argv[++i]);
+                } else if (strcmp(argv[i], "--guard") == 0) {
+                        options.guard = true;
+                } else if (strcmp(argv[i], "--allocator") == 0 &&
+                           i + 1 < argc) {
+                        options.alloc = SegAlloc_find(argv[++i]);
+                        if (options.alloc == NULL) {
+                                print_usage();
+                        }
+                } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                        options.trace = argv[++i];
+                } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+                        options.io = parse_io_mode(argv[++i]);
+                } else if (strcmp(argv[i], "--in") == 0 && i + 1 < argc) {
+                        options.in = argv[++i];
+                } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+                        options.out = argv[++i];
+                } else if ((strcmp(argv[i], "--snapshot-at-halt") == 0 ||
+                            strcmp(argv[i], "--snapshot-on-signal") == 0) &&
+                           i + 1 < argc && options.snapshot == NULL) {
+                        options.on_signal = (strcmp(argv[i],
+                                             "--snapshot-on-signal") == 0);
+                        options.snapshot = argv[++i];
+                } else if (strcmp(argv[i], "--restore") == 0 &&
+                           i + 1 < argc) {
+                        options.restore = argv[++i];
+                } else if (argv[i][0] == '-' || options.program != NULL) {
+                        print_usage();
+                } else {
+                        options.program = argv[i];
+                }
+        }
+
+        if ((options.program == NULL) == (options.restore == NULL) ||
+            (options.jit && options.tiered)) {
+                print_usage();
+        }
+        if ((options.jit || options.tiered) && !Jit_supported) {
+                fprintf(stderr, "um: --jit and --tiered need Linux on "
+                        "x86-64\n");
+                exit(EXIT_FAILURE);
+        }
+        if ((options.mmap_words != 0 || options.guard) &&
+            options.alloc != &SegAlloc_pool) {
+                fprintf(stderr, "um: --mmap-words and --guard need "
+                        "--allocator pool\n");
+                exit(EXIT_FAILURE);
+        }
+        if ((options.snapshot != NULL || options.restore != NULL) &&
+            (options.jit || options.tiered)) {
+                fprintf(stderr, "um: snapshots need the interpreter, not "
+                        "--jit or --tiered\n");
+                exit(EXIT_FAILURE);
+        }
+        if (options.restore != NULL &&
+            (options.alloc != &SegAlloc_pool || options.guard)) {
+                fprintf(stderr, "um: --restore can't be used with "
+                        "--allocator or --guard\n");
                 exit(EXIT_FAILURE);
         }
 
-        /* Give um the opened file */
-        Um_run(input);
+        return options;
+}
 
-        /* Close the file */
-        fclose(input); 
-        
-        return EXIT_SUCCESS; 
+/* parse_words
+ * Purpose:
+ *      Reads the number of words given to an option
+ * Arguments:
+ *      (const char *) arg - The option's argument
+ * Returns:
+ *      (uint32_t) the number, which is at least 1
+ * Notes:
+ *      - Prints the usage and exits if arg isn't such a number
+ */
+static uint32_t parse_words(const char *arg)
+{
+        char *end;
+        unsigned long words = strtoul(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || words == 0 ||
+            words > UINT32_MAX) {
+                print_usage();
+        }
+
+        return words;
 }
 
+/* parse_io_mode
+ * Purpose:
+ *      Reads the mode given to --io
+ * Arguments:
+ *      (const char *) arg - The option's argument
+ * Returns:
+ *      (Io_mode) IO_THROUGHPUT or IO_INTERACTIVE
+ * Notes:
+ *      - Prints the usage and exits if arg is neither "throughput" nor
+ *        "interactive"
+ */
+static Io_mode parse_io_mode(const char *arg)
+{
+        if (strcmp(arg, "throughput") == 0) {
+                return IO_THROUGHPUT;
+        } else if (strcmp(arg, "interactive") == 0) {
+                return IO_INTERACTIVE;
+        }
+        print_usage();
+        return IO_AUTO;
+}
 
 /* print_usage
  * Purpose:
@@ -69,136 +276,135 @@ int main(int argc, char *argv[])
  */
 static void print_usage()
 {
-        fprintf(stderr, "Usage: ./um [um_program.um]\n");
+        fprintf(stderr, "Usage: ./um [--jit | --tiered] [--no-fuse] "
+                "[--mmap-words N] [--sparse-words N] [--guard] "
+                "[--allocator malloc | arena | pool] [--trace FILE] "
+                "[--io throughput | interactive] [--in FILE] [--out FILE] "
+                "[--snapshot-at-halt FILE | --snapshot-on-signal FILE] "
+                "[um_program.um | --restore FILE]\n");
         exit(EXIT_FAILURE);
 }
 
 
 
+/* request_snapshot
+ * Purpose:
+ *      Handles SIGUSR1 with --snapshot-on-signal, by asking IN to stop the
+ *      machine the next time it waits for input (see io.h)
+ */
+static void request_snapshot(int sig)
+{
+        (void)sig;
+        Io_stop_requested = 1;
+}
+
 /* Um_run
  * Purpose: 
- *      Run the UM emulator on the code stored in the opened file passed in
+ *      Run the UM emulator on a machine, from a given instruction
  * Arguments:
- *      (FILE *) input - An opened file to read the program from
+ *      (SegMem_T) memory - The memory, with the program in segment 0
+ *      (Registers_T) registers - The registers
+ *      (word_t) ip - Index in segment 0 of the first instruction to run
+ *      (const Um_options *) options - How to run it
  * Notes:
- *      - CRE for input to be NULL
- *      - Assumes input is already open
+ *      - CRE for memory, registers or options to be NULL
+ *      - memory and registers are left for the caller to free
+ *      - Exits with an error if the trace, output file or snapshot asked
+ *        for can't be written, or the input file can't be read
  */
-void Um_run(FILE *input)
+void Um_run(SegMem_T memory, Registers_T registers, word_t ip,
+            const Um_options *options)
 {
-        assert(input != NULL); 
+        assert(memory != NULL);
+        assert(registers != NULL);
+        assert(options != NULL);
         
-        /* Initialize the memory and registers */
-        SegMem_T memory = SegMem_new(input);
-        Registers_T registers = Registers_new(NUM_REGISTERS);
+        SegMem_set_fusion(memory, options->fuse);
+        if (options->in != NULL && !Io_open_input(options->in)) {
+                fprintf(stderr, "%s: Can't read the input\n", options->in);
+                exit(EXIT_FAILURE);
+        }
+        if (options->out != NULL && !Io_open_output(options->out)) {
+                fprintf(stderr, "%s: Can't write the output\n", options->out);
+                exit(EXIT_FAILURE);
+        }
+        Io_set_mode(options->io);
+        SegMem_set_allocator(memory, options->alloc);
+        if (options->mmap_words != 0) {
+                SegMem_set_mmap_words(memory, options->mmap_words);
+        }
+        if (options->sparse_words != 0) {
+                SegMem_set_sparse_words(memory, options->sparse_words);
+        }
+        if (options->guard) {
+                SegMem_set_guard(memory, true);
+        }
+        FILE *trace = NULL;
+        if (options->trace != NULL) {
+                trace = fopen(options->trace, "wb");
+                if (trace == NULL) {
+                        fprintf(stderr, "%s: Can't write the trace\n",
+                                options->trace);
+                        exit(EXIT_FAILURE);
+                }
+                SegMem_set_trace(memory, trace);
+        }
+        if (options->snapshot != NULL && options->on_signal) {
+                /* Without SA_RESTART, so the signal ends a wait for input */
+                struct sigaction action;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = request_snapshot;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGUSR1, &action, NULL);
+        } else if (options->snapshot != NULL) {
+                Io_stop_at_end = true;
+        }
+
+        if (options->jit || options->tiered) {
+                if (options->jit) {
+                        Jit_run(memory, registers);
+                } else {
+                        Jit_run_tiered(memory, registers);
+                }
+                Io_close();
+                SegMem_set_trace(memory, NULL);
+                if (trace != NULL) {
+                        fclose(trace);
+                }
+                return;
+        }
 
         /* Fetch, decode, execute! */
-        Um_opcode opcode;
-        do {
-                /* Fetch an instruction */
-                word_t instruction = SegMem_fetch_next_i(memory);
-                
-                /* Decode it */
-                unsigned rA, rB, rC, loadval_rA;
-                uint32_t loadval_value;
-                opcode = decode_word(instruction, &rA, &rB, &rC, &loadval_rA, 
-                                       &loadval_value);
-
-                /* Do it */
-                execute(memory, registers, opcode, 
-                        rA, rB, rC, 
-                        loadval_rA, loadval_value);
-        } while (opcode != HALT); 
+        uint64_t instructions = Interp_run(memory, registers, &ip);
+        Io_close();
+        if (options->snapshot != NULL && (Io_stopped || !options->on_signal) &&
+            !Snapshot_save(options->snapshot, memory, registers, ip)) {
+                fprintf(stderr, "%s: Can't write the snapshot\n",
+                        options->snapshot);
+                exit(EXIT_FAILURE);
+        }
 
-        SegMem_free(&memory); 
-        Registers_free(&registers);
-}
+#ifdef UM_STATS
+        fprintf(stderr, "um: %llu instructions executed\n",
+                (unsigned long long)instructions);
+        uint64_t gets, hits;
+        SegMem_pool_counts(memory, &gets, &hits);
+        fprintf(stderr, "um: %llu of %llu segments reused (%.1f%%)\n",
+                (unsigned long long)hits, (unsigned long long)gets,
+                gets == 0 ? 0.0 : 100.0 * hits / gets);
+#ifdef UM_SEGMENT_CACHE
+        uint64_t lookups;
+        SegMem_cache_counts(memory, &lookups, &hits);
+        fprintf(stderr, "um: %llu of %llu segment lookups cached (%.1f%%)\n",
+                (unsigned long long)hits, (unsigned long long)lookups,
+                lookups == 0 ? 0.0 : 100.0 * hits / lookups);
+#endif
+#else
+        (void)instructions;
+#endif
 
-/* execute
- * Purpose:
- *      Execute the UM instruction passed in with given parameters on the 
- *      memory and registers passed in
- * Arguments: 
- *      (SegMem_T) mem - The memory to perform operations on
- *      (Registers_T) regs - The registers to perform operations on
- *      (Um_opcode) opcode - The code of the operation to perform
- *      (unsigned) rA - Which register is register A for 3 register instructions
- *      (unsigned) rB - Which register is register B for 3 register instructions
- *      (unsigned) rC - Which register is register C for 3 register instructions
- *      (unsigned) loadval_rA - Which register is register A for a loadval
- *                              instruction
- *      (unsigned) load_value - If the instruction is loadval, what value to
- *                              load
- * Notes: 
- *      - CRE for mem or regs to be NULL
- */
-void execute(SegMem_T mem, Registers_T regs, Um_opcode opcode, 
-             unsigned rA, unsigned rB, unsigned rC, 
-             unsigned loadval_rA, unsigned loadval_value)
-{
-        assert(mem != NULL); 
-        assert(regs != NULL); 
-
-        /* Get the values of the registers we care about for 3-register 
-         * instructions */
-        word_t rA_val = Registers_get(regs, rA);
-        word_t rB_val = Registers_get(regs, rB);
-        word_t rC_val = Registers_get(regs, rC);
-        
-        /* Performs the operation based on the opcode */
-        word_t word, seg_id;
-        switch (opcode) {
-        case CMOV:
-                if (rC_val != 0) {
-                        Registers_set(regs, rA, rB_val);
-                }
-                break; 
-        case SLOAD:
-                word = SegMem_get_word(mem, rB_val, rC_val); 
-                Registers_set(regs, rA, word);
-                break; 
-        case SSTORE:
-                SegMem_put_word(mem, rA_val, rB_val, rC_val);
-                break; 
-        case ADD:
-                Registers_set(regs, rA, rB_val + rC_val);
-                break; 
-        case MUL:
-                Registers_set(regs, rA, rB_val * rC_val);
-                break; 
-        case DIV:
-                /* don't check for div by 0 for performance */
-                Registers_set(regs, rA, rB_val / rC_val); 
-                break; 
-        case NAND:
-                Registers_set(regs, rA, ~(rB_val & rC_val)); 
-                break; 
-        case HALT: 
-                /* do nothing, let loop end */
-                break; 
-        case MAP:
-                seg_id = SegMem_map(mem, rC_val);
-                Registers_set(regs, rB, seg_id);
-                break; 
-        case UNMAP:
-                SegMem_unmap(mem, rC_val);
-                break; 
-        case OUT:
-                /* URE to out a value larger than 255 */
-                printf("%c", (char)rC_val); 
-                break; 
-        case IN:
-                /* Input is [0, 255] */
-                Registers_set(regs, rC, (char)getchar());
-                break; 
-        case LOADP:
-                SegMem_load_program(mem, rB_val, rC_val);
-                break; 
-        case LV:
-                Registers_set(regs, loadval_rA, loadval_value);
-                break;
-        default:
-                fprintf(stderr, "Instruction opcode not valid: %u\n", opcode);
-                assert(false);
-        }
-}
\ No newline at end of file
+        SegMem_set_trace(memory, NULL);
+        if (trace != NULL) {
+                fclose(trace);
+        }
+}
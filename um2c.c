@@ -0,0 +1,714 @@
+/* um2c.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ *
+ * An ahead-of-time compiler from universal machine programs to native
+ * executables. um2c reads a .um file (with SegMem_new, like um does), writes
+ * a C file with the code for every instruction of the program it can tell
+ * is reachable, and compiles that with gcc against the UM modules (libum.a).
+ *
+ *      Usage: ./um2c [-c] [-o output] program.um
+ *
+ * writes output.c and compiles it to output (by default, the program's name
+ * without its extension). With -c it only writes the C.
+ *
+ * Each straight-line run of the program which starts at a (guessed) jump
+ * target becomes one C function keeping the UM registers in locals, and
+ * every jump within segment 0 goes through a table of those functions.
+ * Whenever the compiled code can't be trusted any more (a LOADP of a segment
+ * other than 0, or running a block some instruction of which has been
+ * stored over) or the target of a jump wasn't compiled, the compiled program
+ * hands its memory and registers to the interpreter (interp module) to
+ * finish the run.
+ */
+
+/* Standard Libs */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* Our Modules */
+#include "segmem.h"
+#include "decode.h"
+
+/* How to compile the C we write. Set by the Makefile so compiled programs
+ * use the same compiler, include paths and libraries as um */
+#ifndef UM2C_CC
+#define UM2C_CC "gcc"
+#endif
+#ifndef UM2C_CFLAGS
+#define UM2C_CFLAGS "-O2"
+#endif
+#ifndef UM2C_LIBS
+#define UM2C_LIBS "libum.a -lcii40 -lm"
+#endif
+
+/* What find_blocks gives instructions which aren't compiled */
+#define NOT_COMPILED UINT32_MAX
+
+/* Private helper functions */
+static void print_usage();
+static char *default_output(const char *program);
+static char *shell_quote(const char *arg);
+static bool ends_block(const Um_instr *instr);
+static bool maybe_code_address(const Um_instr *program, word_t length,
+                               word_t lv_ip);
+static bool *find_starts(const Um_instr *program, word_t length);
+static word_t *find_blocks(const Um_instr *program, word_t length,
+                           const bool *starts);
+static void write_c(FILE *out, const char *name, SegMem_T mem,
+                    const Um_instr *program, word_t length,
+                    const bool *starts, const word_t *block_of);
+static void write_image(FILE *out, SegMem_T mem, word_t length);
+static void write_block_of(FILE *out, const word_t *block_of, word_t length);
+static void write_block(FILE *out, const Um_instr *program, word_t length,
+                        const bool *starts, word_t start);
+static void write_instr(FILE *out, const Um_instr *instr, word_t ip,
+                        word_t start);
+
+int main(int argc, char *argv[])
+{
+        bool compile = true;
+        const char *output = NULL;
+        const char *path = NULL;
+
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "-c") == 0) {
+                        compile = false;
+                } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                        output = argv[++i];
+                } else if (argv[i][0] == '-' || path != NULL) {
+                        print_usage();
+                } else {
+                        path = argv[i];
+                }
+        }
+        if (path == NULL) {
+                print_usage();
+        }
+
+        /* Load the program exactly like um does */
+        FILE *input = fopen(path, "r");
+        if (input == NULL) {
+                fprintf(stderr, "%s: No such file or directory\n", path);
+                exit(EXIT_FAILURE);
+        }
+        SegMem_T mem = SegMem_new(input);
+        fclose(input);
+
+        word_t length;
+        const Um_instr *program = SegMem_program(mem, &length);
+        bool *starts = find_starts(program, length);
+        word_t *block_of = find_blocks(program, length, starts);
+
+        /* Write the C */
+        char *exe = output != NULL ? strcpy(ALLOC(strlen(output) + 1), output)
+                                   : default_output(path);
+        char *c_file = ALLOC(strlen(exe) + 3);
+        sprintf(c_file, "%s.c", exe);
+
+        FILE *out = fopen(c_file, "w");
+        if (out == NULL) {
+                fprintf(stderr, "um2c: can't write %s\n", c_file);
+                exit(EXIT_FAILURE);
+        }
+        write_c(out, path, mem, program, length, starts, block_of);
+        fclose(out);
+
+        /* Compile it */
+        int status = EXIT_SUCCESS;
+        if (compile) {
+                /* The file names come from the user, so they go to the
+                 * shell quoted; the flags are the Makefile's own */
+                char *c_arg = shell_quote(c_file);
+                char *exe_arg = shell_quote(exe);
+                const char *format = "%s %s %s -o %s %s";
+                size_t size = strlen(format) + strlen(UM2C_CC) +
+                              strlen(UM2C_CFLAGS) + strlen(c_arg) +
+                              strlen(exe_arg) + strlen(UM2C_LIBS);
+                char *command = ALLOC(size);
+                sprintf(command, format, UM2C_CC, UM2C_CFLAGS, c_arg,
+                        exe_arg, UM2C_LIBS);
+                if (system(command) != 0) {
+                        fprintf(stderr, "um2c: failed: %s\n", command);
+                        status = EXIT_FAILURE;
+                }
+                FREE(command);
+                FREE(exe_arg);
+                FREE(c_arg);
+        }
+
+        FREE(c_file);
+        FREE(exe);
+        FREE(starts);
+        FREE(block_of);
+        SegMem_free(&mem);
+
+        return status;
+}
+
+/* print_usage
+ * Purpose:
+ *      Prints the usage for um2c
+ * Notes:
+ *      - Prints to stderr and exits program without freeing memory
+ */
+static void print_usage()
+{
+        fprintf(stderr, "Usage: ./um2c [-c] [-o output] [um_program.um]\n");
+        exit(EXIT_FAILURE);
+}
+
+/* default_output
+ * Purpose:
+ *      Makes the default name for the compiled program: the program's path
+ *      without its extension (or with ".out" added if it has none)
+ * Arguments:
+ *      (const char *) program - Path of the .um file
+ * Returns:
+ *      (char *) the name, which the caller must FREE
+ */
+static char *default_output(const char *program)
+{
+        char *name = ALLOC(strlen(program) + 5);
+        strcpy(name, program);
+
+        char *dot = strrchr(name, '.');
+        char *slash = strrchr(name, '/');
+        if (dot != NULL && (slash == NULL || dot > slash)) {
+                *dot = '\0';
+        } else {
+                strcat(name, ".out");
+        }
+        return name;
+}
+
+/* shell_quote
+ * Purpose:
+ *      Quotes a string so the shell passes it on as one argument, exactly
+ *      as written
+ * Arguments:
+ *      (const char *) arg - The string to quote
+ * Returns:
+ *      (char *) the quoted string, which the caller must FREE
+ * Notes:
+ *      - Wraps arg in single quotes, inside which the shell expands nothing,
+ *        and writes each single quote in arg as '\'' (close the quotes, an
+ *        escaped quote, open them again)
+ */
+static char *shell_quote(const char *arg)
+{
+        size_t quotes = 0;
+        for (const char *c = arg; *c != '\0'; c++) {
+                quotes += (*c == '\'');
+        }
+
+        char *quoted = ALLOC(strlen(arg) + 3 * quotes + 3);
+        char *end = quoted;
+        *end++ = '\'';
+        for (const char *c = arg; *c != '\0'; c++) {
+                if (*c == '\'') {
+                        memcpy(end, "'\\''", 4);
+                        end += 4;
+                } else {
+                        *end++ = *c;
+                }
+        }
+        *end++ = '\'';
+        *end = '\0';
+        return quoted;
+}
+
+/* ends_block
+ * Purpose:
+ *      Says whether the instruction after this one can't be reached by
+ *      falling through it
+ * Arguments:
+ *      (const Um_instr *) instr - The instruction
+ * Returns:
+ *      (bool) true for LOADP, HALT and invalid instructions
+ */
+static bool ends_block(const Um_instr *instr)
+{
+        return instr->opcode == LOADP || instr->opcode == HALT ||
+               instr->opcode > LV;
+}
+
+/* maybe_code_address
+ * Purpose:
+ *      Guesses whether the value loaded by an LV could be a code address,
+ *      by following the register it was loaded into to the end of its block
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) length - How many instructions it has
+ *      (word_t) lv_ip - Index of the LV
+ * Returns:
+ *      (bool) false if the value is used as nothing but the index of
+ *      segmented loads and stores (at least once, or before it's overwritten)
+ * Notes:
+ *      - Programs keep their variables in segment 0 too, and without this
+ *        the addresses of those would be compiled (and stores into them
+ *        would look like self-modifying code)
+ *      - Anything else (a LOADP target, arithmetic, being stored) counts as
+ *        maybe code
+ */
+static bool maybe_code_address(const Um_instr *program, word_t length,
+                               word_t lv_ip)
+{
+        unsigned r = program[lv_ip].rA;
+        bool indexed = false;
+
+        for (word_t i = lv_ip + 1; i < length; i++) {
+                const Um_instr *instr = &program[i];
+                unsigned written;
+
+                switch (instr->opcode) {
+                case SLOAD:
+                        if (instr->rB == r) {
+                                return true;
+                        }
+                        indexed = indexed || instr->rC == r;
+                        written = instr->rA;
+                        break;
+                case SSTORE:
+                        if (instr->rA == r || instr->rC == r) {
+                                return true;
+                        }
+                        indexed = indexed || instr->rB == r;
+                        continue;
+                case CMOV:
+                case ADD:
+                case MUL:
+                case DIV:
+                case NAND:
+                        if (instr->rB == r || instr->rC == r) {
+                                return true;
+                        }
+                        /* A CMOV might leave its destination alone */
+                        if (instr->opcode == CMOV) {
+                                continue;
+                        }
+                        written = instr->rA;
+                        break;
+                case MAP:
+                        if (instr->rC == r) {
+                                return true;
+                        }
+                        written = instr->rB;
+                        break;
+                case UNMAP:
+                case OUT:
+                        if (instr->rC == r) {
+                                return true;
+                        }
+                        continue;
+                case IN:
+                        written = instr->rC;
+                        break;
+                case LV:
+                        written = instr->rA;
+                        break;
+                case LOADP:
+                        if (instr->rB == r || instr->rC == r) {
+                                return true;
+                        }
+                        return !indexed;
+                default:
+                        /* HALT, or invalid */
+                        return !indexed;
+                }
+
+                if (written == r) {
+                        return false;
+                }
+        }
+
+        return !indexed;
+}
+
+/* find_starts
+ * Purpose:
+ *      Finds the instructions a jump might land on
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) length - How many instructions it has
+ * Returns:
+ *      (bool *) array of length flags, which the caller must FREE
+ * Notes:
+ *      - Jump targets are computed at run time, so this guesses them: word
+ *        0, the instruction after every LOADP (where calls return to) and
+ *        every value an LV loads which might be a code address (see
+ *        maybe_code_address)
+ *      - A wrong guess only costs speed: jumps to instructions which weren't
+ *        compiled are finished by the interpreter
+ */
+static bool *find_starts(const Um_instr *program, word_t length)
+{
+        bool *starts = CALLOC(length + 1, sizeof(bool));
+
+        starts[0] = true;
+        for (word_t i = 0; i < length; i++) {
+                if (program[i].opcode == LOADP) {
+                        starts[i + 1] = true;
+                }
+                if (program[i].opcode == LV && program[i].value < length &&
+                    maybe_code_address(program, length, i)) {
+                        starts[program[i].value] = true;
+                }
+        }
+
+        return starts;
+}
+
+/* find_blocks
+ * Purpose:
+ *      Splits what gets compiled into blocks: each start and whatever it
+ *      falls through to up to a LOADP, HALT, invalid instruction or the
+ *      next start
+ * Arguments:
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) length - How many instructions it has
+ *      (const bool *) starts - Result of find_starts
+ * Returns:
+ *      (word_t *) array giving, for each instruction, the start of the block
+ *      it is compiled in (or NOT_COMPILED), which the caller must FREE
+ */
+static word_t *find_blocks(const Um_instr *program, word_t length,
+                           const bool *starts)
+{
+        word_t *block_of = ALLOC((length + 1) * sizeof(word_t));
+        for (word_t i = 0; i <= length; i++) {
+                block_of[i] = NOT_COMPILED;
+        }
+
+        for (word_t start = 0; start < length; start++) {
+                if (!starts[start]) {
+                        continue;
+                }
+                for (word_t i = start; i < length; i++) {
+                        if (i != start && starts[i]) {
+                                break;
+                        }
+                        block_of[i] = start;
+                        if (ends_block(&program[i])) {
+                                break;
+                        }
+                }
+        }
+
+        return block_of;
+}
+
+/* write_c
+ * Purpose:
+ *      Writes the C for a compiled program
+ * Arguments:
+ *      (FILE *) out - Where to write it
+ *      (const char *) name - Path of the .um file, for a comment
+ *      (SegMem_T) mem - Memory with the program loaded
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) length - How many instructions it has
+ *      (const bool *) starts - Result of find_starts
+ *      (const word_t *) block_of - Result of find_blocks
+ * Notes:
+ *      - The program's image is embedded in the C and loaded with
+ *        SegMem_new at start up, so the compiled program begins with exactly
+ *        the memory um would
+ */
+static void write_c(FILE *out, const char *name, SegMem_T mem,
+                    const Um_instr *program, word_t length,
+                    const bool *starts, const word_t *block_of)
+{
+        fprintf(out,
+                "/* Compiled from %s by um2c */\n"
+                "\n"
+                "#include <stdlib.h>\n"
+                "#include <stdio.h>\n"
+                "#include <stdint.h>\n"
+                "\n"
+                "#include \"segmem.h\"\n"
+                "#include \"registers.h\"\n"
+                "#include \"interp.h\"\n"
+                "#include \"io.h\"\n"
+                "\n"
+                "#define LENGTH %uu\n"
+                "#define NOT_COMPILED %uu\n"
+                "\n", name, length, NOT_COMPILED);
+
+        fprintf(out, "/* The program, as it is in the .um file */\n"
+                     "static const unsigned char image[] = {");
+        write_image(out, mem, length);
+        fprintf(out, "};\n\n");
+
+        fprintf(out, "/* The block each instruction is compiled in */\n"
+                     "static const uint32_t block_of[LENGTH + 1] = {");
+        write_block_of(out, block_of, length);
+        fprintf(out, "};\n\n");
+
+        fprintf(out,
+                "/* Blocks some instruction of which has been stored over */\n"
+                "static unsigned char stale[LENGTH + 1];\n"
+                "\n"
+                "/* Marks the block a store into segment 0 hit as stale, and "
+                "says whether\n"
+                " * that's the block which is running */\n"
+                "static int store_hits(uint32_t index, uint32_t running)\n"
+                "{\n"
+                "        if (index >= LENGTH || "
+                "block_of[index] == NOT_COMPILED) {\n"
+                "                return 0;\n"
+                "        }\n"
+                "        stale[block_of[index]] = 1;\n"
+                "        return block_of[index] == running;\n"
+                "}\n"
+                "\n");
+
+        fprintf(out,
+                "/* What a block wants done when it returns */\n"
+                "enum { DO_JUMP, DO_LOAD, DO_INTERPRET, DO_HALT };\n"
+                "\n"
+                "typedef struct State {\n"
+                "        uint32_t r[8];\n"
+                "        uint32_t ip, seg;\n"
+                "        SegMem_T mem;\n"
+                "} State;\n"
+                "\n"
+                "typedef int (*Block)(State *s);\n"
+                "\n"
+                "#define ENTER \\\n"
+                "        uint32_t r0 = s->r[0], r1 = s->r[1], "
+                "r2 = s->r[2], r3 = s->r[3]; \\\n"
+                "        uint32_t r4 = s->r[4], r5 = s->r[5], "
+                "r6 = s->r[6], r7 = s->r[7]; \\\n"
+                "        SegMem_T mem = s->mem\n"
+                "#define SAVE(next) \\\n"
+                "        (s->r[0] = r0, s->r[1] = r1, s->r[2] = r2, "
+                "s->r[3] = r3, \\\n"
+                "         s->r[4] = r4, s->r[5] = r5, s->r[6] = r6, "
+                "s->r[7] = r7, \\\n"
+                "         s->ip = (next))\n"
+                "#define LEAVE(next, action) \\\n"
+                "        do { SAVE(next); return (action); } while (0)\n"
+                "\n");
+
+        for (word_t i = 0; i < length; i++) {
+                if (starts[i]) {
+                        fprintf(out, "static int B%u(State *s);\n", i);
+                }
+        }
+        fprintf(out, "\n");
+        for (word_t i = 0; i < length; i++) {
+                if (starts[i]) {
+                        write_block(out, program, length, starts, i);
+                }
+        }
+
+        fprintf(out, "static const Block blocks[LENGTH + 1] = {\n");
+        for (word_t i = 0; i < length; i++) {
+                if (starts[i]) {
+                        fprintf(out, "        [%u] = B%u,\n", i, i);
+                }
+        }
+        fprintf(out, "};\n\n");
+
+        fprintf(out,
+                "int main(void)\n"
+                "{\n"
+                "        FILE *input = fmemopen((void *)image, "
+                "sizeof(image), \"r\");\n"
+                "        SegMem_T mem = SegMem_new(input);\n"
+                "        fclose(input);\n"
+                "        Io_set_mode(IO_AUTO);\n"
+                "\n"
+                "        State s = { .mem = mem };\n"
+                "        int action = DO_JUMP;\n"
+                "        while (action == DO_JUMP) {\n"
+                "                Block block = s.ip <= LENGTH ? "
+                "blocks[s.ip] : NULL;\n"
+                "                action = block != NULL ? block(&s) : "
+                "DO_INTERPRET;\n"
+                "        }\n"
+                "\n"
+                "        if (action == DO_LOAD) {\n"
+                "                SegMem_load_program(mem, s.seg, s.ip);\n"
+                "                action = DO_INTERPRET;\n"
+                "        }\n"
+                "        if (action == DO_INTERPRET) {\n"
+                "                Registers_T regs = Registers_new(8);\n"
+                "                for (unsigned i = 0; i < 8; i++) {\n"
+                "                        Registers_set(regs, i, s.r[i]);\n"
+                "                }\n"
+                "                Interp_run(mem, regs, &s.ip);\n"
+                "                Registers_free(&regs);\n"
+                "        }\n"
+                "\n"
+                "        Io_flush();\n"
+                "        SegMem_free(&mem);\n"
+                "        return EXIT_SUCCESS;\n"
+                "}\n");
+}
+
+/* write_image
+ * Purpose:
+ *      Writes segment 0 as the bytes of a .um file, for an array initializer
+ * Arguments:
+ *      (FILE *) out - Where to write it
+ *      (SegMem_T) mem - Memory with the program loaded
+ *      (word_t) length - How many words segment 0 has
+ */
+static void write_image(FILE *out, SegMem_T mem, word_t length)
+{
+        for (word_t i = 0; i < length; i++) {
+                word_t word = SegMem_get_word(mem, 0, i);
+                fprintf(out, "%s0x%02x,0x%02x,0x%02x,0x%02x,",
+                        i % 4 == 0 ? "\n        " : " ",
+                        word >> 24, (word >> 16) & 0xff,
+                        (word >> 8) & 0xff, word & 0xff);
+        }
+        fprintf(out, "\n");
+}
+
+/* write_block_of
+ * Purpose:
+ *      Writes the result of find_blocks, for an array initializer
+ * Arguments:
+ *      (FILE *) out - Where to write it
+ *      (const word_t *) block_of - Result of find_blocks
+ *      (word_t) length - How many instructions there are
+ */
+static void write_block_of(FILE *out, const word_t *block_of, word_t length)
+{
+        for (word_t i = 0; i < length; i++) {
+                fprintf(out, "%s%uu,", i % 8 == 0 ? "\n        " : " ",
+                        block_of[i]);
+        }
+        fprintf(out, "\n");
+}
+
+/* write_block
+ * Purpose:
+ *      Writes the function which runs the program from one start until it
+ *      jumps, halts or reaches the next start
+ * Arguments:
+ *      (FILE *) out - Where to write it
+ *      (const Um_instr *) program - The predecoded program
+ *      (word_t) length - How many instructions it has
+ *      (const bool *) starts - Result of find_starts
+ *      (word_t) start - Index of the first instruction
+ * Notes:
+ *      - Reaching the next start is a tail call to its function, so no
+ *        instruction is compiled twice
+ *      - A block which has been stored over leaves the rest of the run to
+ *        the interpreter as soon as it is entered
+ */
+static void write_block(FILE *out, const Um_instr *program, word_t length,
+                        const bool *starts, word_t start)
+{
+        fprintf(out, "static int B%u(State *s)\n{\n        ENTER;\n", start);
+        fprintf(out, "        if (stale[%uu]) LEAVE(%uu, DO_INTERPRET);\n",
+                start, start);
+
+        word_t i = start;
+        for (;;) {
+                if (i == length) {
+                        fprintf(out, "        LEAVE(%uu, DO_INTERPRET);\n", i);
+                        break;
+                }
+                if (i != start && starts[i]) {
+                        fprintf(out, "        SAVE(%uu);\n"
+                                     "        return B%u(s);\n", i, i);
+                        break;
+                }
+                write_instr(out, &program[i], i, start);
+                if (ends_block(&program[i])) {
+                        break;
+                }
+                i++;
+        }
+
+        fprintf(out, "}\n\n");
+}
+
+/* write_instr
+ * Purpose:
+ *      Writes the C for one instruction
+ * Arguments:
+ *      (FILE *) out - Where to write it
+ *      (const Um_instr *) instr - The instruction
+ *      (word_t) ip - Its index in segment 0
+ *      (word_t) start - Start of the block it is compiled in
+ * Notes:
+ *      - Does exactly what the interpreter's handler for the instruction
+ *        does, through the same SegMem functions
+ */
+static void write_instr(FILE *out, const Um_instr *instr, word_t ip,
+                        word_t start)
+{
+        unsigned a = instr->rA, b = instr->rB, c = instr->rC;
+
+        fprintf(out, "        /* %u */ ", ip);
+        switch (instr->opcode) {
+        case CMOV:
+                fprintf(out, "if (r%u != 0) r%u = r%u;\n", c, a, b);
+                break;
+        case SLOAD:
+                fprintf(out, "r%u = SegMem_get_word(mem, r%u, r%u);\n",
+                        a, b, c);
+                break;
+        case SSTORE:
+                /* Stores over the block that is running leave the rest
+                 * to the interpreter, which sees the new instruction */
+                fprintf(out, "SegMem_put_word(mem, r%u, r%u, r%u);\n"
+                             "        if (r%u == 0 && store_hits(r%u, %uu)) "
+                             "LEAVE(%uu, DO_INTERPRET);\n",
+                        a, b, c, a, b, start, ip + 1);
+                break;
+        case ADD:
+                fprintf(out, "r%u = r%u + r%u;\n", a, b, c);
+                break;
+        case MUL:
+                fprintf(out, "r%u = r%u * r%u;\n", a, b, c);
+                break;
+        case DIV:
+                fprintf(out, "r%u = r%u / r%u;\n", a, b, c);
+                break;
+        case NAND:
+                fprintf(out, "r%u = ~(r%u & r%u);\n", a, b, c);
+                break;
+        case HALT:
+                fprintf(out, "LEAVE(%uu, DO_HALT);\n", ip);
+                break;
+        case MAP:
+                fprintf(out, "r%u = SegMem_map(mem, r%u);\n", b, c);
+                break;
+        case UNMAP:
+                fprintf(out, "SegMem_unmap(mem, r%u);\n", c);
+                break;
+        case OUT:
+                fprintf(out, "Io_out(r%u);\n", c);
+                break;
+        case IN:
+                fprintf(out, "r%u = Io_in();\n", c);
+                break;
+        case LOADP:
+                fprintf(out, "if (r%u != 0) { s->seg = r%u; "
+                             "LEAVE(r%u, DO_LOAD); }\n"
+                             "        LEAVE(r%u, DO_JUMP);\n", b, b, c, c);
+                break;
+        case LV:
+                fprintf(out, "r%u = %uu;\n", a, instr->value);
+                break;
+        default:
+                /* The interpreter fails on it the way um would */
+                fprintf(out, "LEAVE(%uu, DO_INTERPRET);\n", ip);
+                break;
+        }
+}
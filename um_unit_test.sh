@@ -4,6 +4,9 @@
 
 # For each test, run it (with input if exists) and store output (to diff with
 # expected output if exists)
+#
+# Any arguments are passed on to um, e.g. ./um_unit_test.sh --jit
+um_flags="$@"
 
 # Make the tests
 tests_folder="um-lab"
@@ -34,7 +37,7 @@ while IFS= read -r line; do
         
         # Run um and diff with output. If there's a difference, we failed
         echo "Test $line:"
-        ./um $tests_folder/$line < $expected_in > temp_test_output.out
+        ./um $um_flags $tests_folder/$line < $expected_in > temp_test_output.out
         if [ "$expected_out" != "/dev/null" ]; then
                 # cat $expected_out
                 $(diff temp_test_output.out "$expected_out" > /dev/null)
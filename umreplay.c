@@ -0,0 +1,229 @@
+/* umreplay.c
+ * Authors: Tom Lyons     tlyons01
+ *          Noah Stiegler nstieg01
+ * CS40 HW6 UM
+ * Tufts University
+ *
+ * A benchmark of SegMem's MAP and UNMAP, on traces of real programs written
+ * by um --trace (see trace.h). It does every MAP and UNMAP of the trace, in
+ * order, on an empty memory, without running any UM code.
+ *
+ *      Usage: ./umreplay [--allocator malloc | arena | pool] trace
+ *
+ * Every MAP stores a 0 into every 4KB page of the segment it maps, so the
+ * segment takes the memory it would if a program used it. At the end it
+ * prints:
+ *      - the number of MAPs and UNMAPs, the time they took, and how many
+ *        were done per second
+ *      - the peak resident memory of the process
+ *      - the fragmentation: how much of what the process grew by to reach
+ *        its peak wasn't the words of the segments mapped at their peak
+ *        (anything SegMem keeps besides the words counts, the segment table
+ *        and the segments kept for reuse among them). When the segments
+ *        fit in what the process started with, it is too small to measure
+ */
+
+/* Standard Libs */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* POSIX */
+#include <sys/resource.h>
+
+/* Hanson Libs */
+#include <assert.h>
+#include <mem.h>
+
+/* Our Modules */
+#include "segmem.h"
+#include "segalloc.h"
+#include "trace.h"
+
+/* Words in a 4KB page */
+static const uint32_t PAGE_WORDS = 1024;
+
+/* Private helper functions */
+static void print_usage();
+static void replay(FILE *trace, const SegAlloc *alloc);
+static long peak_rss_kb();
+static double seconds_since(const struct timespec *start);
+
+int main(int argc, char *argv[])
+{
+        const SegAlloc *alloc = &SegAlloc_pool;
+        const char *path = NULL;
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--allocator") == 0 && i + 1 < argc) {
+                        alloc = SegAlloc_find(argv[++i]);
+                        if (alloc == NULL) {
+                                print_usage();
+                        }
+                } else if (argv[i][0] == '-' || path != NULL) {
+                        print_usage();
+                } else {
+                        path = argv[i];
+                }
+        }
+        if (path == NULL) {
+                print_usage();
+        }
+
+        FILE *trace = fopen(path, "rb");
+        if (trace == NULL) {
+                fprintf(stderr, "%s: No such file or directory\n", path);
+                exit(EXIT_FAILURE);
+        }
+        if (!Trace_check(trace)) {
+                fprintf(stderr, "%s: Not a trace from um --trace\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        replay(trace, alloc);
+        fclose(trace);
+
+        return EXIT_SUCCESS;
+}
+
+/* print_usage
+ * Purpose:
+ *      Prints the usage for umreplay
+ * Notes:
+ *      - Prints to stderr and exits program without freeing memory
+ */
+static void print_usage()
+{
+        fprintf(stderr, "Usage: ./umreplay [--allocator malloc | arena | "
+                "pool] trace\n");
+        exit(EXIT_FAILURE);
+}
+
+/* replay
+ * Purpose:
+ *      Does every MAP and UNMAP of a trace, and prints how it went
+ * Arguments:
+ *      (FILE *) trace - The trace, after Trace_check
+ *      (const SegAlloc *) alloc - What allocates the segments
+ * Notes:
+ *      - Exits with an error if a MAP gives back another ID than it did
+ *        when the trace was written (SegMem reuses IDs the same way every
+ *        time, so this means the trace is broken)
+ *      - Exits with an error, before printing anything, if the trace ends
+ *        in the middle of a record or has a record which is neither a MAP
+ *        nor an UNMAP
+ */
+static void replay(FILE *trace, const SegAlloc *alloc)
+{
+        /* An empty program, so only the trace's segments are mapped */
+        FILE *empty = tmpfile();
+        assert(empty != NULL);
+        SegMem_T mem = SegMem_new(empty);
+        fclose(empty);
+        SegMem_set_allocator(mem, alloc);
+
+        /* Length of every mapped segment, by ID, so UNMAPs can count what
+         * is no longer mapped */
+        uint32_t capacity = 1024;
+        uint32_t *lengths = CALLOC(capacity, sizeof(uint32_t));
+        uint64_t live_words = 0, peak_words = 0;
+        uint64_t maps = 0, unmaps = 0;
+
+        long start_kb = peak_rss_kb();
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Trace_record record;
+        Trace_status status;
+        while ((status = Trace_read(trace, &record)) == TRACE_RECORD) {
+                if (!record.map) {
+                        SegMem_unmap(mem, record.id);
+                        live_words -= lengths[record.id];
+                        unmaps++;
+                        continue;
+                }
+
+                uint32_t id = SegMem_map(mem, record.size);
+                if (id != record.id) {
+                        fprintf(stderr, "umreplay: MAP %llu gave segment %u, "
+                                "not %u as in the trace\n",
+                                (unsigned long long)maps + 1, id, record.id);
+                        exit(EXIT_FAILURE);
+                }
+                for (uint64_t i = 0; i < record.size; i += PAGE_WORDS) {
+                        SegMem_put_word(mem, id, i, 0);
+                }
+                while (id >= capacity) {
+                        RESIZE(lengths, 2 * (size_t)capacity *
+                                        sizeof(uint32_t));
+                        capacity *= 2;
+                }
+                lengths[id] = record.size;
+                live_words += record.size;
+                if (live_words > peak_words) {
+                        peak_words = live_words;
+                }
+                maps++;
+        }
+        if (status == TRACE_BROKEN) {
+                fprintf(stderr, "umreplay: not a complete trace: record %llu "
+                        "is cut off or garbled\n",
+                        (unsigned long long)(maps + unmaps) + 1);
+                exit(EXIT_FAILURE);
+        }
+
+        double seconds = seconds_since(&start);
+        long grown_kb = peak_rss_kb() - start_kb;
+        double peak_kb = peak_words * sizeof(word_t) / 1024.0;
+
+        printf("umreplay: %s allocator\n", alloc->name);
+        printf("umreplay: %llu MAPs and %llu UNMAPs in %.3fs "
+               "(%.0f per second)\n", (unsigned long long)maps,
+               (unsigned long long)unmaps, seconds,
+               seconds > 0 ? (maps + unmaps) / seconds : 0.0);
+        printf("umreplay: peak resident memory %ld KB, grown by %ld KB\n",
+               peak_rss_kb(), grown_kb);
+        printf("umreplay: peak mapped words %.0f KB, ", peak_kb);
+        if (peak_kb < grown_kb) {
+                printf("fragmentation %.1f%%\n",
+                       100.0 * (1.0 - peak_kb / grown_kb));
+        } else {
+                printf("fragmentation too small to measure\n");
+        }
+
+        FREE(lengths);
+        SegMem_free(&mem);
+}
+
+/* peak_rss_kb
+ * Purpose:
+ *      Finds the most memory the process has had resident so far
+ * Returns:
+ *      (long) that, in KB
+ */
+static long peak_rss_kb()
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_maxrss;
+}
+
+/* seconds_since
+ * Purpose:
+ *      Works out how long it has been since a time
+ * Arguments:
+ *      (const struct timespec *) start - The time, from CLOCK_MONOTONIC
+ * Returns:
+ *      (double) the seconds since then
+ */
+static double seconds_since(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (now.tv_sec - start->tv_sec) +
+               (now.tv_nsec - start->tv_nsec) / 1e9;
+}
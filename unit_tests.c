@@ -6,6 +6,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+
+/* POSIX */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 /* Hanson Libs */
 #include <except.h>
@@ -15,10 +22,16 @@
 #include "segmem.h"
 #include "registers.h"
 #include "decode.h"
+#include "fuse.h"
+#include "trace.h"
+#include "io.h"
+#include "snapshot.h"
+#include "jit.h"
 
 /* Tests */
 /* SegMem */
 void check_constructor_destructor();
+void check_load_image();
 void check_fetch_next_i_basic();
 void check_get_word_seg_0();
 void check_put_word_seg_0();
@@ -30,18 +43,45 @@ void get_oob_wordid();
 void map_unmap_at_limit(); 
 void map_map_segs(); 
 void check_new_segment_all_0s(); 
+void check_unmapped_segment_reused();
+void check_unmapped_ids_reused();
+void check_fast_paths_follow_table();
+void check_every_allocator();
+void check_trace_records_maps();
+void check_snapshot_restores();
+void check_snapshot_leaves_holes();
+void check_mmapped_segment();
+void check_sparse_segment();
+void check_guarded_segment();
 void get_put_word_new_segments(); 
 void check_load_seg_0(); 
 void check_load_seg_other(); 
+void check_load_seg_copies();
+void check_load_seg_shares();
+void check_program_patched_by_put();
+void check_program_after_load();
+void check_program_fusion();
+void check_program_direct_jump();
+void check_program_watch();
 
 /* Registers */
 void register_check_constructor_destructor();
 void check_register_read_write(); 
 
+/* Io */
+void check_output_buffered();
+void check_input_buffered();
+void check_mapped_files();
+void check_input_stops();
+
+/* JIT */
+void check_jit_invalid_ends_run();
+
 int main()
 {
         /* Constructor/destructor */
         check_constructor_destructor(); 
+        check_load_image();
         
         /* Fetch next instruction */
         check_fetch_next_i_basic(); 
@@ -61,15 +101,43 @@ int main()
         map_unmap_at_limit(0xffff);
         // map_unmap_at_limit(0xfffffff); /* Takes forever */
         check_new_segment_all_0s(); 
+        check_unmapped_segment_reused();
+        check_unmapped_ids_reused();
+        check_fast_paths_follow_table();
+        check_every_allocator();
+        check_trace_records_maps();
+        check_snapshot_restores();
+        check_snapshot_leaves_holes();
+        check_mmapped_segment();
+        check_sparse_segment();
+        check_guarded_segment();
         get_put_word_new_segments(); 
         
         /* Load_seg */
         check_load_seg_0(); 
         check_load_seg_other(); 
+        check_load_seg_copies();
+        check_load_seg_shares();
+
+        /* Predecoded program */
+        check_program_patched_by_put();
+        check_program_after_load();
+        check_program_fusion();
+        check_program_direct_jump();
+        check_program_watch();
 
         /* Test registers */
         register_check_constructor_destructor();
         check_register_read_write(); 
+
+        /* Test the console */
+        check_output_buffered();
+        check_input_buffered();
+        check_mapped_files();
+        check_input_stops();
+
+        /* Test the JIT */
+        check_jit_invalid_ends_run();
 }
 
 /* Ensure memory can be properly allacated and deallocated */
@@ -91,6 +159,60 @@ void check_constructor_destructor() {
         assert(mem == NULL);
 }
 
+/* A program is read from big-endian words, from a file or a pipe, and one
+ * which ends in the middle of a word is rejected */
+void check_load_image()
+{
+        /* Nine words, so both the 4 at a time swaps and the rest run */
+        unsigned char image[36];
+        for (int i = 0; i < 36; i++) {
+                image[i] = i;
+        }
+
+        FILE *file = tmpfile();
+        assert(file != NULL);
+        fwrite(image, 1, sizeof(image), file);
+        rewind(file);
+        SegMem_T mem = SegMem_new(file);
+        fclose(file);
+        assert(mem->segments[0]->length == 9);
+        for (uint32_t i = 0; i < 9; i++) {
+                assert(SegMem_get_word(mem, 0, i) == 0x00010203u +
+                                                     0x04040404u * i);
+        }
+        SegMem_free(&mem);
+
+        int ends[2];
+        assert(pipe(ends) == 0);
+        assert(write(ends[1], image, sizeof(image)) == sizeof(image));
+        close(ends[1]);
+        FILE *piped = fdopen(ends[0], "r");
+        assert(piped != NULL);
+        mem = SegMem_new(piped);
+        fclose(piped);
+        assert(mem->segments[0]->length == 9);
+        assert(SegMem_get_word(mem, 0, 8) == 0x20212223);
+        SegMem_free(&mem);
+        assert(mem == NULL);
+
+        /* The child's complaint goes to a stderr thrown away here */
+        file = tmpfile();
+        assert(file != NULL);
+        fwrite(image, 1, 7, file);
+        rewind(file);
+        pid_t child = fork();
+        assert(child >= 0);
+        if (child == 0) {
+                dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+                SegMem_new(file);
+                _exit(EXIT_SUCCESS);
+        }
+        int status;
+        assert(waitpid(child, &status, 0) == child);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+        fclose(file);
+}
+
 /* Reads a simple example file with the constructor. Compare instructions 
  * fetched with those in the hardcoded file. Uses SegMem_new() and SegMem_free()
  */ 
@@ -415,6 +537,438 @@ void check_new_segment_all_0s()
         assert(mem == NULL);
 }
 
+/* An unmapped segment is reused, zeroed, for the next map of the same size
+ * class, and the pool counts it */
+void check_unmapped_segment_reused()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        /* Loading the program counts as the first */
+        uint64_t gets, hits;
+        uint32_t segid = SegMem_map(mem, 40);
+        SegMem_put_word(mem, segid, 39, 0xabc);
+        SegMem_unmap(mem, segid);
+        SegMem_pool_counts(mem, &gets, &hits);
+        assert(gets == 2 && hits == 0);
+
+        /* 40 and 33 words are in the same class */
+        segid = SegMem_map(mem, 33);
+        for (uint32_t i = 0; i < 33; i++) {
+                assert(SegMem_get_word(mem, segid, i) == 0);
+        }
+        SegMem_put_word(mem, segid, 32, 0xdef);
+        SegMem_pool_counts(mem, &gets, &hits);
+        assert(gets == 3 && hits == 1);
+
+        /* A different class doesn't reuse it */
+        SegMem_unmap(mem, segid);
+        segid = SegMem_map(mem, 3);
+        SegMem_pool_counts(mem, &gets, &hits);
+        assert(gets == 4 && hits == 1);
+
+        /* Grown back to 40 words, the old words must be 0 again */
+        uint32_t big = SegMem_map(mem, 40);
+        assert(SegMem_get_word(mem, big, 32) == 0);
+        assert(SegMem_get_word(mem, big, 39) == 0);
+        SegMem_pool_counts(mem, &gets, &hits);
+        assert(gets == 5 && hits == 2);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Segments past the mmap threshold read as 0, hold what is stored, load
+ * as a program, and go back to the kernel on unmap */
+void check_mmapped_segment()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        SegMem_set_mmap_words(mem, 1024);
+        uint32_t size = 1 << 22;
+        uint32_t segid = SegMem_map(mem, size);
+        assert(SegMem_get_word(mem, segid, 0) == 0);
+        assert(SegMem_get_word(mem, segid, size / 2) == 0);
+        assert(SegMem_get_word(mem, segid, size - 1) == 0);
+        SegMem_put_word(mem, segid, 0, 0x70000000);
+        SegMem_put_word(mem, segid, size - 1, 0x123);
+
+        /* Out of bounds is still caught */
+        bool failed = false;
+        TRY {
+                SegMem_get_word(mem, segid, size);
+        } ELSE {
+                failed = true;
+        } END_TRY;
+        assert(failed);
+
+        /* The copy in segment 0 is mmapped too */
+        SegMem_load_program(mem, segid, 0);
+        assert(SegMem_fetch_next_i(mem) == 0x70000000);
+        assert(SegMem_get_word(mem, 0, size - 1) == 0x123);
+
+        SegMem_unmap(mem, segid);
+        segid = SegMem_map(mem, 2048);
+        assert(SegMem_get_word(mem, segid, 2047) == 0);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Sparse segments read as 0 where unwritten, keep what is stored through
+ * being made dense, and load as a program */
+void check_sparse_segment()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        /* 4G words would be 16GB if it weren't sparse */
+        SegMem_set_sparse_words(mem, 4096);
+        uint32_t huge = SegMem_map(mem, UINT32_MAX);
+        SegMem_put_word(mem, huge, 0, 0x70000000);
+        SegMem_put_word(mem, huge, UINT32_MAX - 1, 0x123);
+        SegMem_put_word(mem, huge, 1 << 30, 0);
+        assert(SegMem_get_word(mem, huge, 0) == 0x70000000);
+        assert(SegMem_get_word(mem, huge, 1) == 0);
+        assert(SegMem_get_word(mem, huge, 1 << 30) == 0);
+        assert(SegMem_get_word(mem, huge, UINT32_MAX - 1) == 0x123);
+        SegMem_unmap(mem, huge);
+
+        /* Filling one up makes it dense part way through */
+        uint32_t size = 10000;
+        uint32_t segid = SegMem_map(mem, size);
+        for (uint32_t i = 0; i < size; i += 2) {
+                SegMem_put_word(mem, segid, i, i + 1);
+        }
+        for (uint32_t i = 0; i < size; i++) {
+                assert(SegMem_get_word(mem, segid, i) ==
+                       (i % 2 == 0 ? i + 1 : 0));
+        }
+
+        /* Loading a sparse one copies the words written */
+        uint32_t program = SegMem_map(mem, size);
+        SegMem_put_word(mem, program, 0, 0x70000000);
+        SegMem_put_word(mem, program, size - 1, 0xabc);
+        SegMem_load_program(mem, program, 0);
+        assert(SegMem_fetch_next_i(mem) == 0x70000000);
+        assert(SegMem_get_word(mem, 0, 1) == 0);
+        assert(SegMem_get_word(mem, 0, size - 1) == 0xabc);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Guarded segments behave like any other, and an unchecked access past the
+ * end of one makes the process fail */
+void check_guarded_segment()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        SegMem_set_guard(mem, true);
+        uint32_t size = 1000;
+        uint32_t segid = SegMem_map(mem, size);
+        assert(SegMem_get_word(mem, segid, size - 1) == 0);
+        SegMem_put_word(mem, segid, size - 1, 0x70000000);
+        assert(SegMem_get_word_fast(mem, segid, size - 1) == 0x70000000);
+
+        /* Even huge ones aren't sparse, and they go back on unmap */
+        SegMem_set_sparse_words(mem, 1024);
+        uint32_t big = SegMem_map(mem, 1 << 20);
+        assert(mem->segments[big]->kind == SEGMENT_GUARDED);
+        SegMem_unmap(mem, big);
+
+        /* Segment 0 is guarded too */
+        SegMem_load_program(mem, segid, size - 1);
+        assert(SegMem_fetch_next_i(mem) == 0x70000000);
+        segid = SegMem_map(mem, size);
+
+        /* The child's fault is reported, on a stderr thrown away here */
+        pid_t child = fork();
+        assert(child >= 0);
+        if (child == 0) {
+                dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+                SegMem_note_access(mem, 7);
+                SegMem_put_word_fast(mem, segid, size, 1);
+                _exit(EXIT_SUCCESS);
+        }
+        int status;
+        assert(waitpid(child, &status, 0) == child);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Unmapped IDs come back last unmapped first, can't be used while on the
+ * free list, and no ID needs bounds checking */
+void check_unmapped_ids_reused()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        uint32_t a = SegMem_map(mem, 1);
+        uint32_t b = SegMem_map(mem, 2);
+        uint32_t c = SegMem_map(mem, 3);
+        SegMem_unmap(mem, a);
+        SegMem_unmap(mem, c);
+
+        bool failed = false;
+        TRY {
+                SegMem_get_word(mem, c, 0);
+        } ELSE {
+                failed = true;
+        } END_TRY;
+        assert(failed);
+        failed = false;
+        TRY {
+                SegMem_get_word(mem, UINT32_MAX, 0);
+        } ELSE {
+                failed = true;
+        } END_TRY;
+        assert(failed);
+
+        assert(SegMem_map(mem, 4) == c);
+        assert(SegMem_map(mem, 5) == a);
+        assert(SegMem_map(mem, 6) == c + 1);
+        assert(SegMem_get_word(mem, b, 1) == 0);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* The fast paths see every change to the segment table, even through the
+ * last-segment cache (make SEGCACHE=1) */
+void check_fast_paths_follow_table()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        /* IDs 1 and 9 share an entry of the cache */
+        uint32_t segid = SegMem_map(mem, 10);
+        for (uint32_t i = 2; i < 10; i++) {
+                SegMem_map(mem, 1);
+        }
+        uint32_t other = SegMem_map(mem, 10);
+        SegMem_put_word_fast(mem, segid, 0, 0x1);
+        SegMem_put_word_fast(mem, other, 0, 0x2);
+        assert(SegMem_get_word_fast(mem, segid, 0) == 0x1);
+        assert(SegMem_get_word_fast(mem, other, 0) == 0x2);
+
+        /* A remapped ID is a new segment */
+        SegMem_unmap(mem, segid);
+        assert(SegMem_map(mem, 10) == segid);
+        assert(SegMem_get_word_fast(mem, segid, 0) == 0);
+
+        /* After a load, and a store which copies segment 0 */
+        SegMem_put_word_fast(mem, segid, 0, 0x70000000);
+        SegMem_load_program(mem, segid, 0);
+        assert(SegMem_get_word_fast(mem, 0, 0) == 0x70000000);
+        SegMem_put_word_fast(mem, 0, 0, 0x3);
+        assert(SegMem_get_word_fast(mem, 0, 0) == 0x3);
+        assert(SegMem_get_word_fast(mem, segid, 0) == 0x70000000);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Every allocator gives out zeroed segments, even from space a shrink gave
+ * back, resizes them, keeps segment 0 when it is switched to, and frees
+ * everything with the memory (run under valgrind by make test) */
+void check_every_allocator()
+{
+        const SegAlloc *allocators[] = {
+                &SegAlloc_malloc, &SegAlloc_arena, &SegAlloc_pool
+        };
+        for (int k = 0; k < 3; k++) {
+                const SegAlloc *alloc = allocators[k];
+                assert(SegAlloc_find(alloc->name) == alloc);
+
+                /* Resizing keeps the words and zeroes the new ones */
+                void *state = alloc->open();
+                Segment *segment = alloc->new_segment(state, 4);
+                segment->words[3] = 0x4;
+                segment = alloc->resize(state, segment, 1 << 18);
+                assert(segment->length == 1 << 18);
+                assert(segment->words[3] == 0x4);
+                assert(segment->words[(1 << 18) - 1] == 0);
+                segment = alloc->resize(state, segment, 2);
+                assert(segment->length == 2);
+                alloc->free_segment(state, segment);
+
+                /* What a shrink gives back comes out zeroed again */
+                segment = alloc->new_segment(state, 100);
+                for (int i = 0; i < 100; i++) {
+                        segment->words[i] = 0xdead;
+                }
+                segment = alloc->resize(state, segment, 2);
+                Segment *next = alloc->new_segment(state, 50);
+                for (int i = 0; i < 50; i++) {
+                        assert(next->words[i] == 0);
+                }
+                alloc->free_segment(state, next);
+                alloc->free_segment(state, segment);
+                alloc->reset(state);
+                alloc->close(state);
+
+                /* Open the file passed in and check it */
+                FILE *input = fopen("add.um", "r"); 
+                assert(input != NULL);
+
+                /* Pass it to memory as the initial program */
+                SegMem_T mem = SegMem_new(input);
+
+                /* Close the file */
+                fclose(input);
+
+                uint32_t first = SegMem_get_word(mem, 0, 0);
+                SegMem_set_allocator(mem, alloc);
+                assert(SegMem_get_word(mem, 0, 0) == first);
+
+                /* Map, store, unmap and map again, big and small */
+                uint32_t big = SegMem_map(mem, 1 << 18);
+                uint32_t small = SegMem_map(mem, 3);
+                SegMem_put_word(mem, big, (1 << 18) - 1, 0x1);
+                SegMem_put_word(mem, small, 2, 0x2);
+                SegMem_unmap(mem, small);
+                assert(SegMem_map(mem, 3) == small);
+                assert(SegMem_get_word(mem, small, 2) == 0);
+                assert(SegMem_get_word(mem, big, (1 << 18) - 1) == 0x1);
+
+                /* Load a segment, and store into the copy segment 0 gets */
+                SegMem_put_word(mem, small, 0, 0x70000000);
+                SegMem_load_program(mem, small, 0);
+                SegMem_put_word(mem, 0, 1, 0x3);
+                assert(SegMem_get_word(mem, small, 1) == 0);
+
+                /* Free the memory with the destructor */
+                SegMem_free(&mem);
+
+                /* Check that destructor set the variable to NULL */
+                assert(mem == NULL);
+        }
+        assert(SegAlloc_find("jemalloc") == NULL);
+}
+
+/* A trace holds every MAP and UNMAP, in order, and reads back as written.
+ * One that ends in a record, or has a garbled one, reads back as broken */
+void check_trace_records_maps()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input);
+
+        FILE *trace = tmpfile();
+        assert(trace != NULL);
+        SegMem_set_trace(mem, trace);
+        uint32_t a = SegMem_map(mem, 7);
+        uint32_t b = SegMem_map(mem, 0x12345678);
+        SegMem_unmap(mem, a);
+        SegMem_set_trace(mem, NULL);
+        SegMem_unmap(mem, b);
+
+        rewind(trace);
+        Trace_record record;
+        assert(Trace_check(trace));
+        assert(Trace_read(trace, &record) == TRACE_RECORD);
+        assert(record.map && record.size == 7 && record.id == a);
+        assert(Trace_read(trace, &record) == TRACE_RECORD);
+        assert(record.map && record.size == 0x12345678 && record.id == b);
+        assert(Trace_read(trace, &record) == TRACE_RECORD);
+        assert(!record.map && record.id == a);
+        assert(Trace_read(trace, &record) == TRACE_END);
+        fclose(trace);
+
+        /* A trace cut off in a record, or with a record that is neither a
+         * MAP nor an UNMAP, is broken */
+        const char *endings[] = { "M\x07\x08", "U", "X\x01\x02\x03\x04" };
+        for (int k = 0; k < 3; k++) {
+                trace = tmpfile();
+                assert(trace != NULL);
+                Trace_start(trace);
+                Trace_unmap(trace, 1);
+                fputs(endings[k], trace);
+                rewind(trace);
+                assert(Trace_check(trace));
+                assert(Trace_read(trace, &record) == TRACE_RECORD);
+                assert(Trace_read(trace, &record) == TRACE_BROKEN);
+                fclose(trace);
+        }
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
 /* Map several new segments then put and get words from them to ensure 
  * they are as they should be */
 void get_put_word_new_segments()
@@ -472,6 +1026,128 @@ void get_put_word_new_segments()
         assert(mem == NULL);
 }
 
+/* A snapshot brings back every segment (sparse ones too), segment 0 still
+ * sharing the segment it was loaded from, the unmapped IDs in the order
+ * they are reused, the registers and the instruction to run next. What is
+ * restored can be stored into without changing the snapshot, and saved
+ * over it */
+void check_snapshot_restores()
+{
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+        SegMem_T mem = SegMem_new(input);
+        fclose(input);
+
+        SegMem_set_sparse_words(mem, 1 << 20);
+        uint32_t a = SegMem_map(mem, 3);
+        uint32_t b = SegMem_map(mem, 1 << 20);
+        uint32_t c = SegMem_map(mem, 5);
+        uint32_t d = SegMem_map(mem, 2);
+        SegMem_put_word(mem, a, 2, 0x12345678);
+        SegMem_put_word(mem, b, (1 << 20) - 1, 42);
+        SegMem_put_word(mem, d, 0, 0x70000000);
+        SegMem_unmap(mem, a);
+        SegMem_unmap(mem, c);
+        SegMem_load_program(mem, d, 0);
+        Registers_T regs = Registers_new(8);
+        for (unsigned k = 0; k < 8; k++) {
+                Registers_set(regs, k, k * 1000);
+        }
+
+        char path[] = "/tmp/unit_tests_snapshot_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        assert(Snapshot_save(path, mem, regs, 1));
+        SegMem_free(&mem);
+        Registers_free(&regs);
+
+        regs = Registers_new(8);
+        word_t ip = 0;
+        SegMem_T restored = Snapshot_restore(path, regs, &ip);
+        assert(restored != NULL);
+        assert(ip == 1);
+        for (unsigned k = 0; k < 8; k++) {
+                assert(Registers_get(regs, k) == k * 1000);
+        }
+        assert(SegMem_get_word(restored, b, (1 << 20) - 1) == 42);
+        assert(SegMem_get_word(restored, 0, 0) == 0x70000000);
+        SegMem_put_word(restored, 0, 1, 7);
+        assert(SegMem_get_word(restored, 0, 1) == 7);
+        assert(SegMem_get_word(restored, d, 1) == 0);
+        assert(SegMem_get_word(restored, d, 0) == 0x70000000);
+
+        assert(SegMem_map(restored, 1) == c);
+        assert(SegMem_map(restored, 1) == a);
+        assert(SegMem_get_word(restored, a, 0) == 0);
+        SegMem_put_word(restored, b, (1 << 20) - 1, 43);
+        SegMem_unmap(restored, b);
+        assert(SegMem_map(restored, 1) == b);
+        assert(SegMem_map(restored, 1) == d + 1);
+
+        /* Saved over the file its segments are still in */
+        SegMem_T again = Snapshot_restore(path, regs, &ip);
+        assert(again != NULL);
+        assert(SegMem_get_word(again, b, (1 << 20) - 1) == 42);
+        assert(Snapshot_save(path, restored, regs, 0));
+        assert(SegMem_get_word(again, b, (1 << 20) - 1) == 42);
+        SegMem_free(&again);
+        SegMem_free(&restored);
+
+        again = Snapshot_restore(path, regs, &ip);
+        assert(again != NULL);
+        assert(ip == 0);
+        assert(SegMem_get_word(again, b, 0) == 0);
+        assert(SegMem_get_word(again, 0, 1) == 7);
+        SegMem_free(&again);
+
+        /* Anything else isn't a snapshot */
+        assert(Snapshot_restore("add.um", regs, &ip) == NULL);
+        unlink(path);
+        assert(Snapshot_restore(path, regs, &ip) == NULL);
+        Registers_free(&regs);
+        assert(again == NULL);
+}
+
+/* A sparse segment's pages of zeros are holes in its snapshot: 64MB of
+ * segment with one word written takes a few pages of disk, and reads back
+ * the same */
+void check_snapshot_leaves_holes()
+{
+        FILE *input = fopen("add.um", "r");
+        assert(input != NULL);
+        SegMem_T mem = SegMem_new(input);
+        fclose(input);
+
+        word_t length = 1 << 24;
+        SegMem_set_sparse_words(mem, 1 << 20);
+        uint32_t id = SegMem_map(mem, length);
+        SegMem_put_word(mem, id, length / 2, 42);
+        Registers_T regs = Registers_new(8);
+
+        char path[] = "/tmp/unit_tests_snapshot_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        assert(Snapshot_save(path, mem, regs, 0));
+        SegMem_free(&mem);
+
+        struct stat info;
+        assert(stat(path, &info) == 0);
+        assert((uint64_t)info.st_size > (uint64_t)length * sizeof(word_t));
+        assert((uint64_t)info.st_blocks * 512 < (1 << 20));
+
+        word_t ip;
+        mem = Snapshot_restore(path, regs, &ip);
+        assert(mem != NULL);
+        assert(SegMem_get_word(mem, id, length / 2) == 42);
+        assert(SegMem_get_word(mem, id, 0) == 0);
+        assert(SegMem_get_word(mem, id, length - 1) == 0);
+        SegMem_free(&mem);
+        Registers_free(&regs);
+        unlink(path);
+}
+
 /* 
  * Test on segment 0 by loading a program, fetching its instructions 
  * and printing them out, then loading segment 0 at program counter 0, 
@@ -567,6 +1243,245 @@ void check_load_seg_other()
         assert(mem == NULL);
 }
 
+/* Loading a segment as the program copies it: later stores into either
+ * one don't show up in the other, and the copy keeps the whole length */
+void check_load_seg_copies()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        uint32_t size = 100000;
+        uint32_t segid = SegMem_map(mem, size);
+        SegMem_put_word(mem, segid, 0, 0x70000000);
+        SegMem_put_word(mem, segid, size - 1, 0xabcdef);
+
+        SegMem_load_program(mem, segid, 0);
+        SegMem_put_word(mem, segid, 0, 0x1);
+        SegMem_put_word(mem, 0, size - 1, 0x2);
+
+        assert(SegMem_get_word(mem, 0, 0) == 0x70000000);
+        assert(SegMem_get_word(mem, 0, 1) == 0);
+        assert(SegMem_get_word(mem, segid, 0) == 0x1);
+        assert(SegMem_get_word(mem, segid, size - 1) == 0xabcdef);
+
+        /* Past the end of the copy */
+        bool failed = false;
+        TRY {
+                SegMem_get_word(mem, 0, size);
+        } ELSE {
+                failed = true;
+        } END_TRY;
+        assert(failed);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Segment 0 shares the loaded segment's words until one is stored into,
+ * outlives it when it's unmapped, and keeps its decoding when it's loaded
+ * again, even after another one */
+void check_load_seg_shares()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        uint32_t size = 1000;
+        uint32_t segid = SegMem_map(mem, size);
+        SegMem_put_word(mem, segid, 0, 0x70000000);
+
+        /* Loading it again doesn't decode it again */
+        word_t length;
+        SegMem_load_program(mem, segid, 0);
+        const Um_instr *program = SegMem_program(mem, &length);
+        SegMem_load_program(mem, segid, 0);
+        assert(SegMem_program(mem, &length) == program);
+        assert(length == size);
+        uint32_t other = SegMem_map(mem, 10);
+        SegMem_load_program(mem, other, 0);
+        assert(SegMem_program(mem, &length) != program && length == 10);
+        SegMem_load_program(mem, segid, 0);
+        assert(SegMem_program(mem, &length) == program);
+
+        /* But not after a store into it */
+        SegMem_load_program(mem, other, 0);
+        SegMem_put_word(mem, segid, 1, 0x70000000);
+        SegMem_load_program(mem, segid, 0);
+        assert(SegMem_program(mem, &length)[1].opcode == HALT);
+
+        /* A store into the other one leaves segment 0 alone */
+        SegMem_put_word_fast(mem, segid, 0, 0x1);
+        assert(SegMem_get_word(mem, 0, 0) == 0x70000000);
+        assert(SegMem_get_word(mem, segid, 0) == 0x1);
+
+        /* Unmapping the loaded one leaves segment 0 its words */
+        SegMem_load_program(mem, segid, 0);
+        SegMem_unmap(mem, segid);
+        assert(SegMem_get_word(mem, 0, 0) == 0x1);
+        other = SegMem_map(mem, size);
+        assert(SegMem_get_word(mem, other, 0) == 0);
+        assert(SegMem_fetch_next_i(mem) == 0x1);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Check the predecoded program matches segment 0, and that storing into
+ * segment 0 updates the predecoded instruction at that index */
+void check_program_patched_by_put()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        /* add.um is ADD r1 r2 r3 then HALT */
+        word_t length;
+        const Um_instr *program = SegMem_program(mem, &length);
+        assert(length == 2);
+        assert(program[0].opcode == ADD);
+        assert(program[0].rA == 1 && program[0].rB == 2 && program[0].rC == 3);
+        assert(program[1].opcode == HALT);
+
+        /* Past the end is an invalid instruction */
+        assert(program[2].opcode > LV);
+
+        /* Overwrite the HALT with LV r4 0x1abcdef */
+        SegMem_put_word(mem, 0, 1, 0xd9abcdef);
+        program = SegMem_program(mem, &length);
+        assert(length == 2);
+        assert(program[1].opcode == LV);
+        assert(program[1].rA == 4);
+        assert(program[1].value == 0x1abcdef);
+        assert(program[1].handler == UM_HANDLER(LV, 4, 0, 0));
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Check that loading a program from another segment gives back a new
+ * predecoded program matching that segment */
+void check_program_after_load()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        word_t length;
+        SegMem_program(mem, &length);
+        assert(length == 2);
+
+        /* Make a 3 instruction program: OUT r3, NAND r0 r1 r2, HALT */
+        uint32_t segid = SegMem_map(mem, 3);
+        SegMem_put_word(mem, segid, 0, 0xa0000003);
+        SegMem_put_word(mem, segid, 1, 0x6000000a);
+        SegMem_put_word(mem, segid, 2, 0x70000000);
+
+        SegMem_load_program(mem, segid, 0);
+
+        const Um_instr *program = SegMem_program(mem, &length);
+        assert(length == 3);
+        assert(program[0].opcode == OUT && program[0].rC == 3);
+        assert(program[1].opcode == NAND);
+        assert(program[1].rA == 0 && program[1].rB == 1 && program[1].rC == 2);
+        assert(program[2].opcode == HALT);
+
+        /* Storing into the source segment doesn't change the program */
+        SegMem_put_word(mem, segid, 2, 0xa0000003);
+        program = SegMem_program(mem, &length);
+        assert(program[2].opcode == HALT);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Check that superinstructions are found in the predecoded program, redone
+ * when a store changes an opcode, and gone when fusion is turned off */
+void check_program_fusion()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        /* ADD r1 r2 r3, HALT: nothing to fuse */
+        word_t length;
+        const Um_instr *program = SegMem_program(mem, &length);
+        assert(program[0].handler == UM_HANDLER(ADD, 1, 2, 3));
+        assert(program[1].handler == UM_HANDLER(HALT, 0, 0, 0));
+
+        /* LV r1 5, HALT: still nothing */
+        SegMem_put_word(mem, 0, 0, 0xd2000005);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == UM_HANDLER(LV, 1, 0, 0));
+
+        /* LV r1 5, ADD r1 r2 r3: the LV starts an LV_ADD, and the ADD can
+         * still be jumped to on its own */
+        SegMem_put_word(mem, 0, 1, 0x30000053);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == FUSED_LV_ADD);
+        assert(program[1].handler == UM_HANDLER(ADD, 1, 2, 3));
+
+        /* Changing registers but not opcodes keeps the superinstruction */
+        SegMem_put_word(mem, 0, 1, 0x3000001a);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == FUSED_LV_ADD);
+        assert(program[1].handler == UM_HANDLER(ADD, 0, 3, 2));
+
+        /* Turned off, every instruction is its own handler */
+        SegMem_set_fusion(mem, false);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == UM_HANDLER(LV, 1, 0, 0));
+        assert(program[1].handler == UM_HANDLER(ADD, 0, 3, 2));
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
 /* Allocates a register with the constructor, then deallocates with
  * the destructor. Ensure instance can be created and freed without memory
  * leaks in valgrind */ 
@@ -600,6 +1515,140 @@ void check_register_read_write()
         assert(regs == NULL);
 }
 
+/* OUT is written when the buffer fills, on Io_flush, and after a newline
+ * only in interactive mode */
+void check_output_buffered()
+{
+        /* Send stdout to a file for a while */
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        FILE *file = tmpfile();
+        assert(saved >= 0 && file != NULL);
+        dup2(fileno(file), STDOUT_FILENO);
+
+        Io_set_mode(IO_THROUGHPUT);
+        Io_out('a');
+        Io_out('\n');
+        assert(Io_buffered == 2);
+        Io_set_mode(IO_INTERACTIVE);
+        Io_out('b');
+        assert(Io_buffered == 3);
+        Io_out('\n');
+        assert(Io_buffered == 0);
+
+        Io_set_mode(IO_THROUGHPUT);
+        for (int i = 0; i < IO_BUFFER_BYTES - 1; i++) {
+                Io_out('c');
+        }
+        assert(Io_buffered == IO_BUFFER_BYTES - 1);
+        Io_out('c');
+        assert(Io_buffered == 0);
+        Io_out('d');
+        Io_flush();
+        assert(Io_buffered == 0);
+
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        assert(fseek(file, 0, SEEK_END) == 0);
+        assert(ftell(file) == 4 + IO_BUFFER_BYTES + 1);
+        rewind(file);
+        char start[5] = { 0 };
+        assert(fread(start, 1, 4, file) == 4);
+        assert(strcmp(start, "a\nb\n") == 0);
+        fclose(file);
+}
+
+/* IN gives every byte as it is, 0 to 255, then all 1s at the end of input,
+ * however often it is asked */
+void check_input_buffered()
+{
+        /* Take stdin from a file for a while */
+        int saved = dup(STDIN_FILENO);
+        FILE *file = tmpfile();
+        assert(saved >= 0 && file != NULL);
+        const unsigned char bytes[] = { 'a', 0x00, 0x80, 0xff };
+        assert(fwrite(bytes, 1, sizeof(bytes), file) == sizeof(bytes));
+        rewind(file);
+        dup2(fileno(file), STDIN_FILENO);
+
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+                assert(Io_in() == bytes[i]);
+        }
+        assert(Io_in() == IO_END_OF_INPUT);
+        assert(Io_in() == 0xffffffff);
+
+        dup2(saved, STDIN_FILENO);
+        close(saved);
+        fclose(file);
+}
+
+/* Output to a mapped file grows it as needed and leaves it as long as what
+ * was output, and input from one gives it all back, then the end */
+void check_mapped_files()
+{
+        char path[] = "/tmp/unit_tests_io_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        /* More than the mapping starts out with */
+        const int bytes = 3 << 20;
+        assert(Io_open_output(path));
+        Io_set_mode(IO_INTERACTIVE);
+        for (int i = 0; i < bytes; i++) {
+                Io_out(i % 251);
+        }
+        Io_close();
+
+        assert(Io_open_input(path));
+        for (int i = 0; i < bytes; i++) {
+                assert(Io_in() == (uint32_t)(i % 251));
+        }
+        assert(Io_in() == IO_END_OF_INPUT);
+        assert(Io_in() == IO_END_OF_INPUT);
+        Io_close();
+
+        /* An empty file is only the end of input */
+        assert(Io_open_output(path));
+        Io_close();
+        assert(Io_open_input(path));
+        assert(Io_in() == IO_END_OF_INPUT);
+        Io_close();
+
+        unlink(path);
+        assert(!Io_open_input(path));
+}
+
+/* With Io_stop_at_end the end of input stops the machine, and once a stop
+ * is requested the next wait for input does without reading */
+void check_input_stops()
+{
+        char path[] = "/tmp/unit_tests_io_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        assert(write(fd, "ab", 2) == 2);
+        close(fd);
+
+        assert(Io_open_input(path));
+        Io_stop_at_end = true;
+        assert(Io_in() == 'a');
+        assert(Io_in() == 'b');
+        assert(!Io_stopped);
+        assert(Io_in() == IO_END_OF_INPUT);
+        assert(Io_stopped);
+        Io_close();
+        Io_stop_at_end = false;
+        Io_stopped = false;
+
+        Io_stop_requested = 1;
+        assert(Io_in() == IO_END_OF_INPUT);
+        assert(Io_stopped);
+        Io_stop_requested = 0;
+        Io_stopped = false;
+
+        unlink(path);
+}
+
 /* Make sure the opcode returned is right */
 void check_decode_opcode() {
         unsigned rA, rB, rC, loadval_rA;
@@ -684,4 +1733,159 @@ void check_decode_load_val() {
         assert(loadval_rA == 8);
         assert(loadval_value == 0x1abcdef);
         return;
-}
\ No newline at end of file
+}
+
+/* Check that stores into watched words of segment 0 are reported once, and
+ * stores anywhere else aren't */
+void check_program_watch()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        /* Nothing watched */
+        SegMem_put_word(mem, 0, 0, 0x30000053);
+        assert(!SegMem_watch_hit(mem));
+
+        /* Watch word 1 of add.um only */
+        uint8_t watched[3] = { 0, 1, 0 };
+        SegMem_watch_program(mem, watched);
+        SegMem_put_word(mem, 0, 0, 0x30000053);
+        assert(!SegMem_watch_hit(mem));
+
+        uint32_t segid = SegMem_map(mem, 2);
+        SegMem_put_word(mem, segid, 1, 0x70000000);
+        assert(!SegMem_watch_hit(mem));
+
+        /* Reported once, even for the same word stored again */
+        SegMem_put_word(mem, 0, 1, 0x70000000);
+        assert(SegMem_watch_hit(mem));
+        assert(!SegMem_watch_hit(mem));
+
+        /* Loading another program stops the watching */
+        SegMem_load_program(mem, segid, 0);
+        SegMem_put_word(mem, 0, 1, 0x70000000);
+        assert(!SegMem_watch_hit(mem));
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* Check that LOADPs to a target just loaded by an LV become direct jumps
+ * only while that target is inside the program, and that stores changing
+ * the LVs are noticed */
+void check_program_direct_jump()
+{
+        /* Open the file passed in and check it */
+        FILE *input = fopen("add.um", "r"); 
+        assert(input != NULL);
+
+        /* Pass it to memory as the initial program */
+        SegMem_T mem = SegMem_new(input);
+
+        /* Close the file */
+        fclose(input); 
+
+        /* LV r1 0, LV r2 1, LOADP r1 r2 */
+        uint32_t segid = SegMem_map(mem, 3);
+        SegMem_put_word(mem, segid, 0, 0xd2000000);
+        SegMem_put_word(mem, segid, 1, 0xd4000001);
+        SegMem_put_word(mem, segid, 2, 0xc000000a);
+        SegMem_load_program(mem, segid, 0);
+
+        word_t length;
+        const Um_instr *program = SegMem_program(mem, &length);
+        assert(length == 3);
+        assert(program[0].handler == FUSED_JUMP);
+        assert(program[1].handler == FUSED_LV_JUMP);
+
+        /* LV r2 3: jumps to the end of the program, so it isn't direct */
+        SegMem_put_word(mem, 0, 1, 0xd4000003);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == FUSED_LV_LV_LOADP);
+        assert(program[1].handler == FUSED_LV_LOADP);
+
+        /* LV r2 2 is in the program again */
+        SegMem_put_word(mem, 0, 1, 0xd4000002);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == FUSED_JUMP);
+
+        /* LV r1 1: the segment isn't 0 any more, but the target still is
+         * known for the LV, LOADP */
+        SegMem_put_word(mem, 0, 0, 0xd2000001);
+        program = SegMem_program(mem, &length);
+        assert(program[0].handler == FUSED_LV_LV_LOADP);
+        assert(program[1].handler == FUSED_LV_JUMP);
+
+        /* LOADP r2 r2: target and segment are the same register */
+        SegMem_put_word(mem, 0, 2, 0xc0000012);
+        program = SegMem_program(mem, &length);
+        assert(program[1].handler == FUSED_LV_LOADP);
+
+        /* Free the memory with the destructor */
+        SegMem_free(&mem);
+
+        /* Check that destructor set the variable to NULL */
+        assert(mem == NULL);
+}
+
+/* An invalid instruction under the JIT ends the run in every build (with
+ * NDEBUG it used to run the same instruction forever): the output so far is
+ * written and the process exits with EXIT_FAILURE. Running off the end of
+ * segment 0, here an empty one, is the same. An alarm kills a child which
+ * doesn't stop */
+void check_jit_invalid_ends_run()
+{
+        if (!Jit_supported) {
+                return;
+        }
+
+        /* LV r1 'h', OUT r1, then opcode 14 */
+        const unsigned char program[] = {
+                0xD2, 0x00, 0x00, 'h', 0xA0, 0x00, 0x00, 0x01,
+                0xE0, 0x00, 0x00, 0x00
+        };
+        size_t lengths[] = { sizeof(program), 0 };
+        const char *outputs[] = { "h", "" };
+
+        for (int k = 0; k < 2; k++) {
+                FILE *file = tmpfile();
+                assert(file != NULL);
+                fwrite(program, 1, lengths[k], file);
+                rewind(file);
+                int ends[2];
+                assert(pipe(ends) == 0);
+
+                pid_t child = fork();
+                assert(child >= 0);
+                if (child == 0) {
+                        alarm(10);
+                        dup2(ends[1], STDOUT_FILENO);
+                        dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+                        SegMem_T mem = SegMem_new(file);
+                        Registers_T regs = Registers_new(8);
+                        Jit_run(mem, regs);
+                        _exit(EXIT_SUCCESS);
+                }
+                close(ends[1]);
+                char output[8];
+                ssize_t got = read(ends[0], output, sizeof(output));
+                close(ends[0]);
+                int status;
+                assert(waitpid(child, &status, 0) == child);
+                assert(WIFEXITED(status));
+                assert(WEXITSTATUS(status) == EXIT_FAILURE);
+                assert(got == (ssize_t)strlen(outputs[k]));
+                assert(memcmp(output, outputs[k], got) == 0);
+                fclose(file);
+        }
+}